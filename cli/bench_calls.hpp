@@ -0,0 +1,270 @@
+/**************************************************************************
+ *
+ * Copyright 2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Synthetic mix of GL-like calls, shared by the benchmarks.
+ */
+
+#ifndef _BENCH_CALLS_HPP_
+#define _BENCH_CALLS_HPP_
+
+
+#include "trace_model.hpp"
+
+
+namespace bench {
+
+
+static const trace::EnumValue glenum_values[] = {
+    {"GL_NO_ERROR", 0},
+    {"GL_TRIANGLES", 0x0004},
+    {"GL_DEPTH_TEST", 0x0B71},
+    {"GL_TEXTURE_2D", 0x0DE1},
+    {"GL_UNSIGNED_SHORT", 0x1403},
+    {"GL_FLOAT", 0x1406},
+    {"GL_ARRAY_BUFFER", 0x8892},
+};
+
+static const trace::EnumSig glenum_sig = {
+    1, sizeof glenum_values / sizeof glenum_values[0], glenum_values
+};
+
+
+static const char *glUniform4f_args[] = {"location", "v0", "v1", "v2", "v3"};
+static const char *glBindTexture_args[] = {"target", "texture"};
+static const char *glVertexAttribPointer_args[] = {"index", "size", "type", "normalized", "stride", "pointer"};
+static const char *glDrawElements_args[] = {"mode", "count", "type", "indices"};
+static const char *glUniformMatrix4fv_args[] = {"location", "count", "transpose", "value"};
+static const char *glBufferSubData_args[] = {"target", "offset", "size", "data"};
+static const char *glEnable_args[] = {"cap"};
+static const char *glXSwapBuffers_args[] = {"dpy", "drawable"};
+
+enum {
+    GL_UNIFORM_4F,
+    GL_BIND_TEXTURE,
+    GL_VERTEX_ATTRIB_POINTER,
+    GL_DRAW_ELEMENTS,
+    GL_GET_ERROR,
+    GL_UNIFORM_MATRIX_4FV,
+    GL_BUFFER_SUB_DATA,
+    GL_ENABLE,
+    GLX_SWAP_BUFFERS,
+    NUM_SIGS
+};
+
+static const trace::FunctionSig function_sigs[NUM_SIGS] = {
+    {0, "glUniform4f", 5, glUniform4f_args},
+    {1, "glBindTexture", 2, glBindTexture_args},
+    {2, "glVertexAttribPointer", 6, glVertexAttribPointer_args},
+    {3, "glDrawElements", 4, glDrawElements_args},
+    {4, "glGetError", 0, NULL},
+    {5, "glUniformMatrix4fv", 4, glUniformMatrix4fv_args},
+    {6, "glBufferSubData", 4, glBufferSubData_args},
+    {7, "glEnable", 1, glEnable_args},
+    {8, "glXSwapBuffers", 2, glXSwapBuffers_args},
+};
+
+
+/**
+ * Roughly what a GL application calls per draw: mostly small calls with a
+ * few scalar arguments, some arrays, and the occasional buffer upload, with
+ * a frame ending every FRAME_CALLS calls.
+ *
+ * Entering and leaving is left to the caller, as the writers differ there,
+ * e.g.:
+ *
+ *   unsigned call = writer.beginEnter(mix.sig(i), 0);
+ *   mix.writeArgs(writer, i);
+ *   writer.endEnter();
+ *   writer.beginLeave(call);
+ *   mix.writeRet(writer, i);
+ *   writer.endLeave();
+ */
+class CallMix
+{
+public:
+    enum {
+        FRAME_CALLS = 1000,
+        MAX_BLOB_SIZE = 64 << 6
+    };
+
+    CallMix() {
+        for (unsigned i = 0; i < sizeof m_blob; ++i) {
+            m_blob[i] = (unsigned char)(i * 2654435761U >> 24);
+        }
+    }
+
+    const trace::FunctionSig *
+    sig(unsigned i) const {
+        if (i % FRAME_CALLS == FRAME_CALLS - 1) {
+            return &function_sigs[GLX_SWAP_BUFFERS];
+        }
+        static const unsigned char draw[] = {
+            GL_ENABLE,
+            GL_BIND_TEXTURE,
+            GL_UNIFORM_4F,
+            GL_UNIFORM_MATRIX_4FV,
+            GL_UNIFORM_4F,
+            GL_BUFFER_SUB_DATA,
+            GL_VERTEX_ATTRIB_POINTER,
+            GL_VERTEX_ATTRIB_POINTER,
+            GL_DRAW_ELEMENTS,
+            GL_GET_ERROR,
+        };
+        return &function_sigs[draw[i % sizeof draw]];
+    }
+
+    template< class Writer >
+    void
+    writeArgs(Writer &writer, unsigned i) const {
+        switch (sig(i)->id) {
+        case GL_UNIFORM_4F:
+            writer.beginArg(0);
+            writer.writeSInt(i % 16);
+            writer.endArg();
+            for (unsigned j = 1; j < 5; ++j) {
+                writer.beginArg(j);
+                writer.writeFloat(i * 0.25f + j);
+                writer.endArg();
+            }
+            break;
+        case GL_BIND_TEXTURE:
+            writer.beginArg(0);
+            writer.writeEnum(&glenum_sig, 0x0DE1);
+            writer.endArg();
+            writer.beginArg(1);
+            writer.writeUInt(1 + i % 64);
+            writer.endArg();
+            break;
+        case GL_VERTEX_ATTRIB_POINTER:
+            writer.beginArg(0);
+            writer.writeUInt(i % 4);
+            writer.endArg();
+            writer.beginArg(1);
+            writer.writeSInt(3);
+            writer.endArg();
+            writer.beginArg(2);
+            writer.writeEnum(&glenum_sig, 0x1406);
+            writer.endArg();
+            writer.beginArg(3);
+            writer.writeBool(false);
+            writer.endArg();
+            writer.beginArg(4);
+            writer.writeSInt(32);
+            writer.endArg();
+            writer.beginArg(5);
+            writer.writePointer(16 * (i % 4));
+            writer.endArg();
+            break;
+        case GL_DRAW_ELEMENTS:
+            writer.beginArg(0);
+            writer.writeEnum(&glenum_sig, 0x0004);
+            writer.endArg();
+            writer.beginArg(1);
+            writer.writeSInt(3 * (1 + i % 1024));
+            writer.endArg();
+            writer.beginArg(2);
+            writer.writeEnum(&glenum_sig, 0x1403);
+            writer.endArg();
+            writer.beginArg(3);
+            writer.writePointer(0);
+            writer.endArg();
+            break;
+        case GL_GET_ERROR:
+            break;
+        case GL_UNIFORM_MATRIX_4FV:
+            writer.beginArg(0);
+            writer.writeSInt(i % 16);
+            writer.endArg();
+            writer.beginArg(1);
+            writer.writeSInt(1);
+            writer.endArg();
+            writer.beginArg(2);
+            writer.writeBool(false);
+            writer.endArg();
+            writer.beginArg(3);
+            writer.beginArray(16);
+            for (unsigned j = 0; j < 16; ++j) {
+                writer.beginElement();
+                writer.writeFloat(j % 5 == 0 ? 1.0f : i * 0.001f);
+                writer.endElement();
+            }
+            writer.endArray();
+            writer.endArg();
+            break;
+        case GL_BUFFER_SUB_DATA:
+            {
+                size_t size = 64 << (i % 7);
+                // Vary the contents, so that blobs are rarely repeated
+                size_t offset = i % (sizeof m_blob - size + 1);
+                writer.beginArg(0);
+                writer.writeEnum(&glenum_sig, 0x8892);
+                writer.endArg();
+                writer.beginArg(1);
+                writer.writeSInt(offset);
+                writer.endArg();
+                writer.beginArg(2);
+                writer.writeSInt(size);
+                writer.endArg();
+                writer.beginArg(3);
+                writer.writeBlob(m_blob + offset, size);
+                writer.endArg();
+            }
+            break;
+        case GL_ENABLE:
+            writer.beginArg(0);
+            writer.writeEnum(&glenum_sig, 0x0B71);
+            writer.endArg();
+            break;
+        case GLX_SWAP_BUFFERS:
+            writer.beginArg(0);
+            writer.writePointer(0x1000);
+            writer.endArg();
+            writer.beginArg(1);
+            writer.writeUInt(0x2000);
+            writer.endArg();
+            break;
+        }
+    }
+
+    template< class Writer >
+    void
+    writeRet(Writer &writer, unsigned i) const {
+        if (sig(i)->id == GL_GET_ERROR) {
+            writer.beginReturn();
+            writer.writeEnum(&glenum_sig, 0);
+            writer.endReturn();
+        }
+    }
+
+private:
+    unsigned char m_blob[2 * MAX_BLOB_SIZE];
+};
+
+
+} /* namespace bench */
+
+
+#endif /* _BENCH_CALLS_HPP_ */
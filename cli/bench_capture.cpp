@@ -0,0 +1,239 @@
+/**************************************************************************
+ *
+ * Copyright 2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Capture overhead benchmark.
+ *
+ * Traces a synthetic mix of GL-like calls the way the wrappers do, and
+ * reports the time spent tracing each call, both through trace::Writer
+ * alone and through the trace::LocalWriter used by the wrappers.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+
+#include <iostream>
+#include <vector>
+
+#include "os_process.hpp"
+#include "os_thread.hpp"
+#include "os_time.hpp"
+#include "trace_file.hpp"
+#include "trace_writer.hpp"
+#include "trace_writer_local.hpp"
+
+#include "bench_calls.hpp"
+
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: bench_capture [OPTIONS]\n"
+        << "Measure the overhead of tracing calls.\n"
+        << "\n"
+        << "The calls traced through trace::Writer are written to\n"
+        << "bench_capture.trace, which is removed afterwards.  The ones traced\n"
+        << "through trace::LocalWriter go to TRACE_FILE, or bench_capture.local.trace,\n"
+        << "which is finished when exiting, and kept.\n"
+        << "\n"
+        << "    -h, --help           show this help message and exit\n"
+        << "    -n, --calls=N        number of calls [default: 1000000]\n"
+        << "    -t, --threads=N      trace through LocalWriter from N threads [default: 1]\n"
+        << "    --codec=CODEC        snappy, zstd, lz4, or gzip [default: snappy]\n"
+        << "\n";
+}
+
+enum {
+    CODEC_OPT = CHAR_MAX + 1,
+};
+
+const static char *
+shortOptions = "hn:t:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"calls", required_argument, 0, 'n'},
+    {"threads", required_argument, 0, 't'},
+    {"codec", required_argument, 0, CODEC_OPT},
+    {0, 0, 0, 0}
+};
+
+
+static const bench::CallMix mix;
+
+
+/**
+ * Time to trace the calls through a trace::Writer, including closing it.
+ */
+static long long
+captureWriter(const char *filename, const char *codec, unsigned numCalls)
+{
+    trace::File *file = trace::File::createForCodec(codec);
+    if (!file) {
+        return -1;
+    }
+
+    trace::Writer writer;
+    writer.setFile(file);
+    if (!writer.open(filename)) {
+        std::cerr << "error: could not open " << filename << " for writing\n";
+        return -1;
+    }
+
+    long long start = os::getTime();
+    for (unsigned i = 0; i < numCalls; ++i) {
+        unsigned call = writer.beginEnter(mix.sig(i), 0);
+        mix.writeArgs(writer, i);
+        writer.endEnter();
+        writer.beginLeave(call);
+        mix.writeRet(writer, i);
+        writer.endLeave();
+    }
+    writer.close();
+    return os::getTime() - start;
+}
+
+
+struct CaptureRange {
+    unsigned start;
+    unsigned end;
+    os::thread thread;
+};
+
+
+/**
+ * Traces a range of the calls through trace::localWriter, as the code
+ * generated by wrappers/trace.py does.
+ */
+static void *
+captureLocal(CaptureRange *range)
+{
+    for (unsigned i = range->start; i < range->end; ++i) {
+        const trace::FunctionSig *sig = mix.sig(i);
+        bool filtered = trace::localWriter.isFiltered(sig);
+        unsigned call = filtered ? 0 : trace::localWriter.beginEnter(sig);
+        if (!filtered) {
+            mix.writeArgs(trace::localWriter, i);
+            trace::localWriter.endEnter();
+            trace::localWriter.beginLeave(call);
+            mix.writeRet(trace::localWriter, i);
+            trace::localWriter.endLeave();
+        }
+    }
+    return NULL;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    unsigned numCalls = 1000000;
+    unsigned numThreads = 1;
+    const char *codec = "snappy";
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'n':
+            numCalls = atoi(optarg);
+            break;
+        case 't':
+            numThreads = atoi(optarg);
+            break;
+        case CODEC_OPT:
+            codec = optarg;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind != argc) {
+        std::cerr << "error: unexpected argument `" << argv[optind] << "`\n";
+        usage();
+        return 1;
+    }
+    if (!numCalls || !numThreads) {
+        std::cerr << "error: nothing to trace\n";
+        return 1;
+    }
+
+    const char *filename = "bench_capture.trace";
+    long long elapsed = captureWriter(filename, codec, numCalls);
+    remove(filename);
+    if (elapsed < 0) {
+        return 1;
+    }
+
+    printf("%u calls, %s\n", numCalls, codec);
+    printf("%-12s %10s %10s\n", "writer", "threads", "ns/call");
+    printf("%-12s %10u %10.1f\n", "Writer", 1u,
+           elapsed * (1e9 / os::timeFrequency) / numCalls);
+
+    /*
+     * The local writer opens on the first call, and finishes the trace once
+     * the process exits, so merging what is left by then is not timed.
+     */
+    if (!getenv("TRACE_FILE")) {
+        os::setEnvironment("TRACE_FILE", "bench_capture.local.trace");
+    }
+    os::setEnvironment("APITRACE_CODEC", codec);
+
+    std::vector<CaptureRange> ranges(numThreads);
+    for (unsigned t = 0; t < numThreads; ++t) {
+        ranges[t].start = (unsigned long long)numCalls * t / numThreads;
+        ranges[t].end = (unsigned long long)numCalls * (t + 1) / numThreads;
+    }
+
+    long long start = os::getTime();
+    if (numThreads == 1) {
+        captureLocal(&ranges[0]);
+    } else {
+        for (unsigned t = 0; t < numThreads; ++t) {
+            ranges[t].thread = os::thread(captureLocal, &ranges[t]);
+        }
+        for (unsigned t = 0; t < numThreads; ++t) {
+            ranges[t].thread.join();
+        }
+    }
+    elapsed = os::getTime() - start;
+
+    // Time each thread spent per call, as threads trace concurrently
+    printf("%-12s %10u %10.1f\n", "LocalWriter", numThreads,
+           elapsed * (1e9 / os::timeFrequency) * numThreads / numCalls);
+
+    return 0;
+}
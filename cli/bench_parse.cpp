@@ -0,0 +1,306 @@
+/**************************************************************************
+ *
+ * Copyright 2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Parser throughput benchmark.
+ *
+ * Writes a synthetic trace of GL-like calls, or takes an existing one, and
+ * times reading it back in each of the parser's modes, reporting the
+ * uncompressed bytes parsed per second.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+
+#include <iostream>
+
+#include "os_time.hpp"
+#include "trace_file.hpp"
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
+
+#include "bench_calls.hpp"
+
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: bench_parse [OPTIONS] [TRACE]\n"
+        << "Measure how fast traces are parsed.\n"
+        << "\n"
+        << "Without a trace, one of synthetic GL-like calls is written to\n"
+        << "bench_parse.trace and removed afterwards.  To measure other codecs,\n"
+        << "keep it and repack it.\n"
+        << "\n"
+        << "    -h, --help           show this help message and exit\n"
+        << "    -n, --calls=N        number of synthetic calls [default: 1000000]\n"
+        << "    -r, --repeat=N       time the best of N passes [default: 3]\n"
+        << "    --keep               keep the synthetic trace\n"
+        << "\n";
+}
+
+enum {
+    KEEP_OPT = CHAR_MAX + 1,
+};
+
+const static char *
+shortOptions = "hn:r:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"calls", required_argument, 0, 'n'},
+    {"repeat", required_argument, 0, 'r'},
+    {"keep", no_argument, 0, KEEP_OPT},
+    {0, 0, 0, 0}
+};
+
+
+static bool
+writeTrace(const char *filename, unsigned numCalls)
+{
+    trace::Writer writer;
+    if (!writer.open(filename)) {
+        std::cerr << "error: could not open " << filename << " for writing\n";
+        return false;
+    }
+
+    bench::CallMix mix;
+    for (unsigned i = 0; i < numCalls; ++i) {
+        unsigned call = writer.beginEnter(mix.sig(i), 0);
+        mix.writeArgs(writer, i);
+        writer.endEnter();
+        writer.beginLeave(call);
+        mix.writeRet(writer, i);
+        writer.endLeave();
+    }
+
+    writer.close();
+    return true;
+}
+
+
+enum Mode {
+    MODE_READ,
+    MODE_PARSE,
+    MODE_LAZY,
+    MODE_SCAN,
+    MODE_EVENT,
+    NUM_MODES
+};
+
+static const char *modeNames[NUM_MODES] = {
+    "read",
+    "parse_call",
+    "lazy_call",
+    "scan_call",
+    "parse_event",
+};
+
+
+/**
+ * Reads the uncompressed bytes only, as a baseline for the parser.
+ */
+static unsigned long long
+readTrace(const char *filename)
+{
+    trace::File *file = trace::File::createForRead(filename);
+    if (!file) {
+        return 0;
+    }
+
+    unsigned long long numBytes = 0;
+    size_t size = 1024 * 1024;
+    char *buf = new char[size];
+    size_t read;
+    while ((read = file->read(buf, size)) != 0) {
+        numBytes += read;
+    }
+    delete [] buf;
+    delete file;
+
+    return numBytes;
+}
+
+
+class CountingHandler : public trace::ParseHandler
+{
+public:
+    unsigned numCalls;
+
+    CountingHandler() :
+        numCalls(0)
+    {}
+
+    void onEnter(const trace::FunctionSig *sig, trace::CallFlags flags,
+                 unsigned thread_id, unsigned call_no) {
+        ++numCalls;
+    }
+};
+
+
+/**
+ * Parses the whole trace in the given mode, returning the number of calls.
+ */
+static unsigned
+parseTrace(const char *filename, Mode mode)
+{
+    trace::Parser p;
+    if (!p.open(filename)) {
+        std::cerr << "error: failed to open " << filename << "\n";
+        return 0;
+    }
+
+    unsigned numCalls = 0;
+    if (mode == MODE_EVENT) {
+        CountingHandler handler;
+        while (p.parse_event(handler)) {
+        }
+        numCalls = handler.numCalls;
+    } else {
+        trace::Call *call;
+        for (;;) {
+            switch (mode) {
+            case MODE_LAZY:
+                call = p.lazy_call();
+                break;
+            case MODE_SCAN:
+                call = p.scan_call();
+                break;
+            default:
+                call = p.parse_call();
+                break;
+            }
+            if (!call) {
+                break;
+            }
+            ++numCalls;
+            delete call;
+        }
+    }
+
+    p.close();
+    return numCalls;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    unsigned numCalls = 1000000;
+    unsigned repeat = 3;
+    bool keep = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'n':
+            numCalls = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case KEEP_OPT:
+            keep = true;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    const char *filename;
+    bool synthetic;
+    if (optind == argc) {
+        filename = "bench_parse.trace";
+        synthetic = true;
+        if (!writeTrace(filename, numCalls)) {
+            return 1;
+        }
+    } else if (optind + 1 == argc) {
+        filename = argv[optind];
+        synthetic = false;
+    } else {
+        std::cerr << "error: too many arguments\n";
+        usage();
+        return 1;
+    }
+
+    unsigned long long numBytes = readTrace(filename);
+    if (!numBytes) {
+        std::cerr << "error: failed to read " << filename << "\n";
+        return 1;
+    }
+
+    printf("%s: %.1f MB uncompressed\n", filename, numBytes / (1024.0 * 1024.0));
+    printf("%-12s %10s %10s %10s\n", "mode", "calls", "MB/s", "ns/call");
+
+    int ret = 0;
+    for (unsigned mode = 0; mode < NUM_MODES; ++mode) {
+        long long best = LLONG_MAX;
+        unsigned calls = 0;
+        for (unsigned pass = 0; pass < repeat; ++pass) {
+            long long start = os::getTime();
+            if (mode == MODE_READ) {
+                readTrace(filename);
+            } else {
+                calls = parseTrace(filename, (Mode)mode);
+            }
+            long long elapsed = os::getTime() - start;
+            if (elapsed < best) {
+                best = elapsed;
+            }
+        }
+        if (mode != MODE_READ && !calls) {
+            ret = 1;
+            continue;
+        }
+
+        double seconds = (double)best / os::timeFrequency;
+        double throughput = numBytes / (1024.0 * 1024.0) / seconds;
+        if (mode == MODE_READ) {
+            printf("%-12s %10s %10.1f %10s\n", modeNames[mode], "-",
+                   throughput, "-");
+        } else {
+            printf("%-12s %10u %10.1f %10.1f\n", modeNames[mode], calls,
+                   throughput, seconds * 1e9 / calls);
+        }
+    }
+
+    if (synthetic && !keep) {
+        remove(filename);
+    }
+
+    return ret;
+}
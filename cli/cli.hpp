@@ -40,6 +40,7 @@ struct Command {
     Function function;
 };
 
+extern const Command collect_command;
 extern const Command diff_command;
 extern const Command diff_state_command;
 extern const Command diff_images_command;
@@ -48,6 +49,8 @@ extern const Command dump_images_command;
 extern const Command pickle_command;
 extern const Command repack_command;
 extern const Command retrace_command;
+extern const Command symbolize_command;
+extern const Command timeline_command;
 extern const Command trace_command;
 extern const Command trim_command;
 
@@ -0,0 +1,271 @@
+/**************************************************************************
+ *
+ * Copyright 2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h> // for CHAR_MAX
+#include <getopt.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "cli.hpp"
+
+#include "os_stream.hpp"
+#include "os_string.hpp"
+#include "os_thread.hpp"
+#include "os_time.hpp"
+
+#include "trace_file.hpp"
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
+
+
+static const char *synopsis = "Collect traces from processes writing to shared memory.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace collect [OPTIONS] NAME\n"
+        << synopsis << "\n"
+        "\n"
+        "Processes traced with TRACE_FILE=shm:NAME write their calls uncompressed\n"
+        "into a ring in shared memory, and leave compressing, indexing and writing\n"
+        "to disk to this command, which writes one PREFIX.PID.trace per process.\n"
+        "Start it before the traced processes, and interrupt it once they are done.\n"
+        "\n"
+        "    -h, --help           show this help message and exit\n"
+        "    -o, --output=PREFIX  prefix of the written traces [default: NAME]\n"
+        "    --codec=CODEC        snappy, zstd, lz4, or gzip [default: snappy]\n"
+        "    --slots=N            processes traced at once [default: 16]\n"
+        "    --size=MB            ring size of each process [default: 16]\n"
+        "    --policy=POLICY      when a ring is full, either block the process, or\n"
+        "                         truncate its trace [default: block]\n"
+        "\n"
+    ;
+}
+
+enum {
+    CODEC_OPT = CHAR_MAX + 1,
+    SLOTS_OPT,
+    SIZE_OPT,
+    POLICY_OPT,
+};
+
+const static char *
+shortOptions = "ho:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"output", required_argument, 0, 'o'},
+    {"codec", required_argument, 0, CODEC_OPT},
+    {"slots", required_argument, 0, SLOTS_OPT},
+    {"size", required_argument, 0, SIZE_OPT},
+    {"policy", required_argument, 0, POLICY_OPT},
+    {0, 0, 0, 0}
+};
+
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void
+onInterrupt(int sig)
+{
+    interrupted = 1;
+}
+
+
+static os::mutex outputMutex;
+
+struct Collection {
+    std::string inFileName;
+    std::string outFileName;
+    const char *codec;
+    os::thread thread;
+};
+
+/**
+ * Compress, index and write a process' calls as they arrive, like
+ * `apitrace repack --dedup` does.
+ */
+static void *
+collectThread(Collection *collection)
+{
+    trace::Parser parser;
+    if (!parser.open(collection->inFileName.c_str())) {
+        os::unique_lock<os::mutex> lock(outputMutex);
+        std::cerr << "error: failed to open " << collection->inFileName << "\n";
+        return NULL;
+    }
+    // Calls are written out and deleted right away
+    parser.setZeroCopyBlobs(true);
+
+    trace::File *outFile = trace::File::createForCodec(collection->codec);
+    if (!outFile) {
+        return NULL;
+    }
+
+    // The writer deletes outFile, also when failing to open it
+    trace::Writer writer;
+    writer.setFile(outFile);
+    writer.setProperties(parser.getProperties());
+    if (!writer.open(collection->outFileName.c_str())) {
+        os::unique_lock<os::mutex> lock(outputMutex);
+        std::cerr << "error: could not open " << collection->outFileName << " for writing\n";
+        return NULL;
+    }
+
+    trace::Call *call;
+    while ((call = parser.parse_call())) {
+        writer.writeCall(call);
+        delete call;
+    }
+    writer.close();
+
+    os::unique_lock<os::mutex> lock(outputMutex);
+    std::cerr << "Collected " << collection->outFileName << "\n";
+    return NULL;
+}
+
+static int
+command(int argc, char *argv[])
+{
+    std::string prefix;
+    const char *codec = "snappy";
+    unsigned numSlots = 16;
+    size_t ringSize = 16;
+    bool truncate = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'o':
+            prefix = optarg;
+            break;
+        case CODEC_OPT:
+            codec = optarg;
+            break;
+        case SLOTS_OPT:
+            numSlots = atoi(optarg);
+            break;
+        case SIZE_OPT:
+            ringSize = atoi(optarg);
+            break;
+        case POLICY_OPT:
+            if (strcmp(optarg, "block") == 0) {
+                truncate = false;
+            } else if (strcmp(optarg, "truncate") == 0) {
+                truncate = true;
+            } else {
+                std::cerr << "error: unknown policy `" << optarg << "`\n";
+                usage();
+                return 1;
+            }
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc != optind + 1) {
+        std::cerr << "error: one shared memory name must be specified\n";
+        usage();
+        return 1;
+    }
+
+    std::string name = argv[optind];
+    if (name.compare(0, 4, "shm:") == 0) {
+        name = name.substr(4);
+    }
+    if (prefix.empty()) {
+        os::String base(name.c_str());
+        base.trimDirectory();
+        prefix = base.str();
+    }
+    if (!numSlots || !ringSize) {
+        std::cerr << "error: slots and size must not be zero\n";
+        return 1;
+    }
+
+    // Check the codec before any process depends on us
+    trace::File *file = trace::File::createForCodec(codec);
+    if (!file) {
+        return 1;
+    }
+    delete file;
+
+    os::ShmCollector collector;
+    if (!collector.create(name.c_str(), numSlots, ringSize * 1024 * 1024, truncate)) {
+        return 1;
+    }
+
+    signal(SIGINT, onInterrupt);
+    signal(SIGTERM, onInterrupt);
+
+    std::cerr << "Collecting traces written to shm:" << name << "\n";
+
+    std::vector<Collection *> collections;
+    while (!interrupted) {
+        unsigned slot;
+        int pid;
+        if (!collector.accept(slot, pid)) {
+            os::sleep(10000);
+            continue;
+        }
+
+        Collection *collection = new Collection;
+        collection->inFileName = os::String::format("shm:%s@%u", name.c_str(), slot).str();
+        collection->outFileName = os::String::format("%s.%i.trace", prefix.c_str(), pid).str();
+        collection->codec = codec;
+        collection->thread = os::thread(collectThread, collection);
+        collections.push_back(collection);
+    }
+
+    // Let readers drain what was already written
+    collector.stop();
+    for (size_t i = 0; i < collections.size(); ++i) {
+        collections[i]->thread.join();
+        delete collections[i];
+    }
+
+    return 0;
+}
+
+const Command collect_command = {
+    "collect",
+    synopsis,
+    usage,
+    command
+};
@@ -25,6 +25,7 @@
  **************************************************************************/
 
 
+#include <stdio.h>
 #include <string.h>
 #include <limits.h> // for CHAR_MAX
 #include <getopt.h>
@@ -53,6 +54,44 @@ static bool verbose = false;
 
 static trace::CallSet calls(trace::FREQUENCY_ALL);
 
+
+/*
+ * Dumps the calls asked for, preceded by their thread ids and times if
+ * asked to.
+ */
+class CallDumper : public trace::EventDumper
+{
+protected:
+    bool dumpThreadIds;
+    bool dumpTimes;
+
+public:
+    CallDumper(trace::DumpFlags dumpFlags, bool _dumpThreadIds, bool _dumpTimes) :
+        trace::EventDumper(std::cout, dumpFlags),
+        dumpThreadIds(_dumpThreadIds),
+        dumpTimes(_dumpTimes)
+    {}
+
+protected:
+    bool beginCall(const CallInfo &call) {
+        if (!calls.contains(call.no, call.flags) ||
+            (!verbose && (call.flags & trace::CALL_FLAG_VERBOSE))) {
+            return false;
+        }
+        if (dumpThreadIds) {
+            std::cout << std::hex << call.thread_id << std::dec << " ";
+        }
+        if (dumpTimes && call.timed) {
+            // In microseconds
+            char buf[64];
+            snprintf(buf, sizeof buf, "@%.3f +%.3f ",
+                     call.enter_time * 1e-3, call.duration * 1e-3);
+            std::cout << buf;
+        }
+        return true;
+    }
+};
+
 static const char *synopsis = "Dump given trace(s) to standard output.";
 
 static void
@@ -69,6 +108,8 @@ usage(void)
         "    --colour[=WHEN]      colored syntax highlighting\n"
         "                         WHEN is 'auto', 'always', or 'never'\n"
         "    --thread-ids=[=BOOL] dump thread ids [default: no]\n"
+        "    --times[=BOOL]       dump when calls were made and how long they took,\n"
+        "                         if recorded with APITRACE_TIMING=1 [default: no]\n"
         "    --call-nos[=BOOL]    dump call numbers[default: yes]\n"
         "    --arg-names[=BOOL]   dump argument names [default: yes]\n"
         "\n"
@@ -79,6 +120,7 @@ enum {
 	CALLS_OPT = CHAR_MAX + 1,
 	COLOR_OPT,
     THREAD_IDS_OPT,
+    TIMES_OPT,
     CALL_NOS_OPT,
     ARG_NAMES_OPT,
 };
@@ -94,6 +136,7 @@ longOptions[] = {
     {"colour", optional_argument, 0, COLOR_OPT},
     {"color", optional_argument, 0, COLOR_OPT},
     {"thread-ids", optional_argument, 0, THREAD_IDS_OPT},
+    {"times", optional_argument, 0, TIMES_OPT},
     {"call-nos", optional_argument, 0, CALL_NOS_OPT},
     {"arg-names", optional_argument, 0, ARG_NAMES_OPT},
     {0, 0, 0, 0}
@@ -104,6 +147,7 @@ command(int argc, char *argv[])
 {
     trace::DumpFlags dumpFlags = 0;
     bool dumpThreadIds = false;
+    bool dumpTimes = false;
     
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
@@ -133,6 +177,9 @@ command(int argc, char *argv[])
         case THREAD_IDS_OPT:
             dumpThreadIds = trace::boolOption(optarg);
             break;
+        case TIMES_OPT:
+            dumpTimes = trace::boolOption(optarg);
+            break;
         case CALL_NOS_OPT:
             if (trace::boolOption(optarg)) {
                 dumpFlags &= ~trace::DUMP_FLAG_NO_CALL_NO;
@@ -174,19 +221,28 @@ command(int argc, char *argv[])
             return 1;
         }
 
-        trace::Call *call;
-        while ((call = p.parse_call())) {
-            if (calls.contains(*call)) {
-                if (verbose ||
-                    !(call->flags & trace::CALL_FLAG_VERBOSE)) {
-                    if (dumpThreadIds) {
-                        std::cout << std::hex << call->thread_id << std::dec << " ";
-                    }
-                    trace::dump(*call, std::cout, dumpFlags);
-                }
+        if (verbose) {
+            const trace::Properties &properties = p.getProperties();
+            for (trace::Properties::const_iterator it = properties.begin();
+                 it != properties.end(); ++it) {
+                std::cout << "// " << it->first << " = " << it->second << "\n";
             }
-            delete call;
         }
+
+        // Skip straight to the first call of interest, if the trace has an
+        // index.
+        trace::ParseBookmark bookmark;
+        if (calls.getFirst() > 0 &&
+            p.loadIndex() &&
+            p.findCallBookmark(calls.getFirst(), bookmark)) {
+            p.setBookmark(bookmark);
+        }
+
+        // Calls are dumped straight from the events, without building them
+        CallDumper dumper(dumpFlags, dumpThreadIds, dumpTimes);
+        while (p.parse_event(dumper)) {
+        }
+        dumper.finish();
     }
 
     return 0;
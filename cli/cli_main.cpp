@@ -66,6 +66,7 @@ const Command help_command = {
 };
 
 static const Command * commands[] = {
+    &collect_command,
     &diff_command,
     &diff_state_command,
     &diff_images_command,
@@ -74,6 +75,8 @@ static const Command * commands[] = {
     &pickle_command,
     &repack_command,
     &retrace_command,
+    &symbolize_command,
+    &timeline_command,
     &trace_command,
     &trim_command,
     &help_command
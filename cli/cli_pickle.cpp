@@ -168,6 +168,7 @@ public:
         writer.writeString(call->name());
 
         writer.beginList();
+        call->decodeArgs();
         for (unsigned i = 0; i < call->args.size(); ++i) {
             if (call->args[i].value) {
                 _visit(call->args[i].value);
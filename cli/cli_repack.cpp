@@ -24,7 +24,9 @@
  **************************************************************************/
 
 
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h> // for CHAR_MAX
 #include <getopt.h>
 
 #include <iostream>
@@ -32,46 +34,120 @@
 #include "cli.hpp"
 
 #include "trace_file.hpp"
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
 
 
-static const char *synopsis = "Repack a trace file with Snappy compression.";
+static const char *synopsis = "Repack a trace file with different compression.";
 
 static void
 usage(void)
 {
     std::cout
-        << "usage: apitrace repack <in-trace-file> <out-trace-file>\n"
+        << "usage: apitrace repack [OPTIONS] <in-trace-file> <out-trace-file>\n"
         << synopsis << "\n"
         << "\n"
         << "Snappy compression allows for faster replay and smaller memory footprint,\n"
-        << "at the expense of a slightly smaller compression ratio than zlib\n"
+        << "at the expense of a slightly smaller compression ratio than zlib.  Zstd\n"
+        << "compresses much better at a similar replay speed, and LZ4 replays faster.\n"
+        << "\n"
+        << "    -h, --help           show this help message and exit\n"
+        << "    -j, --jobs=N         compress with N threads [default: 1]\n"
+        << "    --codec=CODEC        snappy, zstd, lz4, or gzip [default: snappy]\n"
+        << "    --level=N            compression level, for zstd (1-22) and lz4 (1-12)\n"
+        << "    --dedup              rewrite the calls, replacing repeated blobs with\n"
+        << "                         references to the first one\n"
         << "\n";
 }
 
+enum {
+    CODEC_OPT = CHAR_MAX + 1,
+    LEVEL_OPT,
+    DEDUP_OPT,
+};
+
 const static char *
-shortOptions = "h";
+shortOptions = "hj:";
 
 const static struct option
 longOptions[] = {
     {"help", no_argument, 0, 'h'},
+    {"jobs", required_argument, 0, 'j'},
+    {"codec", required_argument, 0, CODEC_OPT},
+    {"level", required_argument, 0, LEVEL_OPT},
+    {"dedup", no_argument, 0, DEDUP_OPT},
     {0, 0, 0, 0}
 };
 
+/**
+ * Parse and write the calls again, rather than just the bytes, so that the
+ * writer can deduplicate blobs.
+ */
 static int
-repack(const char *inFileName, const char *outFileName)
+rewrite(const char *inFileName, const char *outFileName,
+        const char *codec, int level, unsigned jobs)
+{
+    trace::Parser parser;
+    if (!parser.open(inFileName)) {
+        std::cerr << "error: failed to open " << inFileName << "\n";
+        return 1;
+    }
+    // Calls are written out and deleted right away
+    parser.setZeroCopyBlobs(true);
+
+    trace::File *outFile = trace::File::createForCodec(codec);
+    if (!outFile) {
+        return 1;
+    }
+    if (level) {
+        outFile->setCompressionLevel(level);
+    }
+    outFile->setCompressionThreads(jobs);
+
+    trace::Writer writer;
+    writer.setFile(outFile);
+    writer.setProperties(parser.getProperties());
+    if (!writer.open(outFileName)) {
+        std::cerr << "error: could not open " << outFileName << " for writing\n";
+        return 1;
+    }
+
+    trace::Call *call;
+    while ((call = parser.parse_call())) {
+        writer.writeCall(call);
+        delete call;
+    }
+
+    return 0;
+}
+
+static int
+repack(const char *inFileName, const char *outFileName,
+       const char *codec, int level, unsigned jobs)
 {
     trace::File *inFile = trace::File::createForRead(inFileName);
     if (!inFile) {
         return 1;
     }
 
-    trace::File *outFile = trace::File::createForWrite(outFileName);
+    trace::File *outFile = trace::File::createForCodec(codec);
     if (!outFile) {
         delete inFile;
         return 1;
     }
+    if (level) {
+        outFile->setCompressionLevel(level);
+    }
+    outFile->setCompressionThreads(jobs);
+    if (!outFile->open(outFileName, trace::File::Write)) {
+        std::cerr << "error: could not open " << outFileName << " for writing\n";
+        delete outFile;
+        delete inFile;
+        return 1;
+    }
 
-    size_t size = 8192;
+    // Read a whole chunk at a time
+    size_t size = 1024 * 1024;
     char *buf = new char[size];
     size_t read;
 
@@ -89,12 +165,29 @@ repack(const char *inFileName, const char *outFileName)
 static int
 command(int argc, char *argv[])
 {
+    unsigned jobs = 1;
+    const char *codec = "snappy";
+    int level = 0;
+    bool dedup = false;
+
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
         switch (opt) {
         case 'h':
             usage();
             return 0;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case CODEC_OPT:
+            codec = optarg;
+            break;
+        case LEVEL_OPT:
+            level = atoi(optarg);
+            break;
+        case DEDUP_OPT:
+            dedup = true;
+            break;
         default:
             std::cerr << "error: unexpected option `" << opt << "`\n";
             usage();
@@ -108,7 +201,10 @@ command(int argc, char *argv[])
         return 1;
     }
 
-    return repack(argv[optind], argv[optind + 1]);
+    if (dedup) {
+        return rewrite(argv[optind], argv[optind + 1], codec, level, jobs);
+    }
+    return repack(argv[optind], argv[optind + 1], codec, level, jobs);
 }
 
 const Command repack_command = {
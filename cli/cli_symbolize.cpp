@@ -0,0 +1,141 @@
+/**************************************************************************
+ *
+ * Copyright 2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <string.h>
+#include <limits.h> // for CHAR_MAX
+#include <getopt.h>
+
+#include <iostream>
+#include <string>
+
+#include "cli.hpp"
+
+#include "os_string.hpp"
+
+#include "trace_parser.hpp"
+#include "trace_writer.hpp"
+
+
+static const char *synopsis = "Resolve the symbols of backtraces recorded without them.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace symbolize [OPTIONS] TRACE_FILE\n"
+        << synopsis << "\n"
+        "\n"
+        "Backtraces recorded with APITRACE_BACKTRACE_RAW=1 only have the address\n"
+        "of each frame.  This looks up their symbols in the modules on this\n"
+        "system, and writes a trace with them, so that it can be looked at\n"
+        "elsewhere.  Symbols found are cached in APITRACE_SYMBOL_CACHE, or else\n"
+        "~/.cache/apitrace/symbols.\n"
+        "\n"
+        "    -h, --help           show this help message and exit\n"
+        "    -o, --output=TRACE_FILE  output trace file\n"
+        "\n"
+    ;
+}
+
+const static char *
+shortOptions = "ho:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"output", required_argument, 0, 'o'},
+    {0, 0, 0, 0}
+};
+
+static int
+command(int argc, char *argv[])
+{
+    std::string output;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc != optind + 1) {
+        std::cerr << "error: one trace file must be specified\n";
+        usage();
+        return 1;
+    }
+
+    const char *filename = argv[optind];
+
+    // Frames are symbolized as the parser reads them
+    trace::Parser parser;
+    if (!parser.open(filename)) {
+        std::cerr << "error: failed to open " << filename << "\n";
+        return 1;
+    }
+    // Calls are written out and deleted right away
+    parser.setZeroCopyBlobs(true);
+
+    if (output.empty()) {
+        os::String base(filename);
+        base.trimExtension();
+
+        output = std::string(base.str()) + std::string("-symbolized.trace");
+    }
+
+    trace::Writer writer;
+    writer.setProperties(parser.getProperties());
+    if (!writer.open(output.c_str())) {
+        std::cerr << "error: failed to create " << output << "\n";
+        return 1;
+    }
+
+    trace::Call *call;
+    while ((call = parser.parse_call())) {
+        writer.writeCall(call);
+        delete call;
+    }
+
+    std::cerr << "Symbolized trace is available as " << output << "\n";
+
+    return 0;
+}
+
+const Command symbolize_command = {
+    "symbolize",
+    synopsis,
+    usage,
+    command
+};
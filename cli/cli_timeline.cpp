@@ -0,0 +1,539 @@
+/**************************************************************************
+ *
+ * Copyright 2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h> // for CHAR_MAX
+#include <getopt.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "cli.hpp"
+#include "cli_pager.hpp"
+
+#include "os_thread.hpp"
+#include "trace_parser.hpp"
+#include "trace_callset.hpp"
+#include "trace_option.hpp"
+
+
+/*
+ * Histograms of times, with one bucket per power of two microseconds.
+ */
+static const unsigned NUM_BUCKETS = 24;
+
+struct Histogram {
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long max;
+    unsigned long long buckets[NUM_BUCKETS];
+
+    Histogram() :
+        count(0),
+        total(0),
+        max(0)
+    {
+        memset(buckets, 0, sizeof buckets);
+    }
+
+    void
+    add(unsigned long long time) {
+        ++count;
+        total += time;
+        max = std::max(max, time);
+
+        unsigned long long us = time / 1000;
+        unsigned bucket = 0;
+        while (us && bucket + 1 < NUM_BUCKETS) {
+            us >>= 1;
+            ++bucket;
+        }
+        ++buckets[bucket];
+    }
+
+    void
+    merge(const Histogram &other) {
+        count += other.count;
+        total += other.total;
+        max = std::max(max, other.max);
+        for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+            buckets[i] += other.buckets[i];
+        }
+    }
+};
+
+
+static void
+printTime(const char *label, unsigned long long time) {
+    printf("%s%.3f ms", label, time * 1e-6);
+}
+
+
+static void
+printHistogram(const Histogram &histogram) {
+    unsigned first = 0;
+    while (first < NUM_BUCKETS && !histogram.buckets[first]) {
+        ++first;
+    }
+    unsigned last = NUM_BUCKETS;
+    while (last > first && !histogram.buckets[last - 1]) {
+        --last;
+    }
+
+    unsigned long long most = 0;
+    for (unsigned i = first; i < last; ++i) {
+        most = std::max(most, histogram.buckets[i]);
+    }
+
+    for (unsigned i = first; i < last; ++i) {
+        // Bucket i holds times in [2^(i-1), 2^i) microseconds
+        unsigned long long upper = 1ULL << i;
+        unsigned width = (unsigned)((histogram.buckets[i] * 50 + most - 1) / most);
+        printf("    < %10llu us %10llu ", upper, histogram.buckets[i]);
+        for (unsigned j = 0; j < width; ++j) {
+            putchar('#');
+        }
+        putchar('\n');
+    }
+}
+
+
+struct FunctionTimes {
+    const char *name;
+    Histogram histogram;
+
+    FunctionTimes() :
+        name(NULL)
+    {}
+};
+
+static bool
+compareTotal(const FunctionTimes *a, const FunctionTimes *b) {
+    return a->histogram.total > b->histogram.total;
+}
+
+
+typedef std::map<unsigned, FunctionTimes> FunctionTimesMap;
+
+
+struct FrameTimes {
+    // whether the call ending the frame was timed
+    bool ended;
+    unsigned long long end;
+    unsigned calls;
+    unsigned long long callTime;
+
+    FrameTimes() :
+        ended(false),
+        end(0),
+        calls(0),
+        callTime(0)
+    {}
+};
+
+
+static trace::CallSet calls(trace::FREQUENCY_ALL);
+
+
+/*
+ * Calls entered from a frame bookmark of the index up to the next range's,
+ * scanned on a thread of their own.  Calls left past the end of the range
+ * are scanned too, counting the frames on the way, so that every call is
+ * accounted to the frame it left in, just as when scanning the trace at
+ * once.
+ */
+struct Range {
+    trace::Parser *parser;
+    bool seek;
+    trace::ParseBookmark start;
+    bool last;
+    // first call of the next range
+    unsigned endCallNo;
+    unsigned firstFrame;
+
+    FunctionTimesMap functions;
+    std::vector<FrameTimes> frames;
+    bool started;
+    unsigned long long startTime;
+    unsigned long long untimedCalls;
+
+    os::thread thread;
+
+    Range() :
+        parser(NULL),
+        seek(false),
+        last(true),
+        endCallNo(0),
+        firstFrame(0),
+        started(false),
+        startTime(0),
+        untimedCalls(0)
+    {}
+};
+
+
+static void *
+scanRange(Range *range)
+{
+    trace::Parser &p = *range->parser;
+    unsigned remaining = 0;
+    if (range->seek) {
+        p.setBookmark(range->start);
+        remaining = range->endCallNo - range->start.next_call_no;
+    }
+    range->frames.push_back(FrameTimes());
+
+    trace::Call *call;
+    while ((range->last || remaining) &&
+           (call = p.scan_call_details())) {
+        bool ours = range->last || call->no < range->endCallNo;
+        if (ours && !range->last) {
+            --remaining;
+        }
+
+        if (call->timed && !range->started) {
+            range->startTime = call->enter_time;
+            range->started = true;
+        }
+
+        if (ours) {
+            if (!call->timed) {
+                ++range->untimedCalls;
+            } else if (calls.contains(*call)) {
+                FunctionTimes &function = range->functions[call->sig->id];
+                function.name = call->name();
+                function.histogram.add(call->duration);
+                FrameTimes &frame = range->frames.back();
+                frame.callTime += call->duration;
+                ++frame.calls;
+            }
+        }
+
+        if (call->flags & trace::CALL_FLAG_END_FRAME) {
+            // Frames end when the call which presents them returns
+            if (ours && call->timed) {
+                FrameTimes &frame = range->frames.back();
+                frame.end = call->enter_time + call->duration;
+                frame.ended = true;
+            }
+            range->frames.push_back(FrameTimes());
+        }
+
+        delete call;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Parsers sharing signatures must be closed before the one they share.
+ */
+static void
+deleteRanges(std::vector<Range *> &ranges, trace::Parser &master)
+{
+    for (size_t r = 0; r < ranges.size(); ++r) {
+        if (ranges[r]->parser != &master) {
+            delete ranges[r]->parser;
+        }
+        delete ranges[r];
+    }
+    ranges.clear();
+}
+
+
+static const char *synopsis = "Show where the traced application spent its time.";
+
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace timeline [OPTIONS] TRACE_FILE...\n"
+        << synopsis << "\n"
+        "\n"
+        "Requires traces recorded with APITRACE_TIMING=1.\n"
+        "\n"
+        "    -h, --help           show this help message and exit\n"
+        "    -v, --verbose        list every frame\n"
+        "    --calls=CALLSET      only account specified calls\n"
+        "    --functions=N        list the N functions which took longest\n"
+        "                         [default: 20]\n"
+        "    --histograms[=BOOL]  show a histogram for every listed function\n"
+        "                         [default: no]\n"
+        "    -j, --jobs=N         scan indexed traces on N threads [default: 1]\n"
+        "\n"
+    ;
+}
+
+enum {
+    CALLS_OPT = CHAR_MAX + 1,
+    FUNCTIONS_OPT,
+    HISTOGRAMS_OPT,
+};
+
+const static char *
+shortOptions = "hvj:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"verbose", no_argument, 0, 'v'},
+    {"calls", required_argument, 0, CALLS_OPT},
+    {"functions", required_argument, 0, FUNCTIONS_OPT},
+    {"histograms", optional_argument, 0, HISTOGRAMS_OPT},
+    {"jobs", required_argument, 0, 'j'},
+    {0, 0, 0, 0}
+};
+
+static int
+command(int argc, char *argv[])
+{
+    bool verbose = false;
+    unsigned numFunctions = 20;
+    bool histograms = false;
+    unsigned jobs = 1;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'v':
+            verbose = true;
+            break;
+        case CALLS_OPT:
+            calls = trace::CallSet(optarg);
+            break;
+        case FUNCTIONS_OPT:
+            numFunctions = atoi(optarg);
+            break;
+        case HISTOGRAMS_OPT:
+            histograms = trace::boolOption(optarg);
+            break;
+        case 'j':
+            jobs = std::max(atoi(optarg), 1);
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        std::cerr << "error: no trace file specified\n";
+        usage();
+        return 1;
+    }
+
+#ifndef _WIN32
+    pipepager();
+#endif
+
+    for (int i = optind; i < argc; ++i) {
+        trace::Parser p;
+
+        if (!p.open(argv[i])) {
+            return 1;
+        }
+
+        if (argc - optind > 1) {
+            printf("%s:\n", argv[i]);
+        }
+
+        // Split the frames of indexed traces between parsers sharing the
+        // signatures of this one, or else scan the trace at once
+        std::vector<Range *> ranges;
+        if (jobs > 1 && p.supportsOffsets() && p.loadIndex()) {
+            const trace::FrameIndex &frameIndex = p.getFrameIndex();
+            size_t numRanges = std::min<size_t>(jobs, frameIndex.size());
+            for (size_t r = 0; r < numRanges; ++r) {
+                Range *range = new Range;
+                range->parser = new trace::Parser;
+                if (!range->parser->openShared(p)) {
+                    delete range->parser;
+                    delete range;
+                    break;
+                }
+                range->seek = true;
+                range->firstFrame = frameIndex.size() * r / numRanges;
+                range->start = frameIndex[range->firstFrame].start;
+                if (r + 1 < numRanges) {
+                    size_t nextFrame = frameIndex.size() * (r + 1) / numRanges;
+                    range->last = false;
+                    range->endCallNo = frameIndex[nextFrame].start.next_call_no;
+                }
+                ranges.push_back(range);
+            }
+            if (ranges.size() == numRanges) {
+                for (size_t r = 0; r < ranges.size(); ++r) {
+                    ranges[r]->thread = os::thread(scanRange, ranges[r]);
+                }
+            } else {
+                deleteRanges(ranges, p);
+            }
+        }
+        if (ranges.empty()) {
+            Range *range = new Range;
+            range->parser = &p;
+            scanRange(range);
+            ranges.push_back(range);
+        }
+
+        FunctionTimesMap functions;
+        std::vector<FrameTimes> frameTimes;
+        bool started = false;
+        unsigned long long frameStart = 0;
+        unsigned long long untimedCalls = 0;
+        for (size_t r = 0; r < ranges.size(); ++r) {
+            Range *range = ranges[r];
+            if (range->thread.joinable()) {
+                range->thread.join();
+            }
+
+            for (FunctionTimesMap::const_iterator it = range->functions.begin();
+                 it != range->functions.end(); ++it) {
+                FunctionTimes &function = functions[it->first];
+                function.name = it->second.name;
+                function.histogram.merge(it->second.histogram);
+            }
+
+            size_t numFrames = range->firstFrame + range->frames.size();
+            if (frameTimes.size() < numFrames) {
+                frameTimes.resize(numFrames);
+            }
+            for (size_t j = 0; j < range->frames.size(); ++j) {
+                const FrameTimes &times = range->frames[j];
+                FrameTimes &frame = frameTimes[range->firstFrame + j];
+                frame.calls += times.calls;
+                frame.callTime += times.callTime;
+                if (times.ended) {
+                    frame.end = times.end;
+                    frame.ended = true;
+                }
+            }
+
+            if (!started && range->started) {
+                frameStart = range->startTime;
+                started = true;
+            }
+            untimedCalls += range->untimedCalls;
+        }
+
+        if (!started) {
+            std::cerr << "error: " << argv[i] << " has no call times; "
+                         "trace it with APITRACE_TIMING=1\n";
+            deleteRanges(ranges, p);
+            return 1;
+        }
+
+        if (untimedCalls) {
+            std::cerr << "warning: " << untimedCalls << " calls have no times\n";
+        }
+
+        if (verbose) {
+            printf("frame      calls      elapsed      in calls\n");
+        }
+
+        // Calls of frames whose ending call has no time carry over to the
+        // next frame
+        Histogram frames;
+        unsigned frame = 0;
+        unsigned long long frameCallTime = 0;
+        unsigned frameCalls = 0;
+        for (size_t j = 0; j < frameTimes.size(); ++j) {
+            frameCalls += frameTimes[j].calls;
+            frameCallTime += frameTimes[j].callTime;
+            if (!frameTimes[j].ended) {
+                continue;
+            }
+
+            unsigned long long frameEnd = frameTimes[j].end;
+            unsigned long long elapsed = frameEnd - std::min(frameStart, frameEnd);
+            frames.add(elapsed);
+            if (verbose) {
+                printf("%5u %10u %9.3f ms %9.3f ms\n",
+                       frame, frameCalls, elapsed * 1e-6, frameCallTime * 1e-6);
+            }
+            ++frame;
+            frameStart = frameEnd;
+            frameCallTime = 0;
+            frameCalls = 0;
+        }
+
+        if (frames.count) {
+            printf("%llu frames", frames.count);
+            printTime(", mean ", frames.total / frames.count);
+            printTime(", max ", frames.max);
+            printf("\n");
+            printHistogram(frames);
+            printf("\n");
+        }
+
+        std::vector<FunctionTimes *> sorted;
+        unsigned long long total = 0;
+        for (std::map<unsigned, FunctionTimes>::iterator it = functions.begin();
+             it != functions.end(); ++it) {
+            sorted.push_back(&it->second);
+            total += it->second.histogram.total;
+        }
+        std::sort(sorted.begin(), sorted.end(), compareTotal);
+        if (sorted.size() > numFunctions) {
+            sorted.resize(numFunctions);
+        }
+
+        printf("    %%      total ms       calls    mean us     max us  function\n");
+        for (unsigned j = 0; j < sorted.size(); ++j) {
+            const Histogram &histogram = sorted[j]->histogram;
+            printf("%5.1f %12.3f %11llu %10.3f %10.3f  %s\n",
+                   total ? histogram.total * 100.0 / total : 0.0,
+                   histogram.total * 1e-6,
+                   histogram.count,
+                   histogram.total * 1e-3 / histogram.count,
+                   histogram.max * 1e-3,
+                   sorted[j]->name);
+            if (histograms) {
+                printHistogram(histogram);
+            }
+        }
+
+        deleteRanges(ranges, p);
+    }
+
+    return 0;
+}
+
+const Command timeline_command = {
+    "timeline",
+    synopsis,
+    usage,
+    command
+};
@@ -215,10 +215,13 @@ trim_trace(const char *filename, struct trim_options *options)
     /* Mark the beginning so we can return here for pass 2. */
     p.getBookmark(beginning);
 
-    /* In pass 1, analyze which calls are needed. */
+    /* In pass 1, analyze which calls are needed.  Without dependency
+     * analysis, the number and flags of each call are all that matter,
+     * and with it, only a few arguments of the calls which bind or
+     * create objects, so the rest are never decoded. */
     frame = 0;
     trace::Call *call;
-    while ((call = p.parse_call())) {
+    while ((call = options->dependency_analysis ? p.lazy_call() : p.scan_call())) {
 
         /* There's no use doing any work past the last call and frame
          * requested by the user. */
@@ -272,6 +275,7 @@ trim_trace(const char *filename, struct trim_options *options)
     }
 
     trace::Writer writer;
+    writer.setProperties(p.getProperties());
     if (!writer.open(options->output.c_str())) {
         std::cerr << "error: failed to create " << filename << "\n";
         return 1;
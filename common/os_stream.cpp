@@ -0,0 +1,876 @@
+/**************************************************************************
+ *
+ * Copyright 2011-2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#endif
+
+#include "os.hpp"
+#include "os_time.hpp"
+#include "os_stream.hpp"
+
+
+namespace os {
+
+
+/*
+ * Buffered stream, over some unbuffered channel.
+ *
+ * It can't seek, but it keeps count of the bytes read or written so that
+ * the current position can still be queried.
+ */
+class buffered_streambuf : public std::streambuf
+{
+public:
+    buffered_streambuf() :
+        m_pos(0)
+    {
+        setg(m_getBuffer, m_getBuffer, m_getBuffer);
+        setp(m_putBuffer, m_putBuffer + sizeof m_putBuffer);
+    }
+
+protected:
+    /*
+     * Read some bytes, waiting for at least one.  Returns zero at the end of
+     * the stream, or a negative number on error.
+     */
+    virtual long readSome(char *data, size_t length) = 0;
+
+    /*
+     * Write some bytes, waiting until at least one is written.
+     */
+    virtual long writeSome(const char *data, size_t length) = 0;
+
+    int_type underflow()
+    {
+        if (gptr() < egptr()) {
+            return traits_type::to_int_type(*gptr());
+        }
+
+        // Keep a few bytes to put back, for sniffing the file type
+        size_t putBack = gptr() - eback();
+        if (putBack > PUT_BACK_SIZE) {
+            putBack = PUT_BACK_SIZE;
+        }
+        memmove(m_getBuffer, gptr() - putBack, putBack);
+
+        long length;
+        do {
+            length = readSome(m_getBuffer + putBack,
+                              sizeof m_getBuffer - putBack);
+        } while (length < 0 && errno == EINTR);
+        if (length <= 0) {
+            return traits_type::eof();
+        }
+
+        m_pos += length;
+        setg(m_getBuffer, m_getBuffer + putBack,
+             m_getBuffer + putBack + length);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    int_type overflow(int_type c)
+    {
+        if (!writeAll(pbase(), pptr() - pbase())) {
+            return traits_type::eof();
+        }
+        setp(m_putBuffer, m_putBuffer + sizeof m_putBuffer);
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync()
+    {
+        if (pptr() > pbase()) {
+            if (!writeAll(pbase(), pptr() - pbase())) {
+                return -1;
+            }
+            setp(m_putBuffer, m_putBuffer + sizeof m_putBuffer);
+        }
+        return 0;
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n)
+    {
+        // Write big blocks, like compressed chunks, directly
+        if (n >= (std::streamsize)sizeof m_putBuffer) {
+            if (sync() != 0 || !writeAll(s, n)) {
+                return 0;
+            }
+            return n;
+        }
+        return std::streambuf::xsputn(s, n);
+    }
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which)
+    {
+        if (off != 0 || dir != std::ios_base::cur) {
+            return pos_type(off_type(-1));
+        }
+        if (which & std::ios_base::in) {
+            return pos_type(off_type(m_pos - (egptr() - gptr())));
+        }
+        return pos_type(off_type(m_pos + (pptr() - pbase())));
+    }
+
+private:
+    bool writeAll(const char *data, size_t length)
+    {
+        while (length) {
+            long written = writeSome(data, length);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            m_pos += written;
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    enum { PUT_BACK_SIZE = 4 };
+
+    unsigned long long m_pos;
+    char m_getBuffer[64 * 1024];
+    char m_putBuffer[64 * 1024];
+};
+
+
+/*
+ * Stream buffer over a file descriptor.
+ */
+class fd_streambuf : public buffered_streambuf
+{
+public:
+    fd_streambuf(int fd, bool socket, bool owned) :
+        m_fd(fd),
+        m_socket(socket),
+        m_owned(owned)
+    {
+    }
+
+    ~fd_streambuf()
+    {
+        sync();
+        if (m_owned) {
+#ifdef _WIN32
+            _close(m_fd);
+#else
+            ::close(m_fd);
+#endif
+        }
+    }
+
+protected:
+    long readSome(char *data, size_t length)
+    {
+#ifdef _WIN32
+        return _read(m_fd, data, length);
+#else
+        return ::read(m_fd, data, length);
+#endif
+    }
+
+    long writeSome(const char *data, size_t length)
+    {
+#ifdef _WIN32
+        return _write(m_fd, data, length);
+#else
+        if (m_socket) {
+            // Don't let a reader going away kill the traced process
+#ifdef MSG_NOSIGNAL
+            return ::send(m_fd, data, length, MSG_NOSIGNAL);
+#else
+            return ::send(m_fd, data, length, 0);
+#endif
+        }
+        return ::write(m_fd, data, length);
+#endif
+    }
+
+private:
+    int m_fd;
+    bool m_socket;
+    bool m_owned;
+};
+
+
+bool
+isStream(const char *name)
+{
+    if (strcmp(name, "-") == 0 ||
+        strncmp(name, "unix:", 5) == 0 ||
+        strncmp(name, "tcp:", 4) == 0 ||
+        strncmp(name, "shm:", 4) == 0) {
+        return true;
+    }
+
+#ifdef _WIN32
+    return strncmp(name, "\\\\.\\pipe\\", 9) == 0;
+#else
+    struct stat st;
+    return stat(name, &st) == 0 &&
+           (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) || S_ISSOCK(st.st_mode));
+#endif
+}
+
+
+#ifndef _WIN32
+
+/*
+ * Listen on the socket address and accept one connection when reading, or
+ * connect to it when writing.
+ */
+static int
+openSocket(const char *name, int family, const struct sockaddr *addr,
+           socklen_t addrlen, bool write)
+{
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        os::log("error: %s: socket failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof one);
+#endif
+
+    if (write) {
+        if (connect(fd, addr, addrlen) != 0) {
+            os::log("error: %s: connect failed: %s\n", name, strerror(errno));
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    if (family != AF_UNIX) {
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+    }
+    if (bind(fd, addr, addrlen) != 0 ||
+        listen(fd, 1) != 0) {
+        os::log("error: %s: listen failed: %s\n", name, strerror(errno));
+        ::close(fd);
+        return -1;
+    }
+
+    int conn;
+    do {
+        conn = accept(fd, NULL, NULL);
+    } while (conn < 0 && errno == EINTR);
+    if (conn < 0) {
+        os::log("error: %s: accept failed: %s\n", name, strerror(errno));
+    }
+    ::close(fd);
+    return conn;
+}
+
+static int
+openUnixSocket(const char *name, const char *path, bool write)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr.sun_path) {
+        os::log("error: %s: path too long\n", name);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (!write) {
+        // Remove stale sockets from previous runs
+        unlink(path);
+    }
+    int fd = openSocket(name, AF_UNIX, (const struct sockaddr *)&addr,
+                        sizeof addr, write);
+    if (!write) {
+        unlink(path);
+    }
+    return fd;
+}
+
+static int
+openTcpSocket(const char *name, const char *address, bool write)
+{
+    std::string host(address);
+    std::string port;
+    size_t colon = host.rfind(':');
+    if (colon == std::string::npos) {
+        os::log("error: %s: expected tcp:HOST:PORT\n", name);
+        return -1;
+    }
+    port = host.substr(colon + 1);
+    host.resize(colon);
+    if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (!write) {
+        hints.ai_flags = AI_PASSIVE;
+    }
+
+    struct addrinfo *res = NULL;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                          &hints, &res);
+    if (err != 0) {
+        os::log("error: %s: %s\n", name, gai_strerror(err));
+        return -1;
+    }
+    int fd = openSocket(name, res->ai_family, res->ai_addr, res->ai_addrlen,
+                        write);
+    freeaddrinfo(res);
+    return fd;
+}
+
+
+/*
+ * Shared memory rings.
+ *
+ * The area is a file mapped by the collector and by every traced process.  It
+ * holds a header, then one descriptor per slot, then one ring per slot.  Each
+ * writer claims a free slot and appends to its ring, which one reader in the
+ * collector drains.  Head and tail count the bytes written and read since the
+ * slot was claimed, so they index the ring modulo its size.
+ */
+
+#define SHM_MAGIC 0x61736d31
+
+enum {
+    SHM_SLOT_FREE = 0,
+    SHM_SLOT_OPENING,
+    SHM_SLOT_CLAIMED,
+    SHM_SLOT_CLOSED,
+};
+
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t numSlots;
+    uint64_t ringSize;
+    uint32_t truncate;
+    int32_t collectorPid;
+    volatile uint32_t stopping;
+    uint32_t reserved;
+};
+
+struct ShmSlot {
+    volatile uint32_t state;
+    volatile int32_t pid;
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    volatile uint32_t collected;
+    volatile uint32_t truncated;
+};
+
+static inline ShmSlot *
+shmSlot(ShmHeader *header, unsigned slot)
+{
+    return (ShmSlot *)(header + 1) + slot;
+}
+
+static inline char *
+shmRing(ShmHeader *header, unsigned slot)
+{
+    return (char *)shmSlot(header, header->numSlots) + slot * header->ringSize;
+}
+
+static size_t
+shmAreaSize(unsigned numSlots, uint64_t ringSize)
+{
+    return sizeof(ShmHeader) + numSlots * (sizeof(ShmSlot) + ringSize);
+}
+
+static bool
+isProcessAlive(int pid)
+{
+    return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/*
+ * Areas live in /dev/shm, so that they never touch the disk, unless the name
+ * is a path.
+ */
+static std::string
+shmPath(const char *name)
+{
+    if (strchr(name, '/')) {
+        return name;
+    }
+    const char *dir = "/dev/shm";
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        dir = getenv("TMPDIR");
+        if (!dir) {
+            dir = "/tmp";
+        }
+    }
+    return std::string(dir) + "/apitrace-" + name;
+}
+
+static ShmHeader *
+createShmArea(const char *name, const std::string &path,
+              unsigned numSlots, size_t ringSize, bool truncate)
+{
+    size_t size = shmAreaSize(numSlots, ringSize);
+
+    // Remove stale areas from previous runs
+    unlink(path.c_str());
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        os::log("error: %s: %s: %s\n", name, path.c_str(), strerror(errno));
+        return NULL;
+    }
+    void *ptr = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        os::log("error: %s: failed to map %s: %s\n", name, path.c_str(), strerror(errno));
+        unlink(path.c_str());
+        return NULL;
+    }
+
+    // The file is zero filled, so all slots start free
+    ShmHeader *header = (ShmHeader *)ptr;
+    header->numSlots = numSlots;
+    header->ringSize = ringSize;
+    header->truncate = truncate;
+    header->collectorPid = getpid();
+    header->stopping = 0;
+    __sync_synchronize();
+    header->magic = SHM_MAGIC;
+    return header;
+}
+
+static ShmHeader *
+mapShmArea(const char *name, const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        os::log("error: %s: %s: %s\n", name, path.c_str(), strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    void *ptr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ShmHeader)) {
+        ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        os::log("error: %s: failed to map %s\n", name, path.c_str());
+        return NULL;
+    }
+
+    ShmHeader *header = (ShmHeader *)ptr;
+    if (header->magic != SHM_MAGIC ||
+        shmAreaSize(header->numSlots, header->ringSize) != (size_t)st.st_size) {
+        os::log("error: %s: %s is not a trace collection area\n", name, path.c_str());
+        munmap(ptr, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+static void
+unmapShmArea(ShmHeader *header)
+{
+    munmap(header, shmAreaSize(header->numSlots, header->ringSize));
+}
+
+
+/*
+ * Writes into a claimed slot's ring.
+ *
+ * When the ring is full it either waits for the collector, or, with the
+ * truncate policy, drops the rest of the trace, so that the traced
+ * application is never slowed down.  Either way it also gives up once the
+ * collector is gone.
+ */
+class shm_write_streambuf : public buffered_streambuf
+{
+public:
+    shm_write_streambuf(const char *name, ShmHeader *header, unsigned slot) :
+        m_name(name),
+        m_header(header),
+        m_slot(shmSlot(header, slot)),
+        m_ring(shmRing(header, slot)),
+        m_detached(false)
+    {
+    }
+
+    ~shm_write_streambuf()
+    {
+        sync();
+        __sync_synchronize();
+        m_slot->state = SHM_SLOT_CLOSED;
+        unmapShmArea(m_header);
+    }
+
+protected:
+    long readSome(char *data, size_t length)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    long writeSome(const char *data, size_t length)
+    {
+        if (m_detached) {
+            return length;
+        }
+
+        uint64_t ringSize = m_header->ringSize;
+        uint64_t head = m_slot->head;
+        uint64_t available;
+        while ((available = ringSize - (head - m_slot->tail)) == 0) {
+            if (m_header->truncate) {
+                m_slot->truncated = 1;
+                detach("collector fell behind, truncating trace");
+                return length;
+            }
+            if (m_header->stopping || !isProcessAlive(m_header->collectorPid)) {
+                detach("collector went away, dropping rest of trace");
+                return length;
+            }
+            os::sleep(1000);
+        }
+
+        size_t offset = head % ringSize;
+        size_t count = std::min<uint64_t>(std::min<uint64_t>(length, available),
+                                          ringSize - offset);
+        memcpy(m_ring + offset, data, count);
+        __sync_synchronize();
+        m_slot->head = head + count;
+        return count;
+    }
+
+private:
+    void detach(const char *reason)
+    {
+        os::log("apitrace: warning: %s: %s\n", m_name.c_str(), reason);
+        m_detached = true;
+    }
+
+    std::string m_name;
+    ShmHeader *m_header;
+    ShmSlot *m_slot;
+    char *m_ring;
+    bool m_detached;
+};
+
+
+/*
+ * Drains a slot's ring, until its writer closes it, dies, or the collector
+ * stops.  The slot is freed for another writer afterwards, unless the reader
+ * created the area for itself, in which case the area is removed.
+ */
+class shm_read_streambuf : public buffered_streambuf
+{
+public:
+    shm_read_streambuf(ShmHeader *header, unsigned slot, const std::string &ownedPath) :
+        m_header(header),
+        m_slot(shmSlot(header, slot)),
+        m_ring(shmRing(header, slot)),
+        m_ownedPath(ownedPath)
+    {
+    }
+
+    ~shm_read_streambuf()
+    {
+        if (m_ownedPath.empty()) {
+            m_slot->head = 0;
+            m_slot->tail = 0;
+            m_slot->pid = 0;
+            m_slot->truncated = 0;
+            m_slot->collected = 0;
+            __sync_synchronize();
+            m_slot->state = SHM_SLOT_FREE;
+        } else {
+            unlink(m_ownedPath.c_str());
+        }
+        unmapShmArea(m_header);
+    }
+
+protected:
+    long readSome(char *data, size_t length)
+    {
+        uint64_t ringSize = m_header->ringSize;
+        for (;;) {
+            // Check the state before the head, as writers publish all their
+            // data before closing
+            uint32_t state = m_slot->state;
+            __sync_synchronize();
+            uint64_t head = m_slot->head;
+            uint64_t tail = m_slot->tail;
+            if (head != tail) {
+                size_t offset = tail % ringSize;
+                size_t count = std::min<uint64_t>(std::min<uint64_t>(length, head - tail),
+                                                  ringSize - offset);
+                memcpy(data, m_ring + offset, count);
+                __sync_synchronize();
+                m_slot->tail = tail + count;
+                return count;
+            }
+
+            if (state == SHM_SLOT_CLOSED ||
+                m_header->stopping ||
+                (state == SHM_SLOT_CLAIMED && !isProcessAlive(m_slot->pid))) {
+                if (m_slot->truncated) {
+                    os::log("warning: trace from process %i was truncated\n", (int)m_slot->pid);
+                }
+                return 0;
+            }
+            os::sleep(1000);
+        }
+    }
+
+    long writeSome(const char *data, size_t length)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+private:
+    ShmHeader *m_header;
+    ShmSlot *m_slot;
+    char *m_ring;
+    std::string m_ownedPath;
+};
+
+
+static std::streambuf *
+openShm(const char *name, bool write)
+{
+    std::string area(name + 4);
+    long slot = -1;
+    size_t at = area.rfind('@');
+    if (!write && at != std::string::npos) {
+        char *end = NULL;
+        slot = strtol(area.c_str() + at + 1, &end, 10);
+        if (*end != '\0' || slot < 0) {
+            os::log("error: %s: expected shm:NAME@SLOT\n", name);
+            return NULL;
+        }
+        area.resize(at);
+    }
+    std::string path = shmPath(area.c_str());
+
+    if (!write) {
+        if (slot < 0) {
+            // Serve a single writer, like sockets do
+            ShmHeader *header = createShmArea(name, path, 1, 16 * 1024 * 1024, false);
+            return header ? new shm_read_streambuf(header, 0, path) : NULL;
+        }
+        ShmHeader *header = mapShmArea(name, path);
+        if (!header) {
+            return NULL;
+        }
+        if ((unsigned long)slot >= header->numSlots) {
+            os::log("error: %s: no such slot\n", name);
+            unmapShmArea(header);
+            return NULL;
+        }
+        return new shm_read_streambuf(header, slot, std::string());
+    }
+
+    ShmHeader *header = mapShmArea(name, path);
+    if (!header) {
+        return NULL;
+    }
+    if (header->stopping || !isProcessAlive(header->collectorPid)) {
+        os::log("error: %s: collector is not running\n", name);
+        unmapShmArea(header);
+        return NULL;
+    }
+    for (unsigned i = 0; i < header->numSlots; ++i) {
+        ShmSlot *s = shmSlot(header, i);
+        if (__sync_bool_compare_and_swap(&s->state, SHM_SLOT_FREE, SHM_SLOT_OPENING)) {
+            s->pid = getpid();
+            s->head = 0;
+            s->tail = 0;
+            s->truncated = 0;
+            __sync_synchronize();
+            s->state = SHM_SLOT_CLAIMED;
+            return new shm_write_streambuf(name, header, i);
+        }
+    }
+    os::log("error: %s: all %u slots are taken\n", name, header->numSlots);
+    unmapShmArea(header);
+    return NULL;
+}
+
+#endif /* !_WIN32 */
+
+
+std::streambuf *
+openStream(const char *name, bool write)
+{
+    int fd;
+    bool socket = false;
+    bool owned = true;
+
+    if (strcmp(name, "-") == 0) {
+        fd = write ? 1 : 0;
+        owned = false;
+#ifdef _WIN32
+        _setmode(fd, _O_BINARY);
+#endif
+    } else if (strncmp(name, "unix:", 5) == 0) {
+#ifdef _WIN32
+        os::log("error: %s: sockets are not supported on Windows\n", name);
+        return NULL;
+#else
+        fd = openUnixSocket(name, name + 5, write);
+        socket = true;
+#endif
+    } else if (strncmp(name, "tcp:", 4) == 0) {
+#ifdef _WIN32
+        os::log("error: %s: sockets are not supported on Windows\n", name);
+        return NULL;
+#else
+        fd = openTcpSocket(name, name + 4, write);
+        socket = true;
+#endif
+    } else if (strncmp(name, "shm:", 4) == 0) {
+#ifdef _WIN32
+        os::log("error: %s: shared memory is not supported on Windows\n", name);
+        return NULL;
+#else
+        return openShm(name, write);
+#endif
+    } else {
+#ifdef _WIN32
+        fd = _open(name, (write ? _O_WRONLY : _O_RDONLY) | _O_BINARY);
+#else
+        fd = ::open(name, write ? O_WRONLY : O_RDONLY);
+#endif
+        if (fd < 0) {
+            os::log("error: %s: %s\n", name, strerror(errno));
+        }
+    }
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    return new fd_streambuf(fd, socket, owned);
+}
+
+
+ShmCollector::ShmCollector() :
+    m_header(NULL)
+{
+}
+
+ShmCollector::~ShmCollector()
+{
+#ifndef _WIN32
+    if (m_header) {
+        unlink(m_path.c_str());
+        unmapShmArea((ShmHeader *)m_header);
+    }
+#endif
+}
+
+bool
+ShmCollector::create(const char *name, unsigned numSlots, size_t ringSize,
+                     bool truncate)
+{
+#ifdef _WIN32
+    os::log("error: shared memory is not supported on Windows\n");
+    return false;
+#else
+    m_path = shmPath(name);
+    m_header = createShmArea(name, m_path, numSlots, ringSize, truncate);
+    return m_header != NULL;
+#endif
+}
+
+bool
+ShmCollector::accept(unsigned &slot, int &pid)
+{
+#ifndef _WIN32
+    ShmHeader *header = (ShmHeader *)m_header;
+    for (unsigned i = 0; i < header->numSlots; ++i) {
+        ShmSlot *s = shmSlot(header, i);
+        uint32_t state = s->state;
+        if ((state == SHM_SLOT_CLAIMED || state == SHM_SLOT_CLOSED) &&
+            !s->collected) {
+            s->collected = 1;
+            slot = i;
+            pid = s->pid;
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+void
+ShmCollector::stop(void)
+{
+#ifndef _WIN32
+    ((ShmHeader *)m_header)->stopping = 1;
+#endif
+}
+
+
+} /* namespace os */
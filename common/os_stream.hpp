@@ -0,0 +1,109 @@
+/**************************************************************************
+ *
+ * Copyright 2011-2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Non-seekable byte streams: standard input/output, pipes, sockets and shared
+ * memory rings.
+ */
+
+#ifndef _OS_STREAM_HPP_
+#define _OS_STREAM_HPP_
+
+
+#include <stddef.h>
+
+#include <streambuf>
+#include <string>
+
+
+namespace os {
+
+
+/**
+ * Whether the name refers to a stream rather than a regular file, that is
+ * "-" for standard input/output, "unix:PATH" or "tcp:HOST:PORT" for a
+ * socket, "shm:NAME" for a shared memory ring, or the path of a pipe.
+ */
+bool
+isStream(const char *name);
+
+/**
+ * Open a stream named as above.
+ *
+ * When reading, sockets are listened on until one connection is accepted, so
+ * the reader must be started before the writer, which connects to them.
+ * Returns NULL on failure, after logging why.
+ */
+std::streambuf *
+openStream(const char *name, bool write);
+
+
+/**
+ * Shared memory area for collecting traces from many processes at once.
+ *
+ * Every process writing to "shm:NAME" claims one of the area's slots, and
+ * writes into its ring.  The collector accepts each new writer, and reads
+ * its ring through "shm:NAME@SLOT".  Reading "shm:NAME" directly creates a
+ * single slot area, and serves a single writer.
+ */
+class ShmCollector
+{
+public:
+    ShmCollector();
+
+    /**
+     * Removes the area.
+     */
+    ~ShmCollector();
+
+    /**
+     * With the truncate policy, writers drop the rest of their trace when
+     * their ring fills up, instead of waiting for it to be drained.
+     */
+    bool
+    create(const char *name, unsigned numSlots, size_t ringSize, bool truncate);
+
+    /**
+     * Look for a writer which claimed a slot since the last call, without
+     * waiting.
+     */
+    bool
+    accept(unsigned &slot, int &pid);
+
+    /**
+     * Have readers stop once they drained their rings, and writers go away.
+     */
+    void
+    stop(void);
+
+private:
+    void *m_header;
+    std::string m_path;
+};
+
+
+} /* namespace os */
+
+#endif /* _OS_STREAM_HPP_ */
@@ -37,6 +37,7 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <sys/time.h>
 #endif
 
 
@@ -278,11 +279,76 @@ namespace os {
 #  endif
 #else
             pthread_cond_wait(&_native_handle, &mutex_native_handle);
+#endif
+        }
+
+        /**
+         * Same as wait(), but give up after the given number of
+         * milliseconds.
+         */
+        inline void
+        wait_for(unique_lock<mutex> & lock, unsigned long milliseconds) {
+            mutex::native_handle_type & mutex_native_handle = lock.mutex()->native_handle();
+#ifdef _WIN32
+#  if USE_WIN32_CONDITION_VARIABLES
+            SleepConditionVariableCS(&_native_handle, &mutex_native_handle, milliseconds);
+#  else
+            InterlockedIncrement(&cWaiters);
+            LeaveCriticalSection(&mutex_native_handle);
+            WaitForSingleObject(hEvent, milliseconds);
+            EnterCriticalSection(&mutex_native_handle);
+            InterlockedDecrement(&cWaiters);
+#  endif
+#else
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            unsigned long long nsec = now.tv_usec * 1000ULL + milliseconds * 1000000ULL;
+            struct timespec deadline;
+            deadline.tv_sec = now.tv_sec + nsec / 1000000000ULL;
+            deadline.tv_nsec = nsec % 1000000000ULL;
+            pthread_cond_timedwait(&_native_handle, &mutex_native_handle, &deadline);
 #endif
         }
     };
 
 
+    /**
+     * Atomically add to a counter, returning its previous value.  Same as
+     * std::atomic::fetch_add, with sequentially consistent ordering.
+     */
+    inline unsigned long long
+    atomic_fetch_add(volatile unsigned long long *ptr, unsigned long long value) {
+#ifdef _MSC_VER
+        return InterlockedExchangeAdd64((volatile LONGLONG *)ptr, value);
+#else
+        return __sync_fetch_and_add(ptr, value);
+#endif
+    }
+
+    inline unsigned
+    atomic_fetch_add(volatile unsigned *ptr, unsigned value) {
+#ifdef _MSC_VER
+        return InterlockedExchangeAdd((volatile LONG *)ptr, value);
+#else
+        return __sync_fetch_and_add(ptr, value);
+#endif
+    }
+
+
+    /**
+     * Full memory barrier, to order plain loads and stores of volatile
+     * variables shared between threads.
+     */
+    inline void
+    memory_barrier(void) {
+#ifdef _MSC_VER
+        MemoryBarrier();
+#else
+        __sync_synchronize();
+#endif
+    }
+
+
     template <typename T>
     class thread_specific_ptr
     {
@@ -294,11 +360,19 @@ namespace os {
 #endif
 
     public:
-        thread_specific_ptr(void) {
+        typedef void (*cleanup_function)(void *);
+
+        /**
+         * The cleanup function, if any, is called with the value of every
+         * thread which exits with one set.  Windows TLS has no such
+         * destructors, so it is never called there, and DLLs must clean up
+         * on DLL_THREAD_DETACH instead.
+         */
+        thread_specific_ptr(cleanup_function cleanup = NULL) {
 #ifdef _WIN32
             dwTlsIndex = TlsAlloc();
 #else
-            pthread_key_create(&key, NULL);
+            pthread_key_create(&key, cleanup);
 #endif
         }
 
@@ -269,17 +269,29 @@ std::vector<RawStackFrame> get_backtrace() {
     return backtraceProvider.parseBacktrace(backtraceProvider.getBacktrace());
 }
 
+void symbolize_stack_frame(StackFrame *frame) {
+    // Dalvik backtraces are always symbolized
+}
+
 /* end ANDROID */
 #elif defined __linux__
 
 #include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
 #include <dlfcn.h>
+#include <link.h>
+#include <algorithm>
 #include <map>
+#include <string>
 #include <vector>
 #include <cxxabi.h>
 
 #include "backtrace.h"
 
+#include "os_string.hpp"
+#include "os_thread.hpp"
+
 namespace trace {
 
 
@@ -287,6 +299,53 @@ namespace trace {
 
 #define BT_DEPTH 10
 
+
+/*
+ * A module loaded in the traced process, for recording frames to be
+ * symbolized offline.
+ */
+struct Module {
+    uintptr_t start;
+    uintptr_t end;
+    // load bias, i.e., where the module's ELF addresses are mapped from
+    uintptr_t bias;
+    std::string path;
+    std::string buildId;
+};
+
+/**
+ * Find the GNU build-id of a loaded module in its notes, in hex.
+ */
+static std::string
+getBuildId(uintptr_t bias, const ElfW(Phdr) *phdrs, unsigned num_phdrs) {
+    for (unsigned i = 0; i < num_phdrs; ++i) {
+        if (phdrs[i].p_type != PT_NOTE) {
+            continue;
+        }
+        const char *note = (const char *)(bias + phdrs[i].p_vaddr);
+        const char *end = note + phdrs[i].p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *nhdr = (const ElfW(Nhdr) *)note;
+            const char *name = note + sizeof *nhdr;
+            const unsigned char *desc =
+                (const unsigned char *)name + ((nhdr->n_namesz + 3) & ~3);
+            if (nhdr->n_type == NT_GNU_BUILD_ID &&
+                nhdr->n_namesz == 4 &&
+                memcmp(name, "GNU", 4) == 0) {
+                std::string buildId;
+                for (unsigned j = 0; j < nhdr->n_descsz; ++j) {
+                    char hex[3];
+                    snprintf(hex, sizeof hex, "%02x", desc[j]);
+                    buildId += hex;
+                }
+                return buildId;
+            }
+            note = (const char *)desc + ((nhdr->n_descsz + 3) & ~3);
+        }
+    }
+    return std::string();
+}
+
 class libbacktraceProvider {
     struct backtrace_state *state;
     int skipFrames;
@@ -295,6 +354,12 @@ class libbacktraceProvider {
     std::vector<RawStackFrame> *current, *current_frames;
     RawStackFrame *current_frame;
 
+    // Whether to leave symbolization for later, see APITRACE_BACKTRACE_RAW
+    bool raw;
+    // Modules loaded so far, by end address.  Never freed, as frames refer
+    // to their path and build-id.
+    std::map<uintptr_t, Module *> modules;
+
     static void bt_err_callback(void *vdata, const char *msg, int errnum)
     {
         if (errnum == -1)
@@ -338,10 +403,81 @@ class libbacktraceProvider {
         return 0;
     }
 
+    static int bt_module_callback(struct dl_phdr_info *info, size_t size,
+                                  void *vdata)
+    {
+        libbacktraceProvider *this_ = (libbacktraceProvider*)vdata;
+        uintptr_t start = ~(uintptr_t)0;
+        uintptr_t end = 0;
+        for (unsigned i = 0; i < info->dlpi_phnum; ++i) {
+            const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+            if (phdr.p_type == PT_LOAD) {
+                uintptr_t segmentStart = info->dlpi_addr + phdr.p_vaddr;
+                uintptr_t segmentEnd = segmentStart + phdr.p_memsz;
+                start = std::min(start, segmentStart);
+                end = std::max(end, segmentEnd);
+            }
+        }
+        if (start >= end || this_->modules.count(end)) {
+            return 0;
+        }
+
+        Module *module = new Module;
+        module->start = start;
+        module->end = end;
+        module->bias = info->dlpi_addr;
+        if (info->dlpi_name && info->dlpi_name[0]) {
+            module->path = info->dlpi_name;
+        } else {
+            // The executable itself
+            module->path = os::getProcessName().str();
+        }
+        module->buildId = getBuildId(info->dlpi_addr, info->dlpi_phdr,
+                                     info->dlpi_phnum);
+        this_->modules[end] = module;
+        return 0;
+    }
+
+    const Module *findModule(uintptr_t pc)
+    {
+        for (unsigned pass = 0; pass < 2; ++pass) {
+            std::map<uintptr_t, Module *>::const_iterator it =
+                modules.upper_bound(pc);
+            if (it != modules.end() && it->second->start <= pc) {
+                return it->second;
+            }
+            if (pass == 0) {
+                // Not loaded yet when last looked
+                dl_iterate_phdr(bt_module_callback, this);
+            }
+        }
+        return NULL;
+    }
+
+    RawStackFrame getRawFrame(uintptr_t pc)
+    {
+        RawStackFrame frame;
+        frame.id = nextFrameId++;
+        const Module *module = findModule(pc);
+        if (module) {
+            frame.module = module->path.c_str();
+            frame.address = pc - module->bias;
+            if (!module->buildId.empty()) {
+                frame.build_id = module->buildId.c_str();
+            }
+        } else {
+            frame.address = pc;
+        }
+        return frame;
+    }
+
     static int bt_callback(void *vdata, uintptr_t pc)
     {
         libbacktraceProvider *this_ = (libbacktraceProvider*)vdata;
         std::vector<RawStackFrame> &frames = this_->cache[pc];
+        if (!frames.size() && this_->raw) {
+            frames.push_back(this_->getRawFrame(pc));
+        }
         if (!frames.size()) {
             RawStackFrame frame;
             Dl_info info = {0};
@@ -366,6 +502,8 @@ public:
     libbacktraceProvider():
         state(backtrace_create_state(NULL, 0, bt_err_callback, NULL))
     {
+        const char *rawEnv = getenv("APITRACE_BACKTRACE_RAW");
+        raw = rawEnv && atoi(rawEnv) != 0;
         backtrace_simple(state, 0, bt_countskip, bt_err_callback, this);
     }
 
@@ -383,6 +521,223 @@ std::vector<RawStackFrame> get_backtrace() {
     return backtraceProvider.getParsedBacktrace();
 }
 
+
+/*
+ * Offline symbolization of the frames recorded with APITRACE_BACKTRACE_RAW.
+ *
+ * Symbols are looked up in the modules on this system, and kept in a cache
+ * of text files named after the modules' build-ids, so that they only need to
+ * be looked up once.
+ */
+class Symbolizer {
+    struct Symbol {
+        std::string function;
+        std::string filename;
+        int linenumber;
+    };
+
+    typedef std::map<unsigned long long, Symbol> SymbolMap;
+
+    struct ModuleSymbols {
+        std::string path;
+        // NULL if the module is not available
+        struct backtrace_state *state;
+        SymbolMap symbols;
+        // where new symbols are appended, or empty
+        std::string cachePath;
+    };
+
+    std::map<std::string, ModuleSymbols> modules;
+    std::string cacheDir;
+
+    static void err_callback(void *vdata, const char *msg, int errnum)
+    {
+        if (errnum == -1)
+            return;// no debug/sym info
+        else if (errnum)
+            os::log("libbacktrace: %s: %s\n", msg, strerror(errnum));
+        else
+            os::log("libbacktrace: %s\n", msg);
+    }
+
+    static int pcinfo_callback(void *vdata, uintptr_t pc,
+                               const char *file, int line, const char *func)
+    {
+        Symbol *symbol = (Symbol *)vdata;
+        if (func) {
+            symbol->function = func;
+        }
+        if (file) {
+            symbol->filename = file;
+            symbol->linenumber = line;
+        }
+        // Inlined functions come first, which is the most precise location
+        return 1;
+    }
+
+    static void syminfo_callback(void *vdata, uintptr_t pc,
+                                 const char *symname, uintptr_t symval)
+    {
+        Symbol *symbol = (Symbol *)vdata;
+        if (symname) {
+            symbol->function = symname;
+        }
+    }
+
+    void loadCache(ModuleSymbols &module, const char *buildId) {
+        module.cachePath = cacheDir + "/" + buildId;
+        FILE *fp = fopen(module.cachePath.c_str(), "rt");
+        if (!fp) {
+            return;
+        }
+        char line[4096];
+        while (fgets(line, sizeof line, fp)) {
+            // address, line number, function, and file name, tab separated
+            char *fields[4];
+            char *p = line;
+            unsigned numFields = 0;
+            while (numFields < 4) {
+                fields[numFields++] = p;
+                p = strpbrk(p, numFields < 4 ? "\t" : "\n");
+                if (!p) {
+                    break;
+                }
+                *p++ = 0;
+            }
+            if (numFields < 4) {
+                continue;
+            }
+            Symbol &symbol = module.symbols[strtoull(fields[0], NULL, 16)];
+            symbol.linenumber = atoi(fields[1]);
+            symbol.function = fields[2];
+            symbol.filename = fields[3];
+        }
+        fclose(fp);
+    }
+
+    void saveSymbol(ModuleSymbols &module, unsigned long long address,
+                    const Symbol &symbol) {
+        if (module.cachePath.empty()) {
+            return;
+        }
+        // Create the cache directory and its parents as needed
+        for (size_t i = 1; i <= cacheDir.size(); ++i) {
+            if (i == cacheDir.size() || cacheDir[i] == '/') {
+                os::createDirectory(os::String(cacheDir.substr(0, i).c_str()));
+            }
+        }
+        FILE *fp = fopen(module.cachePath.c_str(), "at");
+        if (!fp) {
+            return;
+        }
+        fprintf(fp, "%llx\t%i\t%s\t%s\n", address, symbol.linenumber,
+                symbol.function.c_str(), symbol.filename.c_str());
+        fclose(fp);
+    }
+
+    ModuleSymbols &getModule(const char *path, const char *buildId) {
+        std::string key = buildId ? buildId : path;
+        std::map<std::string, ModuleSymbols>::iterator it = modules.find(key);
+        if (it != modules.end()) {
+            return it->second;
+        }
+
+        ModuleSymbols &module = modules[key];
+        module.path = path;
+        module.state = NULL;
+
+        if (buildId && !cacheDir.empty()) {
+            loadCache(module, buildId);
+        }
+
+        // Prefer separate debug information, when installed
+        if (buildId && strlen(buildId) > 2) {
+            std::string debugPath = std::string("/usr/lib/debug/.build-id/") +
+                                    std::string(buildId, 2) + "/" +
+                                    (buildId + 2) + ".debug";
+            if (access(debugPath.c_str(), R_OK) == 0) {
+                module.path = debugPath;
+            }
+        }
+
+        // libbacktrace falls back to the running executable when it can't
+        // open the given one, which would give bogus symbols
+        if (access(module.path.c_str(), R_OK) == 0) {
+            module.state = backtrace_create_state(module.path.c_str(), 0,
+                                                  err_callback, NULL);
+        }
+        return module;
+    }
+
+public:
+    Symbolizer()
+    {
+        const char *dir = getenv("APITRACE_SYMBOL_CACHE");
+        if (dir) {
+            cacheDir = dir;
+        } else if ((dir = getenv("XDG_CACHE_HOME")) && dir[0]) {
+            cacheDir = std::string(dir) + "/apitrace/symbols";
+        } else if ((dir = getenv("HOME"))) {
+            cacheDir = std::string(dir) + "/.cache/apitrace/symbols";
+        }
+    }
+
+    void symbolize(StackFrame *frame)
+    {
+        if (frame->module == NULL) {
+            return;
+        }
+
+        ModuleSymbols &module = getModule(frame->module, frame->build_id);
+
+        unsigned long long address = frame->address;
+        SymbolMap::iterator it = module.symbols.find(address);
+        if (it == module.symbols.end()) {
+            if (!module.state) {
+                return;
+            }
+            Symbol symbol;
+            symbol.linenumber = -1;
+            backtrace_pcinfo(module.state, address, pcinfo_callback,
+                             err_callback, &symbol);
+            if (symbol.function.empty()) {
+                backtrace_syminfo(module.state, address, syminfo_callback,
+                                  err_callback, &symbol);
+            }
+            int status;
+            char *demangled = abi::__cxa_demangle(symbol.function.c_str(),
+                                                  NULL, NULL, &status);
+            if (demangled) {
+                symbol.function = demangled;
+                free(demangled);
+            }
+            // Unresolved addresses are cached too, to not look them up again
+            it = module.symbols.insert(std::make_pair(address, symbol)).first;
+            saveSymbol(module, address, symbol);
+        }
+
+        const Symbol &symbol = it->second;
+        if (!symbol.function.empty()) {
+            char *function = new char[symbol.function.size() + 1];
+            strcpy(function, symbol.function.c_str());
+            frame->function = function;
+        }
+        if (!symbol.filename.empty()) {
+            char *filename = new char[symbol.filename.size() + 1];
+            strcpy(filename, symbol.filename.c_str());
+            frame->filename = filename;
+            frame->linenumber = symbol.linenumber;
+        }
+    }
+};
+
+void symbolize_stack_frame(StackFrame *frame) {
+    static os::mutex mutex;
+    static Symbolizer symbolizer;
+    os::unique_lock<os::mutex> lock(mutex);
+    symbolizer.symbolize(frame);
+}
+
 #endif /* LINUX */
 
 } /* namespace trace */
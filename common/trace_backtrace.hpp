@@ -39,6 +39,12 @@ namespace trace {
 std::vector<RawStackFrame> get_backtrace();
 bool backtrace_is_needed(const char* fname);
 
+/**
+ * Resolve the function and source location of a frame recorded with just its
+ * module and address, see BACKTRACE_ADDRESS.
+ */
+void symbolize_stack_frame(StackFrame *frame);
+
 #else
 
 static inline std::vector<RawStackFrame> get_backtrace() {
@@ -49,6 +55,9 @@ static inline bool backtrace_is_needed(const char*) {
     return false;
 }
 
+static inline void symbolize_stack_frame(StackFrame *) {
+}
+
 #endif
 
 } /* namespace trace */
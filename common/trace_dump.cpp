@@ -24,6 +24,9 @@
  **************************************************************************/
 
 
+#include <assert.h>
+#include <string.h>
+
 #include <limits>
 
 #include "formatter.hpp"
@@ -33,6 +36,41 @@
 namespace trace {
 
 
+/*
+ * Values noted down by EventDumper, in the order Parser::parse_event()
+ * passes them.  Arrays, structs and reprs are followed by their elements.
+ */
+struct ValueRecord {
+    enum Type {
+        NULL_,
+        BOOL,
+        SINT,
+        UINT,
+        FLOAT,
+        DOUBLE,
+        STRING,
+        ENUM,
+        BITMASK,
+        POINTER,
+        BLOB,
+        ARRAY,
+        STRUCT,
+        REPR
+    };
+
+    Type type;
+    const void *sig;
+    union {
+        signed long long sint;
+        unsigned long long uint;
+        float float_;
+        double double_;
+    };
+    // string length, blob size or array length
+    size_t size;
+};
+
+
 class Dumper : public Visitor
 {
 protected:
@@ -63,7 +101,7 @@ public:
         literal = formatter->color(formatter::BLUE);
     }
 
-    ~Dumper() {
+    virtual ~Dumper() {
         delete normal;
         delete bold;
         delete italic;
@@ -74,37 +112,30 @@ public:
         delete formatter;
     }
 
-    void visit(Null *) {
+    void dumpNull(void) {
         os << literal << "NULL" << normal;
     }
 
-    void visit(Bool *node) {
-        os << literal << (node->value ? "true" : "false") << normal;
+    void dumpBool(bool value) {
+        os << literal << (value ? "true" : "false") << normal;
     }
 
-    void visit(SInt *node) {
-        os << literal << node->value << normal;
+    template< class T >
+    void dumpLiteral(T value) {
+        os << literal << value << normal;
     }
 
-    void visit(UInt *node) {
-        os << literal << node->value << normal;
-    }
-
-    void visit(Float *node) {
-        std::streamsize oldPrecision = os.precision(std::numeric_limits<float>::digits10 + 1);
-        os << literal << node->value << normal;
-        os.precision(oldPrecision);
-    }
-
-    void visit(Double *node) {
-        std::streamsize oldPrecision = os.precision(std::numeric_limits<double>::digits10 + 1);
-        os << literal << node->value << normal;
+    template< class T >
+    void dumpReal(T value) {
+        std::streamsize oldPrecision = os.precision(std::numeric_limits<T>::digits10 + 1);
+        os << literal << value << normal;
         os.precision(oldPrecision);
     }
 
-    void visit(String *node) {
+    // Strings end at their first NUL, or else at end, if not NULL
+    void dumpString(const char *str, const char *end) {
         os << literal << "\"";
-        for (const char *it = node->value; *it; ++it) {
+        for (const char *it = str; it != end && *it; ++it) {
             unsigned char c = (unsigned char) *it;
             if (c == '\"')
                 os << "\\\"";
@@ -134,18 +165,17 @@ public:
         os << "\"" << normal;
     }
 
-    void visit(Enum *node) {
-        const EnumValue *it = node->lookup();
-        if (it) {
-            os << literal << it->name << normal;
-            return;
+    void dumpEnum(const EnumSig *sig, signed long long value) {
+        for (const EnumValue *it = sig->values; it != sig->values + sig->num_values; ++it) {
+            if (it->value == value) {
+                os << literal << it->name << normal;
+                return;
+            }
         }
-        os << literal << node->value << normal;
+        os << literal << value << normal;
     }
 
-    void visit(Bitmask *bitmask) {
-        unsigned long long value = bitmask->value;
-        const BitmaskSig *sig = bitmask->sig;
+    void dumpBitmask(const BitmaskSig *sig, unsigned long long value) {
         bool first = true;
         for (const BitmaskFlag *it = sig->flags; it != sig->flags + sig->num_flags; ++it) {
             assert(it->value || first);
@@ -170,6 +200,54 @@ public:
         }
     }
 
+    void dumpBlob(size_t size) {
+        os << pointer << "blob(" << size << ")" << normal;
+    }
+
+    void dumpPointer(unsigned long long value) {
+        os << pointer << "0x" << std::hex << value << std::dec << normal;
+    }
+
+    void dumpMemberName(const char *sep, const char *name) {
+        os << sep << italic << name << normal << " = ";
+    }
+
+    void visit(Null *) {
+        dumpNull();
+    }
+
+    void visit(Bool *node) {
+        dumpBool(node->value);
+    }
+
+    void visit(SInt *node) {
+        dumpLiteral(node->value);
+    }
+
+    void visit(UInt *node) {
+        dumpLiteral(node->value);
+    }
+
+    void visit(Float *node) {
+        dumpReal(node->value);
+    }
+
+    void visit(Double *node) {
+        dumpReal(node->value);
+    }
+
+    void visit(String *node) {
+        dumpString(node->value, NULL);
+    }
+
+    void visit(Enum *node) {
+        dumpEnum(node->sig, node->value);
+    }
+
+    void visit(Bitmask *bitmask) {
+        dumpBitmask(bitmask->sig, bitmask->value);
+    }
+
     const char *
     visitMembers(Struct *s, const char *sep = "") {
         for (unsigned i = 0; i < s->members.size(); ++i) {
@@ -186,7 +264,7 @@ public:
                 }
             }
 
-            os << sep << italic << memberName << normal << " = ",
+            dumpMemberName(sep, memberName);
             _visit(memberValue);
             sep = ", ";
         }
@@ -217,17 +295,133 @@ public:
     }
 
     void visit(Blob *blob) {
-        os << pointer << "blob(" << blob->size << ")" << normal;
+        dumpBlob(blob->size);
     }
 
     void visit(Pointer *p) {
-        os << pointer << "0x" << std::hex << p->value << std::dec << normal;
+        dumpPointer(p->value);
     }
 
     void visit(Repr *r) {
         _visit(r->humanValue);
     }
 
+    /**
+     * Dump the value noted down at the given record, returning the record
+     * which follows it.
+     */
+    const ValueRecord *
+    dumpRecord(const ValueRecord *r, const char *strings) {
+        const ValueRecord *next = r + 1;
+        switch (r->type) {
+        case ValueRecord::NULL_:
+            dumpNull();
+            break;
+        case ValueRecord::BOOL:
+            dumpBool(r->uint);
+            break;
+        case ValueRecord::SINT:
+            dumpLiteral(r->sint);
+            break;
+        case ValueRecord::UINT:
+            dumpLiteral(r->uint);
+            break;
+        case ValueRecord::FLOAT:
+            dumpReal(r->float_);
+            break;
+        case ValueRecord::DOUBLE:
+            dumpReal(r->double_);
+            break;
+        case ValueRecord::STRING:
+            dumpString(strings + r->uint, strings + r->uint + r->size);
+            break;
+        case ValueRecord::ENUM:
+            dumpEnum(static_cast<const EnumSig *>(r->sig), r->sint);
+            break;
+        case ValueRecord::BITMASK:
+            dumpBitmask(static_cast<const BitmaskSig *>(r->sig), r->uint);
+            break;
+        case ValueRecord::POINTER:
+            dumpPointer(r->uint);
+            break;
+        case ValueRecord::BLOB:
+            dumpBlob(r->size);
+            break;
+        case ValueRecord::ARRAY:
+            if (r->size == 1) {
+                os << "&";
+                next = dumpRecord(next, strings);
+            } else {
+                const char *sep = "";
+                os << "{";
+                for (size_t i = 0; i < r->size; ++i) {
+                    os << sep;
+                    next = dumpRecord(next, strings);
+                    sep = ", ";
+                }
+                os << "}";
+            }
+            break;
+        case ValueRecord::STRUCT:
+            {
+                const char *sep = "";
+                os << "{";
+                next = dumpRecordMembers(r, strings, sep);
+                os << "}";
+            }
+            break;
+        case ValueRecord::REPR:
+            next = dumpRecord(next, strings);
+            next = skipRecord(next);
+            break;
+        }
+        return next;
+    }
+
+    const ValueRecord *
+    dumpRecordMembers(const ValueRecord *r, const char *strings, const char *&sep) {
+        const StructSig *sig = static_cast<const StructSig *>(r->sig);
+        ++r;
+        for (unsigned i = 0; i < sig->num_members; ++i) {
+            const char *memberName = sig->member_names[i];
+
+            if ((!memberName || !*memberName) &&
+                r->type == ValueRecord::STRUCT) {
+                // Anonymous structure
+                r = dumpRecordMembers(r, strings, sep);
+                continue;
+            }
+
+            dumpMemberName(sep, memberName);
+            r = dumpRecord(r, strings);
+            sep = ", ";
+        }
+        return r;
+    }
+
+    static const ValueRecord *
+    skipRecord(const ValueRecord *r) {
+        size_t count = 1;
+        while (count) {
+            switch (r->type) {
+            case ValueRecord::ARRAY:
+                count += r->size;
+                break;
+            case ValueRecord::STRUCT:
+                count += static_cast<const StructSig *>(r->sig)->num_members;
+                break;
+            case ValueRecord::REPR:
+                count += 2;
+                break;
+            default:
+                break;
+            }
+            ++r;
+            --count;
+        }
+        return r;
+    }
+
     void visit(StackFrame *frame) {
         if (frame->module != NULL) {
             os << frame->module << " ";
@@ -244,22 +438,26 @@ public:
         else {
             if (frame->offset >= 0) {
                 os << "[" << "0x" << std::hex << frame->offset << std::dec << "]";
+            } else if (frame->address >= 0) {
+                os << "[" << "0x" << std::hex << frame->address << std::dec << "]";
             }
         }
     }
 
-    void visit(Backtrace & backtrace) {
-        for (int i = 0; i < backtrace.size(); i ++) {
+    void visit(const Backtrace & backtrace) {
+        for (unsigned i = 0; i < backtrace.size(); i ++) {
             visit(backtrace[i]);
             os << "\n";
         }
     }
 
-    void visit(Call *call) {
-        CallFlags callFlags = call->flags;
-        
+    void visit(Backtrace & backtrace) {
+        visit(const_cast<const Backtrace &>(backtrace));
+    }
+
+    void dumpCallName(unsigned no, const FunctionSig *sig, CallFlags callFlags) {
         if (!(dumpFlags & DUMP_FLAG_NO_CALL_NO)) {
-            os << call->no << " ";
+            os << no << " ";
         }
 
         if (callFlags & CALL_FLAG_NON_REPRODUCIBLE) {
@@ -269,15 +467,40 @@ public:
         } else {
             os << bold;
         }
-        os << call->sig->name << normal;
+        os << sig->name << normal;
+    }
+
+    void dumpArgName(const FunctionSig *sig, unsigned index) {
+        if (!(dumpFlags & DUMP_FLAG_NO_ARG_NAMES)) {
+            os << italic << sig->arg_names[index] << normal << " = ";
+        }
+    }
+
+    void dumpCallEnd(CallFlags callFlags, const Backtrace *backtrace) {
+        if (callFlags & CALL_FLAG_INCOMPLETE) {
+            os << " // " << red << "incomplete" << normal;
+        }
+        
+        os << "\n";
+
+        if (backtrace != NULL) {
+            os << bold << red << "Backtrace:\n" << normal;
+            visit(*backtrace);
+        }
+        if (callFlags & CALL_FLAG_END_FRAME) {
+            os << "\n";
+        }
+    }
+
+    void visit(Call *call) {
+        dumpCallName(call->no, call->sig, call->flags);
 
         os << "(";
         const char *sep = "";
+        call->decodeArgs();
         for (unsigned i = 0; i < call->args.size(); ++i) {
             os << sep;
-            if (!(dumpFlags & DUMP_FLAG_NO_ARG_NAMES)) {
-                os << italic << call->sig->arg_names[i] << normal << " = ";
-            }
+            dumpArgName(call->sig, i);
             if (call->args[i].value) {
                 _visit(call->args[i].value);
             } else {
@@ -291,22 +514,329 @@ public:
             os << " = ";
             _visit(call->ret);
         }
-        
-        if (callFlags & CALL_FLAG_INCOMPLETE) {
-            os << " // " << red << "incomplete" << normal;
+
+        dumpCallEnd(call->flags, call->backtrace);
+    }
+};
+
+
+struct EventDumper::PendingCall : public EventDumper::CallInfo {
+    std::vector<ValueRecord> records;
+    // contents of the strings among the records
+    std::vector<char> strings;
+    // first record of each argument and of the return value, if any
+    std::vector<size_t> args;
+    size_t ret;
+    Backtrace backtrace;
+    bool hasBacktrace;
+
+    ValueRecord &
+    add(ValueRecord::Type type) {
+        records.resize(records.size() + 1);
+        ValueRecord &record = records.back();
+        record.type = type;
+        return record;
+    }
+};
+
+
+static const size_t NO_RECORD = ~(size_t)0;
+
+
+EventDumper::EventDumper(std::ostream &_os, DumpFlags _flags) :
+    os(_os),
+    dumpFlags(_flags),
+    current(NULL),
+    entering(false)
+{
+    dumper = new Dumper(os, dumpFlags);
+}
+
+
+EventDumper::~EventDumper() {
+    if (current) {
+        release(current);
+    }
+    for (unsigned i = 0; i < pending.size(); ++i) {
+        delete pending[i];
+    }
+    for (unsigned i = 0; i < spare.size(); ++i) {
+        delete spare[i];
+    }
+    delete dumper;
+}
+
+
+void EventDumper::finish(void) {
+    // Calls cut short are dropped, as the parser does
+    if (current) {
+        release(current);
+        current = NULL;
+    }
+    for (unsigned i = 0; i < pending.size(); ++i) {
+        PendingCall *call = pending[i];
+        call->flags |= CALL_FLAG_INCOMPLETE;
+        dumpCall(call);
+        release(call);
+    }
+    pending.clear();
+}
+
+
+void EventDumper::release(PendingCall *call) {
+    spare.push_back(call);
+}
+
+
+void EventDumper::onEnter(const FunctionSig *sig, CallFlags flags,
+                          unsigned thread_id, unsigned call_no) {
+    if (current) {
+        release(current);
+    }
+
+    PendingCall *call;
+    if (spare.empty()) {
+        call = new PendingCall;
+    } else {
+        call = spare.back();
+        spare.pop_back();
+    }
+    call->no = call_no;
+    call->sig = sig;
+    call->flags = flags;
+    call->thread_id = thread_id;
+    call->timed = false;
+    call->enter_time = 0;
+    call->duration = 0;
+    call->records.clear();
+    call->strings.clear();
+    call->args.assign(sig->num_args, NO_RECORD);
+    call->ret = NO_RECORD;
+    call->backtrace.clear();
+    call->hasBacktrace = false;
+
+    current = call;
+    entering = true;
+}
+
+
+void EventDumper::onLeave(unsigned call_no) {
+    if (current) {
+        release(current);
+    }
+    current = NULL;
+    entering = false;
+    for (std::vector<PendingCall *>::iterator it = pending.begin(); it != pending.end(); ++it) {
+        if ((*it)->no == call_no) {
+            current = *it;
+            pending.erase(it);
+            break;
         }
-        
-        os << "\n";
+    }
+}
 
-        if (call->backtrace != NULL) {
-            os << bold << red << "Backtrace:\n" << normal;
-            visit(*call->backtrace);
+
+void EventDumper::onEnd(void) {
+    if (!current) {
+        return;
+    }
+    if (entering) {
+        pending.push_back(current);
+    } else {
+        dumpCall(current);
+        release(current);
+    }
+    current = NULL;
+}
+
+
+void EventDumper::onArg(unsigned index) {
+    if (current) {
+        if (index >= current->args.size()) {
+            current->args.resize(index + 1, NO_RECORD);
         }
-        if (callFlags & CALL_FLAG_END_FRAME) {
-            os << "\n";
+        current->args[index] = current->records.size();
+    }
+}
+
+
+void EventDumper::onRet(void) {
+    if (current) {
+        current->ret = current->records.size();
+    }
+}
+
+
+void EventDumper::onTime(unsigned long long time) {
+    if (current) {
+        // The enter event's time comes first
+        if (current->timed) {
+            current->duration = time;
+        } else {
+            current->enter_time = time;
+            current->timed = true;
         }
     }
-};
+}
+
+
+void EventDumper::onBacktrace(const Backtrace &backtrace) {
+    if (current) {
+        current->backtrace.assign(backtrace.begin(), backtrace.end());
+        current->hasBacktrace = true;
+    }
+}
+
+
+void EventDumper::onNull(void) {
+    if (current) {
+        current->add(ValueRecord::NULL_);
+    }
+}
+
+
+void EventDumper::onBool(bool value) {
+    if (current) {
+        current->add(ValueRecord::BOOL).uint = value;
+    }
+}
+
+
+void EventDumper::onSInt(signed long long value) {
+    if (current) {
+        current->add(ValueRecord::SINT).sint = value;
+    }
+}
+
+
+void EventDumper::onUInt(unsigned long long value) {
+    if (current) {
+        current->add(ValueRecord::UINT).uint = value;
+    }
+}
+
+
+void EventDumper::onFloat(float value) {
+    if (current) {
+        current->add(ValueRecord::FLOAT).float_ = value;
+    }
+}
+
+
+void EventDumper::onDouble(double value) {
+    if (current) {
+        current->add(ValueRecord::DOUBLE).double_ = value;
+    }
+}
+
+
+void EventDumper::onString(const char *str, size_t len) {
+    if (current) {
+        ValueRecord &record = current->add(ValueRecord::STRING);
+        record.uint = current->strings.size();
+        record.size = len;
+        current->strings.insert(current->strings.end(), str, str + len);
+    }
+}
+
+
+void EventDumper::onEnum(const EnumSig *sig, signed long long value) {
+    if (current) {
+        ValueRecord &record = current->add(ValueRecord::ENUM);
+        record.sig = sig;
+        record.sint = value;
+    }
+}
+
+
+void EventDumper::onBitmask(const BitmaskSig *sig, unsigned long long value) {
+    if (current) {
+        ValueRecord &record = current->add(ValueRecord::BITMASK);
+        record.sig = sig;
+        record.uint = value;
+    }
+}
+
+
+void EventDumper::onPointer(unsigned long long value) {
+    if (current) {
+        current->add(ValueRecord::POINTER).uint = value;
+    }
+}
+
+
+void EventDumper::onBlob(const void *data, size_t size) {
+    if (current) {
+        current->add(ValueRecord::BLOB).size = size;
+    }
+}
+
+
+void EventDumper::beginArray(size_t length) {
+    if (current) {
+        current->add(ValueRecord::ARRAY).size = length;
+    }
+}
+
+
+void EventDumper::beginStruct(const StructSig *sig) {
+    if (current) {
+        current->add(ValueRecord::STRUCT).sig = sig;
+    }
+}
+
+
+void EventDumper::beginRepr(void) {
+    if (current) {
+        current->add(ValueRecord::REPR);
+    }
+}
+
+
+void EventDumper::dumpCall(PendingCall *call) {
+    const ValueRecord *records = call->records.empty() ? NULL : &call->records[0];
+    const char *strings = call->strings.empty() ? NULL : &call->strings[0];
+
+    // Mark glGetError() = GL_NO_ERROR as verbose, like the parser does
+    if (call->ret != NO_RECORD &&
+        call->sig->num_args == 0 &&
+        strcmp(call->sig->name, "glGetError") == 0) {
+        const ValueRecord &ret = records[call->ret];
+        if ((ret.type == ValueRecord::ENUM ||
+             ret.type == ValueRecord::SINT ||
+             ret.type == ValueRecord::UINT) &&
+            ret.uint == 0) {
+            call->flags |= CALL_FLAG_VERBOSE;
+        }
+    }
+
+    if (!beginCall(*call)) {
+        return;
+    }
+
+    dumper->dumpCallName(call->no, call->sig, call->flags);
+
+    os << "(";
+    const char *sep = "";
+    for (unsigned i = 0; i < call->args.size(); ++i) {
+        os << sep;
+        dumper->dumpArgName(call->sig, i);
+        if (call->args[i] != NO_RECORD) {
+            dumper->dumpRecord(records + call->args[i], strings);
+        } else {
+           os << "?";
+        }
+        sep = ", ";
+    }
+    os << ")";
+
+    if (call->ret != NO_RECORD) {
+        os << " = ";
+        dumper->dumpRecord(records + call->ret, strings);
+    }
+
+    dumper->dumpCallEnd(call->flags, call->hasBacktrace ? &call->backtrace : NULL);
+}
 
 
 void dump(Value *value, std::ostream &os, DumpFlags flags) {
@@ -32,8 +32,10 @@
 
 
 #include <iostream>
+#include <vector>
 
 #include "trace_model.hpp"
+#include "trace_parser.hpp"
 
 
 namespace trace {
@@ -68,6 +70,91 @@ inline std::ostream & operator <<(std::ostream &os, Call &call) {
 }
 
 
+class Dumper;
+
+
+/**
+ * Dumps calls as Parser::parse_event() decodes them, without building them.
+ * Calls are dumped as they leave, in the same order as parse_call() returns
+ * them, so their values are noted down compactly until then.
+ */
+class EventDumper : public ParseHandler
+{
+public:
+    struct CallInfo {
+        unsigned no;
+        const FunctionSig *sig;
+        CallFlags flags;
+        unsigned thread_id;
+        bool timed;
+        unsigned long long enter_time;
+        unsigned long long duration;
+    };
+
+    EventDumper(std::ostream &os, DumpFlags flags = 0);
+
+    ~EventDumper();
+
+    /**
+     * Dump the calls which never left, as incomplete, at the end of the
+     * trace.
+     */
+    void finish(void);
+
+    void onEnter(const FunctionSig *sig, CallFlags flags,
+                 unsigned thread_id, unsigned call_no);
+    void onLeave(unsigned call_no);
+    void onEnd(void);
+
+    void onArg(unsigned index);
+    void onRet(void);
+    void onTime(unsigned long long time);
+    void onBacktrace(const Backtrace &backtrace);
+
+    void onNull(void);
+    void onBool(bool value);
+    void onSInt(signed long long value);
+    void onUInt(unsigned long long value);
+    void onFloat(float value);
+    void onDouble(double value);
+    void onString(const char *str, size_t len);
+    void onEnum(const EnumSig *sig, signed long long value);
+    void onBitmask(const BitmaskSig *sig, unsigned long long value);
+    void onPointer(unsigned long long value);
+    void onBlob(const void *data, size_t size);
+    void beginArray(size_t length);
+    void beginStruct(const StructSig *sig);
+    void beginRepr(void);
+
+protected:
+    /**
+     * Called before dumping each call, to tell whether to dump it at all,
+     * and to write anything which should come before it.
+     */
+    virtual bool beginCall(const CallInfo &call) {
+        return true;
+    }
+
+private:
+    struct PendingCall;
+
+    std::ostream &os;
+    DumpFlags dumpFlags;
+    Dumper *dumper;
+
+    // entered calls, in order, and those to reuse
+    std::vector<PendingCall *> pending;
+    std::vector<PendingCall *> spare;
+
+    // call whose event is being decoded, and whether entering it
+    PendingCall *current;
+    bool entering;
+
+    void release(PendingCall *call);
+    void dumpCall(PendingCall *call);
+};
+
+
 } /* namespace trace */
 
 #endif /* _TRACE_DUMP_HPP_ */
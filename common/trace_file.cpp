@@ -28,14 +28,40 @@
 
 #include <assert.h>
 
+#include "os_thread.hpp"
+
 
 using namespace trace;
 
 
+// Chunks are mostly released by whatever thread deletes the values pointing
+// into them, so the count is updated atomically.
+void SharedChunk::ref(void)
+{
+    os::atomic_fetch_add(&m_refCount, 1U);
+}
+
+void SharedChunk::unref(void)
+{
+    unsigned previous = os::atomic_fetch_add(&m_refCount, -1U);
+    assert(previous > 0);
+    if (previous == 1) {
+        delete this;
+    }
+}
+
+SharedChunk::~SharedChunk()
+{
+    delete [] m_data;
+}
+
+
 File::File(const std::string &filename,
            File::Mode mode)
     : m_mode(mode),
-      m_isOpened(false)
+      m_isOpened(false),
+      m_readPtr(NULL),
+      m_readEnd(NULL)
 {
     if (!filename.empty()) {
         open(filename, m_mode);
@@ -49,8 +75,48 @@ File::~File()
 }
 
 
+bool File::isStream() const
+{
+    return false;
+}
+
+bool File::rawOpenStream(std::streambuf *stream, File::Mode mode)
+{
+    // Only chunked files can be streamed
+    delete stream;
+    return false;
+}
+
 void File::setCurrentOffset(const File::Offset &offset)
 {
     assert(0);
 }
 
+void File::setCompressionThreads(unsigned threads)
+{
+}
+
+void File::setCompressionLevel(int level)
+{
+}
+
+bool File::writeIndex(const std::string &index)
+{
+    return false;
+}
+
+bool File::readIndex(std::string &index)
+{
+    return false;
+}
+
+bool File::resolveOffset(File::Offset &offset)
+{
+    return false;
+}
+
+char *File::readShared(size_t length, SharedChunk *&chunk)
+{
+    return NULL;
+}
+
@@ -27,17 +27,58 @@
 #ifndef TRACE_FILE_HPP
 #define TRACE_FILE_HPP
 
+#include <string.h>
+#include <stdint.h>
+
 #include <string>
 #include <fstream>
-#include <stdint.h>
+#include <streambuf>
 
 
 #define SNAPPY_BYTE1 'a'
 #define SNAPPY_BYTE2 't'
 
+#define ZSTD_BYTE1 'a'
+#define ZSTD_BYTE2 'z'
+
+#define LZ4_BYTE1 'a'
+#define LZ4_BYTE2 'l'
+
+#define RAW_BYTE1 'a'
+#define RAW_BYTE2 'r'
+
 
 namespace trace {
 
+
+/**
+ * Reference counted buffer of decompressed data, which values can point into
+ * instead of copying the data out.  It is freed once the file and all such
+ * values are done with it, from whatever thread that happens.
+ */
+class SharedChunk {
+public:
+    // Takes ownership of data, which must have been allocated with new []
+    SharedChunk(char *data) :
+        m_data(data),
+        m_refCount(1)
+    {}
+
+    char *data(void) const {
+        return m_data;
+    }
+
+    void ref(void);
+    void unref(void);
+
+private:
+    ~SharedChunk();
+
+    char *m_data;
+    volatile unsigned m_refCount;
+};
+
+
 class File {
 public:
     enum Mode {
@@ -56,6 +97,10 @@ public:
 public:
     static File *createZLib(void);
     static File *createSnappy(void);
+    static File *createZstd(void);
+    static File *createLZ4(void);
+    static File *createRaw(void);
+    static File *createForCodec(const char *codec);
     static File *createForRead(const char *filename);
     static File *createForWrite(const char *filename);
 public:
@@ -67,19 +112,67 @@ public:
     File::Mode mode() const;
 
     bool open(const std::string &filename, File::Mode mode);
+    bool open(std::streambuf *stream, File::Mode mode);
     bool write(const void *buffer, size_t length);
     size_t read(void *buffer, size_t length);
     void close();
     void flush(void);
     int getc();
     bool skip(size_t length);
+    const char *readInPlace(size_t length);
     int percentRead();
 
     virtual bool supportsOffsets() const = 0;
+
+    /**
+     * Whether the file is a pipe or socket (see os::isStream), which can't
+     * seek, and whose reader may be waiting for data as it is written.
+     */
+    virtual bool isStream() const;
+
     virtual File::Offset currentOffset() = 0;
     virtual void setCurrentOffset(const File::Offset &offset);
+
+    /**
+     * Number of threads used to compress when writing, to be set before
+     * opening.  Zero means compressing on the writing thread.
+     */
+    virtual void setCompressionThreads(unsigned threads);
+
+    /**
+     * Compression level, to be set before opening for writing.  Its meaning
+     * depends on the codec, and it is ignored by codecs without levels.
+     */
+    virtual void setCompressionLevel(int level);
+
+    /**
+     * Append an index after the end of the data, right before closing a file
+     * open for writing.  The index is opaque to the file, but any offsets in
+     * it must be ones returned by currentOffset() while writing.
+     */
+    virtual bool writeIndex(const std::string &index);
+
+    /**
+     * Retrieve the index of a file open for reading, if it has one.
+     */
+    virtual bool readIndex(std::string &index);
+
+    /**
+     * Map an offset found in the index to one which can be passed to
+     * setCurrentOffset().
+     */
+    virtual bool resolveOffset(File::Offset &offset);
+
+    /**
+     * Read length bytes without copying them, when they are all in the
+     * current decompressed chunk.  Returns where they are, with a reference
+     * to the chunk which the caller must unref() once done with them, or
+     * NULL if they must be copied with read() instead.
+     */
+    virtual char *readShared(size_t length, SharedChunk *&chunk);
 protected:
     virtual bool rawOpen(const std::string &filename, File::Mode mode) = 0;
+    virtual bool rawOpenStream(std::streambuf *stream, File::Mode mode);
     virtual bool rawWrite(const void *buffer, size_t length) = 0;
     virtual size_t rawRead(void *buffer, size_t length) = 0;
     virtual int rawGetc() = 0;
@@ -91,6 +184,16 @@ protected:
 protected:
     File::Mode m_mode;
     bool m_isOpened;
+
+    /**
+     * Window of data which has been decompressed but not read yet, which
+     * read(), getc() and skip() consume inline, only calling into the
+     * implementation once it is exhausted.  Implementations that keep such
+     * a buffer should use these as their read position, and leave them NULL
+     * otherwise.
+     */
+    const char *m_readPtr;
+    const char *m_readEnd;
 };
 
 inline bool File::isOpened() const
@@ -114,6 +217,21 @@ inline bool File::open(const std::string &filename, File::Mode mode)
     return m_isOpened;
 }
 
+/**
+ * Open an already opened stream, such as one from os::openStream, taking
+ * ownership of it.
+ */
+inline bool File::open(std::streambuf *stream, File::Mode mode)
+{
+    if (m_isOpened) {
+        close();
+    }
+    m_isOpened = rawOpenStream(stream, mode);
+    m_mode = mode;
+
+    return m_isOpened;
+}
+
 inline bool File::write(const void *buffer, size_t length)
 {
     if (!m_isOpened || m_mode != File::Write) {
@@ -124,6 +242,11 @@ inline bool File::write(const void *buffer, size_t length)
 
 inline size_t File::read(void *buffer, size_t length)
 {
+    if (length <= (size_t)(m_readEnd - m_readPtr)) {
+        memcpy(buffer, m_readPtr, length);
+        m_readPtr += length;
+        return length;
+    }
     if (!m_isOpened || m_mode != File::Read) {
         return 0;
     }
@@ -144,6 +267,8 @@ inline void File::close()
         rawClose();
         m_isOpened = false;
     }
+    m_readPtr = NULL;
+    m_readEnd = NULL;
 }
 
 inline void File::flush(void)
@@ -155,6 +280,9 @@ inline void File::flush(void)
 
 inline int File::getc()
 {
+    if (m_readPtr < m_readEnd) {
+        return (unsigned char)*m_readPtr++;
+    }
     if (!m_isOpened || m_mode != File::Read) {
         return -1;
     }
@@ -163,6 +291,10 @@ inline int File::getc()
 
 inline bool File::skip(size_t length)
 {
+    if (length <= (size_t)(m_readEnd - m_readPtr)) {
+        m_readPtr += length;
+        return true;
+    }
     if (!m_isOpened || m_mode != File::Read) {
         return false;
     }
@@ -170,6 +302,22 @@ inline bool File::skip(size_t length)
 }
 
 
+/**
+ * Read length bytes where they are, when already decompressed, returning
+ * NULL if they must be copied with read() instead.  They are only valid
+ * until the file is read further.
+ */
+inline const char *File::readInPlace(size_t length)
+{
+    if (length <= (size_t)(m_readEnd - m_readPtr)) {
+        const char *data = m_readPtr;
+        m_readPtr += length;
+        return data;
+    }
+    return NULL;
+}
+
+
 inline bool
 operator<(const File::Offset &one, const File::Offset &two)
 {
@@ -0,0 +1,1397 @@
+/**************************************************************************
+ *
+ * Copyright 2011 Zack Rusin
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "trace_file_chunked.hpp"
+
+
+#define CHUNK_SIZE (1 * 1024 * 1024)
+
+/*
+ * How much compressed data to ask the OS to prefetch ahead of the chunk being
+ * decompressed, when the file is memory mapped.
+ */
+#define READAHEAD_SIZE (16 * 1024 * 1024)
+
+/*
+ * Number of chunk buffers used when compressing asynchronously with a single
+ * thread: one being filled, one being compressed, and one spare so that
+ * filling can carry on while the previous chunk is still being written.
+ */
+#define WRITE_BUFFERS 3
+
+#define INDEX_MAGIC "atindex1"
+#define INDEX_MAGIC_SIZE 8
+
+
+
+using namespace trace;
+
+
+/*
+ * Identifies the compression thread, so that we don't wait on ourselves
+ * when flushing due to an exception raised on it.
+ */
+static OS_THREAD_SPECIFIC_PTR(void)
+compressionThread;
+
+/*
+ * Number of read-ahead threads, as specified by the APITRACE_READAHEAD
+ * environment variable.  Read-ahead is disabled by default.
+ */
+static unsigned
+readAheadThreads(void)
+{
+    const char *threads = getenv("APITRACE_READAHEAD");
+    if (!threads) {
+        return 0;
+    }
+    int n = atoi(threads);
+    return n > 0 ? n : 0;
+}
+
+static void
+putUInt64(std::string &buf, uint64_t value)
+{
+    for (unsigned i = 0; i < 8; ++i) {
+        buf += (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static uint64_t
+getUInt64(const char *buf)
+{
+    uint64_t value = 0;
+    for (unsigned i = 0; i < 8; ++i) {
+        value |= (uint64_t)(unsigned char)buf[i] << (8 * i);
+    }
+    return value;
+}
+
+
+ChunkedFile::ChunkedFile(char byte1, char byte2)
+    : File(),
+      m_byte1(byte1),
+      m_byte2(byte2),
+      m_streambuf(NULL),
+      m_streaming(false),
+      m_stream(NULL),
+      m_cacheMaxSize(CHUNK_SIZE),
+      m_cacheSize(m_cacheMaxSize),
+      m_cache(new char [m_cacheMaxSize]),
+      m_cachePtr(m_cache),
+      m_cacheShared(NULL),
+      m_compressedCache(NULL),
+      m_nextChunk(0),
+      m_mapping(NULL),
+      m_mappingSize(0),
+      m_mappingPos(0),
+      m_writeChunks(0),
+      m_writePos(0),
+      m_hasIndex(false),
+      m_readAheadStop(false),
+      m_readAheadGeneration(0),
+      m_fetchPos(0),
+      m_fetchSeq(0),
+      m_fetchSeek(false),
+      m_fetchEof(false),
+      m_consumeSeq(0),
+      m_eof(false),
+      m_compressionThreads(1),
+      m_compressionCurrent(NULL),
+      m_compressionNextSeq(0),
+      m_compressionWriteSeq(0),
+      m_compressionInFlight(0),
+      m_compressionWriting(false),
+      m_compressionStop(false)
+{
+    m_parked.data = NULL;
+    m_parked.size = 0;
+    m_parked.maxSize = 0;
+    m_parked.shared = NULL;
+    m_parked.chunk = 0;
+    m_parked.next = 0;
+#ifdef _WIN32
+    m_mappingHandle = NULL;
+#endif
+}
+
+ChunkedFile::~ChunkedFile()
+{
+    // Subclasses must close the file, as closing needs to compress.
+    assert(!m_isOpened);
+    assert(!m_cacheShared);
+    delete [] m_compressedCache;
+    delete [] m_cache;
+}
+
+bool ChunkedFile::rawOpen(const std::string &filename, File::Mode mode)
+{
+    if (os::isStream(filename.c_str())) {
+        std::streambuf *stream = os::openStream(filename.c_str(),
+                                                mode == File::Write);
+        return stream && rawOpenStream(stream, mode);
+    }
+
+    std::ios_base::openmode fmode = std::fstream::binary;
+
+    prepareOpen(mode);
+
+    if (mode == File::Write) {
+        fmode |= (std::fstream::out | std::fstream::trunc);
+    } else if (mode == File::Read) {
+        fmode |= std::fstream::in;
+
+        if (mapFile(filename)) {
+            // check the file identifier
+            if (m_mappingSize < 2 ||
+                m_mapping[0] != m_byte1 ||
+                m_mapping[1] != m_byte2) {
+                unmapFile();
+                return false;
+            }
+            m_mappingPos = 2;
+            m_fetchPos = 2;
+
+            loadIndex();
+            startReadAhead(readAheadThreads());
+            flushReadCache();
+            return true;
+        }
+    }
+
+    if (!m_filebuf.open(filename.c_str(), fmode)) {
+        return false;
+    }
+    m_stream.rdbuf(&m_filebuf);
+    return openStream(mode);
+}
+
+bool ChunkedFile::rawOpenStream(std::streambuf *stream, File::Mode mode)
+{
+    prepareOpen(mode);
+    m_streambuf = stream;
+    m_streaming = true;
+    m_stream.rdbuf(stream);
+    return openStream(mode);
+}
+
+void ChunkedFile::prepareOpen(File::Mode mode)
+{
+    m_streaming = false;
+    m_chunkPositions.clear();
+    m_writeChunks = 0;
+    m_writePos = 0;
+    m_index.clear();
+    m_hasIndex = false;
+
+    // The compression hooks can't be called from the constructor
+    if (!m_compressedCache) {
+        m_compressedCache = new char[maxCompressedLength(CHUNK_SIZE)];
+    }
+    // Closing frees the cache, so that files can be opened again
+    if (!m_cache) {
+        m_cache = new char[m_cacheMaxSize];
+    }
+
+    if (mode == File::Write) {
+        m_cachePtr = m_cache;
+        m_cacheSize = CHUNK_SIZE;
+    }
+}
+
+/*
+ * Start reading or writing through m_stream, once opened.
+ */
+bool ChunkedFile::openStream(File::Mode mode)
+{
+    m_stream.clear();
+
+    //read in the initial buffer if we're reading
+    if (mode == File::Read) {
+        if (m_streaming) {
+            m_endPos = 0;
+        } else {
+            m_stream.seekg(0, std::ios::end);
+            m_endPos = m_stream.tellg();
+            m_stream.seekg(0, std::ios::beg);
+        }
+
+        // read the file identifier
+        char byte1, byte2;
+        m_stream >> byte1;
+        m_stream >> byte2;
+        if (m_stream.fail() || byte1 != m_byte1 || byte2 != m_byte2) {
+            closeStream();
+            return false;
+        }
+        m_fetchPos = m_stream.tellg();
+
+        // Streams can't seek to the index at the end, nor use it
+        if (!m_streaming) {
+            loadIndex();
+            m_stream.clear();
+            m_stream.seekg(m_fetchPos, std::ios::beg);
+        }
+
+        startReadAhead(readAheadThreads());
+        flushReadCache();
+    } else if (mode == File::Write) {
+        // write the file identifier
+        m_stream << m_byte1;
+        m_stream << m_byte2;
+        m_writePos = 2;
+
+        startCompression();
+    }
+    return true;
+}
+
+void ChunkedFile::closeStream()
+{
+    m_stream.rdbuf(NULL);
+    if (m_streambuf) {
+        // Flushes it too
+        delete m_streambuf;
+        m_streambuf = NULL;
+    } else {
+        m_filebuf.close();
+    }
+}
+
+bool ChunkedFile::rawWrite(const void *buffer, size_t length)
+{
+    if (freeCacheSize() > length) {
+        memcpy(m_cachePtr, buffer, length);
+        m_cachePtr += length;
+    } else if (freeCacheSize() == length) {
+        memcpy(m_cachePtr, buffer, length);
+        m_cachePtr += length;
+        flushWriteCache();
+    } else {
+        size_t sizeToWrite = length;
+
+        while (sizeToWrite >= freeCacheSize()) {
+            size_t endSize = freeCacheSize();
+            size_t offset = length - sizeToWrite;
+            memcpy(m_cachePtr, (const char*)buffer + offset, endSize);
+            sizeToWrite -= endSize;
+            m_cachePtr += endSize;
+            flushWriteCache();
+        }
+        if (sizeToWrite) {
+            size_t offset = length - sizeToWrite;
+            memcpy(m_cachePtr, (const char*)buffer + offset, sizeToWrite);
+            m_cachePtr += sizeToWrite;
+        }
+    }
+
+    return true;
+}
+
+size_t ChunkedFile::rawRead(void *buffer, size_t length)
+{
+    if (endOfData()) {
+        return 0;
+    }
+
+    if (readCacheSize() >= length) {
+        memcpy(buffer, m_readPtr, length);
+        m_readPtr += length;
+    } else {
+        size_t sizeToRead = length;
+        size_t offset = 0;
+        while (sizeToRead) {
+            size_t chunkSize = std::min(readCacheSize(), sizeToRead);
+            offset = length - sizeToRead;
+            memcpy((char*)buffer + offset, m_readPtr, chunkSize);
+            m_readPtr += chunkSize;
+            sizeToRead -= chunkSize;
+            if (sizeToRead > 0) {
+                advanceChunk();
+            }
+            if (!m_cacheSize) {
+                return length - sizeToRead;
+            }
+        }
+    }
+
+    return length;
+}
+
+int ChunkedFile::rawGetc()
+{
+    unsigned char c = 0;
+    if (rawRead(&c, 1) != 1)
+        return -1;
+    return c;
+}
+
+void ChunkedFile::rawClose()
+{
+    if (m_mode == File::Write) {
+        flushWriteCache();
+        stopCompression();
+    }
+    stopReadAhead();
+    if (m_mapping) {
+        unmapFile();
+    } else {
+        closeStream();
+    }
+    if (m_cacheShared) {
+        m_cacheShared->unref();
+        m_cacheShared = NULL;
+    } else {
+        delete [] m_cache;
+    }
+    m_cache = NULL;
+    m_cachePtr = NULL;
+    releaseParkedChunk();
+}
+
+void ChunkedFile::rawFlush()
+{
+    assert(m_mode == File::Write);
+    if (compressionThread == this) {
+        // We got an exception on a compression thread, so the queue might
+        // never drain.
+        m_stream.flush();
+        return;
+    }
+    flushWriteCache();
+    drainCompression();
+    m_stream.flush();
+}
+
+void ChunkedFile::flushWriteCache()
+{
+    size_t inputLength = usedCacheSize();
+
+    if (inputLength) {
+        ++m_writeChunks;
+        if (m_compressionCurrent) {
+            // Hand the chunk over to the compression threads, and carry on
+            // with a free buffer.
+            os::unique_lock<os::mutex> lock(m_compressionMutex);
+            while (m_compressionFree.empty()) {
+                m_compressionDoneCond.wait(lock);
+            }
+            CompressionChunk *chunk = m_compressionCurrent;
+            assert(chunk->data == m_cache);
+            chunk->size = inputLength;
+            chunk->seq = m_compressionNextSeq++;
+            m_compressionPending.push_back(chunk);
+            ++m_compressionInFlight;
+            m_compressionCurrent = m_compressionFree.back();
+            m_compressionFree.pop_back();
+            m_cache = m_compressionCurrent->data;
+            m_compressionWorkCond.signal();
+        } else {
+            compressChunk(m_cache, inputLength);
+        }
+        m_cachePtr = m_cache;
+    }
+    assert(m_cachePtr == m_cache);
+}
+
+void ChunkedFile::compressChunk(const char *data, size_t length)
+{
+    size_t compressedLength = compress(data, length, m_compressedCache);
+
+    writeCompressedChunk(m_compressedCache, compressedLength);
+}
+
+void ChunkedFile::writeCompressedChunk(const char *compressed, size_t length)
+{
+    m_chunkPositions.push_back(m_writePos);
+    m_writePos += 4 + length;
+
+    writeCompressedLength(length);
+    m_stream.write(compressed, length);
+}
+
+void ChunkedFile::flushReadCache(size_t skipLength)
+{
+    if (!m_readAheadThreads.empty()) {
+        flushReadAheadCache();
+        return;
+    }
+
+    if (m_mapping) {
+        m_currentOffset.chunk = m_mappingPos;
+        size_t compressedLength = readCompressedLength();
+        if (compressedLength) {
+            const char *compressed = m_mapping + m_mappingPos;
+            m_mappingPos += compressedLength;
+            m_nextChunk = m_mappingPos;
+            adviseReadAhead();
+            if (!uncompressedLength(compressed, compressedLength,
+                                    &m_cacheSize)) {
+                m_cacheSize = 0;
+            }
+            createCache(m_cacheSize);
+            if (skipLength <= m_cacheSize &&
+                !uncompress(compressed, compressedLength,
+                            m_cache, m_cacheSize)) {
+                createCache(0);
+            }
+        } else {
+            createCache(0);
+        }
+        return;
+    }
+
+    m_currentOffset.chunk = m_stream.tellg();
+    size_t compressedLength;
+    compressedLength = readCompressedLength();
+
+    if (compressedLength) {
+        m_stream.read((char*)m_compressedCache, compressedLength);
+        if (m_stream.fail()) {
+            // truncated chunk, e.g., from a crashed capture
+            createCache(0);
+            return;
+        }
+        m_nextChunk = m_currentOffset.chunk + 4 + compressedLength;
+        if (!uncompressedLength(m_compressedCache, compressedLength,
+                                &m_cacheSize)) {
+            m_cacheSize = 0;
+        }
+        createCache(m_cacheSize);
+        if (skipLength <= m_cacheSize &&
+            !uncompress(m_compressedCache, compressedLength,
+                        m_cache, m_cacheSize)) {
+            createCache(0);
+        }
+    } else {
+        createCache(0);
+    }
+}
+
+void ChunkedFile::createCache(size_t size)
+{
+    releaseSharedCache();
+
+    if (size > m_cacheMaxSize) {
+        do {
+            m_cacheMaxSize <<= 1;
+        } while (size > m_cacheMaxSize);
+
+        delete [] m_cache;
+        m_cache = new char[size];
+        m_cacheMaxSize = size;
+    }
+
+    m_cacheSize = size;
+    m_readPtr = m_cache;
+    m_readEnd = m_cache + size;
+}
+
+void ChunkedFile::writeCompressedLength(size_t length)
+{
+    unsigned char buf[4];
+    buf[0] = length & 0xff; length >>= 8;
+    buf[1] = length & 0xff; length >>= 8;
+    buf[2] = length & 0xff; length >>= 8;
+    buf[3] = length & 0xff; length >>= 8;
+    assert(length == 0);
+    m_stream.write((const char *)buf, sizeof buf);
+}
+
+size_t ChunkedFile::readCompressedLength()
+{
+    unsigned char buf[4];
+    size_t length;
+    if (m_mapping) {
+        if (m_mappingSize - m_mappingPos < sizeof buf) {
+            m_mappingPos = m_mappingSize;
+            return 0;
+        }
+        memcpy(buf, m_mapping + m_mappingPos, sizeof buf);
+        m_mappingPos += sizeof buf;
+    } else {
+        m_stream.read((char *)buf, sizeof buf);
+        if (m_stream.fail()) {
+            return 0;
+        }
+    }
+    length  =  (size_t)buf[0];
+    length |= ((size_t)buf[1] <<  8);
+    length |= ((size_t)buf[2] << 16);
+    length |= ((size_t)buf[3] << 24);
+    if (m_mapping) {
+        if (length == 0 || length > m_mappingSize - m_mappingPos) {
+            // end of the data, possibly followed by the index, or truncated
+            // chunk, e.g., from a crashed capture
+            m_mappingPos = m_mappingSize;
+            length = 0;
+        }
+    } else if (length == 0) {
+        // end of the data, don't read the index as if it were a chunk
+        if (m_streaming) {
+            m_stream.setstate(std::ios::eofbit);
+        } else {
+            m_stream.seekg(0, std::ios::end);
+        }
+    }
+    return length;
+}
+
+bool ChunkedFile::mapFile(const std::string &filename)
+{
+    assert(!m_mapping);
+
+#ifdef _WIN32
+    HANDLE hFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                               NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) ||
+        size.QuadPart == 0 ||
+        (unsigned long long)size.QuadPart > (size_t)-1) {
+        CloseHandle(hFile);
+        return false;
+    }
+
+    m_mappingHandle = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (!m_mappingHandle) {
+        return false;
+    }
+
+    void *ptr = MapViewOfFile(m_mappingHandle, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr) {
+        CloseHandle(m_mappingHandle);
+        return false;
+    }
+
+    uint64_t fileSize = size.QuadPart;
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        !S_ISREG(st.st_mode) ||
+        st.st_size == 0 ||
+        (unsigned long long)st.st_size > (size_t)-1) {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping keeps a reference to the file, so the descriptor can be
+    // closed right away.
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+    uint64_t fileSize = st.st_size;
+#endif
+
+    m_mapping = (const char *)ptr;
+    m_mappingSize = fileSize;
+    m_mappingPos = 0;
+    m_endPos = m_mappingSize;
+
+    return true;
+}
+
+void ChunkedFile::unmapFile()
+{
+    assert(m_mapping);
+#ifdef _WIN32
+    UnmapViewOfFile(m_mapping);
+    CloseHandle(m_mappingHandle);
+#else
+    munmap((void *)m_mapping, m_mappingSize);
+#endif
+    m_mapping = NULL;
+    m_mappingSize = 0;
+    m_mappingPos = 0;
+}
+
+/*
+ * Ask the OS to start paging in the compressed data following the current
+ * position, so that the next chunks don't block on disk I/O.
+ */
+void ChunkedFile::adviseReadAhead()
+{
+#ifndef _WIN32
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+    uint64_t start = m_mappingPos & ~(pageSize - 1);
+    if (start >= m_mappingSize) {
+        return;
+    }
+    uint64_t length = std::min<uint64_t>(READAHEAD_SIZE,
+                                         m_mappingSize - start);
+
+    madvise((void *)(m_mapping + start), length, MADV_WILLNEED);
+#endif
+}
+
+bool ChunkedFile::readAt(uint64_t pos, char *buffer, size_t length)
+{
+    if (m_mapping) {
+        if (pos > m_mappingSize || length > m_mappingSize - pos) {
+            return false;
+        }
+        memcpy(buffer, m_mapping + pos, length);
+        return true;
+    }
+
+    m_stream.clear();
+    m_stream.seekg(pos, std::ios::beg);
+    m_stream.read(buffer, length);
+    return !m_stream.fail();
+}
+
+/*
+ * Look for an index at the end of the file.  Anything unexpected, such as a
+ * truncated file, just means there is no index.
+ */
+void ChunkedFile::loadIndex()
+{
+    uint64_t fileSize = m_mapping ? m_mappingSize : (uint64_t)m_endPos;
+    char trailer[8 + INDEX_MAGIC_SIZE];
+    if (fileSize < 2 + 4 + 4 + sizeof trailer ||
+        !readAt(fileSize - sizeof trailer, trailer, sizeof trailer) ||
+        memcmp(trailer + 8, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0) {
+        return;
+    }
+
+    uint64_t indexPos = getUInt64(trailer);
+    char buf[8];
+    if (indexPos < 2 + 4 ||
+        indexPos > fileSize - sizeof trailer - 4 ||
+        !readAt(indexPos - 4, buf, 8)) {
+        return;
+    }
+
+    size_t compressedLength;
+    compressedLength  =  (size_t)(unsigned char)buf[4];
+    compressedLength |= ((size_t)(unsigned char)buf[5] <<  8);
+    compressedLength |= ((size_t)(unsigned char)buf[6] << 16);
+    compressedLength |= ((size_t)(unsigned char)buf[7] << 24);
+    if (buf[0] || buf[1] || buf[2] || buf[3] ||
+        indexPos + 4 + compressedLength != fileSize - sizeof trailer) {
+        return;
+    }
+
+    std::string compressed(compressedLength, '\0');
+    std::string block;
+    size_t blockLength;
+    if (!readAt(indexPos + 4, &compressed[0], compressedLength) ||
+        !uncompressedLength(compressed.data(), compressedLength,
+                            &blockLength) ||
+        blockLength < 8) {
+        return;
+    }
+    block.resize(blockLength);
+    if (!uncompress(compressed.data(), compressedLength,
+                    &block[0], blockLength)) {
+        return;
+    }
+
+    uint64_t numChunks = getUInt64(block.data());
+    if (numChunks > (block.size() - 8) / 8) {
+        return;
+    }
+    m_chunkPositions.resize(numChunks);
+    for (uint64_t i = 0; i < numChunks; ++i) {
+        m_chunkPositions[i] = getUInt64(block.data() + 8 + 8 * i);
+    }
+    m_index = block.substr(8 + 8 * numChunks);
+    m_hasIndex = true;
+}
+
+bool ChunkedFile::writeIndex(const std::string &index)
+{
+    assert(m_mode == File::Write);
+
+    // The position of all chunks must be known
+    flushWriteCache();
+    drainCompression();
+
+    std::string block;
+    putUInt64(block, m_chunkPositions.size() + 1);
+    for (unsigned i = 0; i < m_chunkPositions.size(); ++i) {
+        putUInt64(block, m_chunkPositions[i]);
+    }
+    putUInt64(block, m_writePos);
+    block += index;
+
+    std::string compressed(maxCompressedLength(block.size()), '\0');
+    compressed.resize(compress(block.data(), block.size(), &compressed[0]));
+
+    // Readers stop at the empty chunk, and find the index from the end.
+    std::string trailer;
+    putUInt64(trailer, m_writePos + 4);
+    trailer.append(INDEX_MAGIC, INDEX_MAGIC_SIZE);
+
+    writeCompressedLength(0);
+    writeCompressedLength(compressed.size());
+    m_stream.write(compressed.data(), compressed.size());
+    m_stream.write(trailer.data(), trailer.size());
+
+    return !m_stream.fail();
+}
+
+bool ChunkedFile::readIndex(std::string &index)
+{
+    if (!m_hasIndex) {
+        return false;
+    }
+    index = m_index;
+    return true;
+}
+
+bool ChunkedFile::resolveOffset(File::Offset &offset)
+{
+    if (!m_hasIndex || offset.chunk >= m_chunkPositions.size()) {
+        return false;
+    }
+    offset.chunk = m_chunkPositions[offset.chunk];
+    return true;
+}
+
+char *ChunkedFile::readShared(size_t length, SharedChunk *&chunk)
+{
+    if (m_mode != File::Read || length > readCacheSize()) {
+        return NULL;
+    }
+
+    // The cache is handed over to the chunk, and replaced rather than
+    // reused once done with.
+    if (!m_cacheShared) {
+        m_cacheShared = new SharedChunk(m_cache);
+    }
+    m_cacheShared->ref();
+    chunk = m_cacheShared;
+
+    char *data = m_cache + (m_readPtr - m_cache);
+    m_readPtr += length;
+    return data;
+}
+
+void ChunkedFile::releaseSharedCache()
+{
+    if (m_cacheShared) {
+        m_cacheShared->unref();
+        m_cacheShared = NULL;
+        m_cache = new char[m_cacheMaxSize];
+    }
+}
+
+bool ChunkedFile::supportsOffsets() const
+{
+    return !m_streaming;
+}
+
+bool ChunkedFile::isStream() const
+{
+    return m_streaming;
+}
+
+File::Offset ChunkedFile::currentOffset()
+{
+    if (m_mode == File::Write) {
+        // The position of chunks is only known once they are compressed
+        return File::Offset(m_writeChunks, usedCacheSize());
+    }
+    m_currentOffset.offsetInChunk = m_readPtr - m_cache;
+    return m_currentOffset;
+}
+
+void ChunkedFile::setCurrentOffset(const File::Offset &offset)
+{
+    if (m_cacheSize && offset.chunk == m_currentOffset.chunk) {
+        // Still in the current chunk, so no need to decompress it again
+        assert(m_cacheSize >= offset.offsetInChunk);
+        m_readPtr = m_cache + offset.offsetInChunk;
+        return;
+    }
+
+    if (m_parked.size && offset.chunk == m_parked.chunk) {
+        // Back to where we came from, so carry on after it
+        swapParkedChunk();
+        seekChunk(m_nextChunk);
+        m_readEnd = m_cache + m_cacheSize;
+    } else {
+        if (m_cacheSize) {
+            swapParkedChunk();
+        }
+        seekChunk(offset.chunk);
+        // load the chunk
+        flushReadCache();
+    }
+
+    assert(m_cacheSize >= offset.offsetInChunk);
+    // seek within our cache to the correct location within the chunk
+    m_readPtr = m_cache + offset.offsetInChunk;
+}
+
+/*
+ * Continue reading chunks from the given position.
+ */
+void ChunkedFile::seekChunk(uint64_t pos)
+{
+    if (!m_readAheadThreads.empty()) {
+        // Discard all chunks fetched so far.  Chunks still being
+        // decompressed are recognized by their stale generation and thrown
+        // away when done.
+        m_readAheadMutex.lock();
+        ++m_readAheadGeneration;
+        for (unsigned i = 0; i < m_readAheadSlots.size(); ++i) {
+            if (m_readAheadSlots[i].state == ReadAheadSlot::READY) {
+                m_readAheadSlots[i].state = ReadAheadSlot::EMPTY;
+            }
+        }
+        m_fetchPos = pos;
+        m_fetchSeq = 0;
+        m_fetchSeek = true;
+        m_fetchEof = false;
+        m_consumeSeq = 0;
+        m_eof = false;
+        m_readAheadMutex.unlock();
+        m_readAheadWorkCond.signal();
+        return;
+    }
+
+    if (m_mapping) {
+        m_mappingPos = pos;
+        return;
+    }
+
+    // to remove eof bit
+    m_stream.clear();
+    // seek to the start of a chunk
+    m_stream.seekg(pos, std::ios::beg);
+}
+
+/*
+ * Carry on reading with the next chunk, parking the current one.
+ */
+void ChunkedFile::advanceChunk(size_t skipLength)
+{
+    if (m_parked.size && m_parked.chunk == m_nextChunk) {
+        swapParkedChunk();
+        seekChunk(m_nextChunk);
+        m_readPtr = m_cache;
+        m_readEnd = m_cache + m_cacheSize;
+        return;
+    }
+
+    if (m_cacheSize) {
+        swapParkedChunk();
+    }
+    flushReadCache(skipLength);
+}
+
+/*
+ * Exchange the current chunk with the parked one, so that the parked one
+ * becomes current, and the current one's buffer is reused or kept.
+ */
+void ChunkedFile::swapParkedChunk()
+{
+    if (!m_parked.data) {
+        m_parked.maxSize = CHUNK_SIZE;
+        m_parked.data = new char[m_parked.maxSize];
+    }
+    std::swap(m_cache, m_parked.data);
+    std::swap(m_cacheSize, m_parked.size);
+    std::swap(m_cacheMaxSize, m_parked.maxSize);
+    std::swap(m_cacheShared, m_parked.shared);
+    std::swap(m_currentOffset.chunk, m_parked.chunk);
+    std::swap(m_nextChunk, m_parked.next);
+}
+
+void ChunkedFile::releaseParkedChunk()
+{
+    if (m_parked.shared) {
+        m_parked.shared->unref();
+    } else {
+        delete [] m_parked.data;
+    }
+    m_parked.data = NULL;
+    m_parked.size = 0;
+    m_parked.maxSize = 0;
+    m_parked.shared = NULL;
+}
+
+bool ChunkedFile::rawSkip(size_t length)
+{
+    if (endOfData()) {
+        return false;
+    }
+
+    if (readCacheSize() >= length) {
+        m_readPtr += length;
+    } else {
+        size_t sizeToRead = length;
+        bool decompressed = true;
+        while (sizeToRead) {
+            size_t chunkSize = std::min(readCacheSize(), sizeToRead);
+            m_readPtr += chunkSize;
+            sizeToRead -= chunkSize;
+            if (sizeToRead > 0) {
+                // Chunks skipped whole are never decompressed, so there is
+                // no use keeping them
+                if (decompressed) {
+                    advanceChunk(sizeToRead);
+                } else {
+                    flushReadCache(sizeToRead);
+                }
+                decompressed = sizeToRead <= m_cacheSize;
+            }
+            if (!m_cacheSize) {
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+int ChunkedFile::rawPercentRead()
+{
+    if (m_streaming) {
+        // The size is unknown
+        return 0;
+    }
+    if (!m_readAheadThreads.empty()) {
+        return 100 * (double(m_currentOffset.chunk) / double(m_endPos));
+    }
+    if (m_mapping) {
+        return 100 * (double(m_mappingPos) / double(m_mappingSize));
+    }
+    return 100 * (double(m_stream.tellg()) / double(m_endPos));
+}
+
+
+void ChunkedFile::startReadAhead(unsigned numThreads)
+{
+    assert(m_readAheadThreads.empty());
+    if (!numThreads) {
+        return;
+    }
+
+    // Keep a couple of chunks in flight for each thread, so that threads
+    // never wait on the parser while there are chunks left to decompress.
+    size_t compressedMaxSize = maxCompressedLength(CHUNK_SIZE);
+    m_readAheadSlots.resize(numThreads * 2 + 1);
+    for (unsigned i = 0; i < m_readAheadSlots.size(); ++i) {
+        ReadAheadSlot &slot = m_readAheadSlots[i];
+        slot.state = ReadAheadSlot::EMPTY;
+        slot.generation = 0;
+        slot.offset = 0;
+        slot.eof = false;
+        slot.compressedMaxSize = m_mapping ? 0 : compressedMaxSize;
+        slot.compressed = m_mapping ? NULL : new char[slot.compressedMaxSize];
+        slot.dataSize = 0;
+        slot.dataMaxSize = CHUNK_SIZE;
+        slot.data = new char[slot.dataMaxSize];
+    }
+
+    m_readAheadStop = false;
+    m_readAheadGeneration = 0;
+    m_fetchSeq = 0;
+    m_fetchSeek = false;
+    m_fetchEof = false;
+    m_consumeSeq = 0;
+    m_eof = false;
+
+    m_readAheadThreads.resize(numThreads);
+    for (unsigned i = 0; i < numThreads; ++i) {
+        m_readAheadThreads[i] = os::thread(readAheadThread, this);
+    }
+}
+
+void ChunkedFile::stopReadAhead()
+{
+    if (m_readAheadThreads.empty()) {
+        return;
+    }
+
+    m_readAheadMutex.lock();
+    m_readAheadStop = true;
+    m_readAheadMutex.unlock();
+    m_readAheadWorkCond.signal();
+
+    for (unsigned i = 0; i < m_readAheadThreads.size(); ++i) {
+        m_readAheadThreads[i].join();
+    }
+    m_readAheadThreads.clear();
+
+    for (unsigned i = 0; i < m_readAheadSlots.size(); ++i) {
+        delete [] m_readAheadSlots[i].compressed;
+        delete [] m_readAheadSlots[i].data;
+    }
+    m_readAheadSlots.clear();
+}
+
+void *ChunkedFile::readAheadThread(ChunkedFile *_this)
+{
+    _this->runReadAhead();
+    return 0;
+}
+
+void ChunkedFile::runReadAhead()
+{
+    os::unique_lock<os::mutex> lock(m_readAheadMutex);
+
+    while (true) {
+        ReadAheadSlot *slot =
+            &m_readAheadSlots[m_fetchSeq % m_readAheadSlots.size()];
+        while (!m_readAheadStop &&
+               (m_fetchEof || slot->state != ReadAheadSlot::EMPTY)) {
+            m_readAheadWorkCond.wait(lock);
+            slot = &m_readAheadSlots[m_fetchSeq % m_readAheadSlots.size()];
+        }
+
+        if (m_readAheadStop) {
+            // pass the stop notification on to the next thread
+            m_readAheadWorkCond.signal();
+            break;
+        }
+
+        slot->state = ReadAheadSlot::BUSY;
+        slot->generation = m_readAheadGeneration;
+        slot->offset = m_fetchPos;
+        slot->eof = false;
+        ++m_fetchSeq;
+
+        // Fetching is sequential, as the position of each chunk depends on
+        // the length of the previous one, so do it with the lock held.
+        const char *compressed = NULL;
+        size_t compressedLength;
+        if (m_mapping) {
+            m_mappingPos = m_fetchPos;
+            compressedLength = readCompressedLength();
+            compressed = m_mapping + m_mappingPos;
+            m_mappingPos += compressedLength;
+            adviseReadAhead();
+            m_fetchPos = m_mappingPos;
+        } else {
+            if (m_fetchSeek) {
+                m_stream.clear();
+                m_stream.seekg(m_fetchPos, std::ios::beg);
+                m_fetchSeek = false;
+            }
+            compressedLength = readCompressedLength();
+            if (compressedLength > slot->compressedMaxSize) {
+                delete [] slot->compressed;
+                slot->compressedMaxSize = compressedLength;
+                slot->compressed = new char[slot->compressedMaxSize];
+            }
+            if (compressedLength) {
+                m_stream.read(slot->compressed, compressedLength);
+                if (m_stream.fail()) {
+                    compressedLength = 0;
+                }
+            }
+            compressed = slot->compressed;
+            m_fetchPos += 4 + compressedLength;
+        }
+        if (!compressedLength) {
+            m_fetchEof = true;
+        }
+        slot->next = m_fetchPos;
+
+        // let another thread fetch the next chunk meanwhile
+        m_readAheadWorkCond.signal();
+        lock.unlock();
+
+        size_t length = 0;
+        if (compressedLength &&
+            uncompressedLength(compressed, compressedLength, &length)) {
+            if (length > slot->dataMaxSize) {
+                delete [] slot->data;
+                slot->dataMaxSize = length;
+                slot->data = new char[slot->dataMaxSize];
+            }
+            if (!uncompress(compressed, compressedLength,
+                            slot->data, length)) {
+                length = 0;
+            }
+        }
+
+        lock.lock();
+
+        slot->dataSize = length;
+        slot->eof = length == 0;
+        if (slot->generation == m_readAheadGeneration) {
+            if (slot->eof) {
+                // don't bother fetching past corrupted chunks
+                m_fetchEof = true;
+            }
+            slot->state = ReadAheadSlot::READY;
+            m_readAheadReadyCond.signal();
+        } else {
+            // a seek happened meanwhile
+            slot->state = ReadAheadSlot::EMPTY;
+            m_readAheadWorkCond.signal();
+        }
+    }
+}
+
+/*
+ * Take the next chunk from the read-ahead ring, waiting for it to be
+ * decompressed if necessary.
+ */
+void ChunkedFile::flushReadAheadCache()
+{
+    if (m_eof) {
+        createCache(0);
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(m_readAheadMutex);
+
+    ReadAheadSlot &slot =
+        m_readAheadSlots[m_consumeSeq % m_readAheadSlots.size()];
+    while (slot.state != ReadAheadSlot::READY ||
+           slot.generation != m_readAheadGeneration) {
+        m_readAheadReadyCond.wait(lock);
+    }
+
+    m_currentOffset.chunk = slot.offset;
+    m_nextChunk = slot.next;
+
+    if (slot.eof) {
+        m_eof = true;
+        createCache(0);
+    } else {
+        // Swap buffers with the slot instead of copying
+        releaseSharedCache();
+        std::swap(m_cache, slot.data);
+        std::swap(m_cacheMaxSize, slot.dataMaxSize);
+        m_cacheSize = slot.dataSize;
+        m_readPtr = m_cache;
+        m_readEnd = m_cache + m_cacheSize;
+    }
+
+    slot.state = ReadAheadSlot::EMPTY;
+    ++m_consumeSeq;
+    m_readAheadWorkCond.signal();
+}
+
+
+void ChunkedFile::setCompressionThreads(unsigned threads)
+{
+    assert(!m_isOpened);
+    m_compressionThreads = threads;
+}
+
+void ChunkedFile::startCompression()
+{
+    assert(m_compressionWorkers.empty());
+    if (!m_compressionThreads) {
+        return;
+    }
+
+    // Each thread needs a chunk to compress, plus one being filled and one
+    // spare so that filling can carry on while the oldest chunk is written.
+    size_t compressedMaxSize = maxCompressedLength(CHUNK_SIZE);
+    unsigned numChunks = m_compressionThreads + WRITE_BUFFERS - 1;
+    for (unsigned i = 0; i < numChunks; ++i) {
+        CompressionChunk *chunk = new CompressionChunk;
+        chunk->data = i ? new char[m_cacheMaxSize] : m_cache;
+        chunk->size = 0;
+        chunk->compressed = new char[compressedMaxSize];
+        chunk->compressedSize = 0;
+        chunk->seq = 0;
+        if (i) {
+            m_compressionFree.push_back(chunk);
+        } else {
+            m_compressionCurrent = chunk;
+        }
+    }
+    m_compressionNextSeq = 0;
+    m_compressionWriteSeq = 0;
+    m_compressionInFlight = 0;
+    m_compressionWriting = false;
+    m_compressionStop = false;
+
+    m_compressionWorkers.resize(m_compressionThreads);
+    for (unsigned i = 0; i < m_compressionThreads; ++i) {
+        m_compressionWorkers[i] = os::thread(compressionThreadProc, this);
+    }
+}
+
+/*
+ * Wait for all queued chunks to be written.
+ */
+void ChunkedFile::drainCompression()
+{
+    if (!m_compressionCurrent) {
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(m_compressionMutex);
+    while (m_compressionInFlight) {
+        m_compressionDoneCond.wait(lock);
+    }
+}
+
+void ChunkedFile::stopCompression()
+{
+    if (!m_compressionCurrent) {
+        return;
+    }
+
+    // The threads only exit once there is nothing left to compress.
+    m_compressionMutex.lock();
+    m_compressionStop = true;
+    m_compressionMutex.unlock();
+    m_compressionWorkCond.signal();
+
+    for (unsigned i = 0; i < m_compressionWorkers.size(); ++i) {
+        m_compressionWorkers[i].join();
+    }
+    m_compressionWorkers.clear();
+
+    // If the threads were killed (e.g., threads are terminated before static
+    // destructors run on Windows) write whatever was left behind here.
+    std::map<uint64_t, CompressionChunk *>::iterator it;
+    for (it = m_compressionDone.begin(); it != m_compressionDone.end(); ++it) {
+        CompressionChunk *chunk = it->second;
+        writeCompressedChunk(chunk->compressed, chunk->compressedSize);
+        m_compressionFree.push_back(chunk);
+    }
+    m_compressionDone.clear();
+    while (!m_compressionPending.empty()) {
+        CompressionChunk *chunk = m_compressionPending.front();
+        m_compressionPending.pop_front();
+        compressChunk(chunk->data, chunk->size);
+        m_compressionFree.push_back(chunk);
+    }
+    m_compressionInFlight = 0;
+
+    // m_cache keeps the current chunk's buffer
+    m_cache = m_compressionCurrent->data;
+    delete [] m_compressionCurrent->compressed;
+    delete m_compressionCurrent;
+    m_compressionCurrent = NULL;
+
+    for (unsigned i = 0; i < m_compressionFree.size(); ++i) {
+        delete [] m_compressionFree[i]->data;
+        delete [] m_compressionFree[i]->compressed;
+        delete m_compressionFree[i];
+    }
+    m_compressionFree.clear();
+}
+
+void *ChunkedFile::compressionThreadProc(ChunkedFile *_this)
+{
+    compressionThread = _this;
+    _this->runCompression();
+    return 0;
+}
+
+void ChunkedFile::runCompression()
+{
+    os::unique_lock<os::mutex> lock(m_compressionMutex);
+
+    while (true) {
+        while (!m_compressionStop && m_compressionPending.empty()) {
+            m_compressionWorkCond.wait(lock);
+        }
+
+        if (m_compressionPending.empty()) {
+            // pass the stop notification on to the next thread
+            m_compressionWorkCond.signal();
+            break;
+        }
+
+        CompressionChunk *chunk = m_compressionPending.front();
+        m_compressionPending.pop_front();
+        if (!m_compressionPending.empty()) {
+            m_compressionWorkCond.signal();
+        }
+        lock.unlock();
+
+        chunk->compressedSize = compress(chunk->data, chunk->size,
+                                         chunk->compressed);
+
+        lock.lock();
+        m_compressionDone[chunk->seq] = chunk;
+
+        // Write out all chunks that are due, unless another thread is
+        // already doing it, in which case it will pick ours too.
+        if (m_compressionWriting) {
+            continue;
+        }
+        m_compressionWriting = true;
+        std::map<uint64_t, CompressionChunk *>::iterator it;
+        while ((it = m_compressionDone.find(m_compressionWriteSeq)) !=
+               m_compressionDone.end()) {
+            CompressionChunk *next = it->second;
+            m_compressionDone.erase(it);
+            lock.unlock();
+
+            writeCompressedChunk(next->compressed, next->compressedSize);
+
+            lock.lock();
+            ++m_compressionWriteSeq;
+            --m_compressionInFlight;
+            m_compressionFree.push_back(next);
+            m_compressionDoneCond.signal();
+        }
+        m_compressionWriting = false;
+    }
+}
@@ -0,0 +1,338 @@
+/**************************************************************************
+ *
+ * Copyright 2011 Zack Rusin
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Chunked file format.
+ * --------------------
+ *
+ * Compression libraries like snappy are just compression algorithms, so
+ * we're using a file format of our own to hold the compressed trace data.
+ *
+ * The file starts with two bytes identifying the compression, followed by a
+ * number of chunks, they are:
+ * chunk {
+ *     uint32 - specifying the length of the compressed data
+ *     compressed data, in little endian
+ * }
+ * File can contain any number of such chunks.
+ * The default size of an uncompressed chunk is specified in
+ * CHUNK_SIZE.
+ *
+ * An empty chunk marks the end of the data, and may be followed by an index:
+ * index {
+ *     uint32 - specifying the length of the compressed index
+ *     compressed index {
+ *         uint64 - number of chunk positions
+ *         uint64 - file position of each chunk, plus the end of the data
+ *         opaque index data
+ *     }
+ *     uint64 - file position of the compressed index length
+ *     INDEX_MAGIC
+ * }
+ * The chunk positions allow mapping offsets recorded while writing, which
+ * count chunks rather than bytes, to file positions.
+ *
+ * Note:
+ * Currently the default size for a a to-be-compressed data is
+ * 1mb, meaning that the compressed data will be <= 1mb.
+ * The reason it's 1mb is because it seems
+ * to offer a pretty good compression/disk io speed ratio
+ * but that might change.
+ *
+ */
+
+
+#ifndef TRACE_FILE_CHUNKED_HPP
+#define TRACE_FILE_CHUNKED_HPP
+
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <assert.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "os_stream.hpp"
+#include "os_thread.hpp"
+#include "trace_file.hpp"
+
+
+namespace trace {
+
+
+/**
+ * Base class for the compressed file formats made of chunks, which
+ * subclasses provide the compression for.
+ */
+class ChunkedFile : public File {
+public:
+    ChunkedFile(char byte1, char byte2);
+    virtual ~ChunkedFile();
+
+    virtual bool supportsOffsets() const;
+    virtual bool isStream() const;
+    virtual File::Offset currentOffset();
+    virtual void setCurrentOffset(const File::Offset &offset);
+    virtual void setCompressionThreads(unsigned threads);
+    virtual bool writeIndex(const std::string &index);
+    virtual bool readIndex(std::string &index);
+    virtual bool resolveOffset(File::Offset &offset);
+    virtual char *readShared(size_t length, SharedChunk *&chunk);
+protected:
+    virtual bool rawOpen(const std::string &filename, File::Mode mode);
+    virtual bool rawOpenStream(std::streambuf *stream, File::Mode mode);
+    virtual bool rawWrite(const void *buffer, size_t length);
+    virtual size_t rawRead(void *buffer, size_t length);
+    virtual int rawGetc();
+    virtual void rawClose();
+    virtual void rawFlush();
+    virtual bool rawSkip(size_t length);
+    virtual int rawPercentRead();
+
+    /*
+     * Compression of a chunk.  These are called concurrently from the
+     * compression and read-ahead threads, so they must not keep any state.
+     */
+    virtual size_t maxCompressedLength(size_t length) = 0;
+    virtual size_t compress(const char *data, size_t length,
+                            char *compressed) = 0;
+    virtual bool uncompressedLength(const char *compressed, size_t length,
+                                    size_t *result) = 0;
+    virtual bool uncompress(const char *compressed, size_t length,
+                            char *data, size_t dataLength) = 0;
+
+private:
+    inline size_t usedCacheSize() const
+    {
+        assert(m_cachePtr >= m_cache);
+        return m_cachePtr - m_cache;
+    }
+    inline size_t freeCacheSize() const
+    {
+        assert(m_cacheSize >= usedCacheSize());
+        if (m_cacheSize > 0) {
+            return m_cacheSize - usedCacheSize();
+        } else {
+            return 0;
+        }
+    }
+    inline size_t readCacheSize() const
+    {
+        assert(m_readPtr <= m_readEnd);
+        return m_readEnd - m_readPtr;
+    }
+    inline bool endOfData() const
+    {
+        if (!m_readAheadThreads.empty()) {
+            return m_eof && readCacheSize() == 0;
+        }
+        if (m_mapping) {
+            return m_mappingPos >= m_mappingSize && readCacheSize() == 0;
+        }
+        return m_stream.eof() && readCacheSize() == 0;
+    }
+    void flushWriteCache();
+    void flushReadCache(size_t skipLength = 0);
+    void prepareOpen(File::Mode mode);
+    bool openStream(File::Mode mode);
+    void closeStream();
+    void createCache(size_t size);
+    void releaseSharedCache();
+    void writeCompressedLength(size_t length);
+    size_t readCompressedLength();
+
+    bool mapFile(const std::string &filename);
+    void unmapFile();
+    void adviseReadAhead();
+
+    bool readAt(uint64_t pos, char *buffer, size_t length);
+    void loadIndex();
+private:
+    // file identifier
+    char m_byte1;
+    char m_byte2;
+
+    // Reads and writes go through m_filebuf for regular files, or through
+    // m_streambuf for pipes and sockets, which can't seek.
+    std::filebuf m_filebuf;
+    std::streambuf *m_streambuf;
+    bool m_streaming;
+    std::iostream m_stream;
+    size_t m_cacheMaxSize;
+    size_t m_cacheSize;
+    char *m_cache;
+    // Write position, as the read position is File::m_readPtr
+    char *m_cachePtr;
+    // Set once values point into m_cache
+    SharedChunk *m_cacheShared;
+
+    char *m_compressedCache;
+
+    File::Offset m_currentOffset;
+    std::streampos m_endPos;
+    // position of the chunk following the current one
+    uint64_t m_nextChunk;
+
+    /*
+     * The chunk last seeked or read away from, kept decompressed, as the
+     * parser usually comes back to it right after reading a blob or
+     * argument elsewhere.
+     */
+    struct ParkedChunk {
+        char *data;
+        size_t size;
+        size_t maxSize;
+        SharedChunk *shared;
+        uint64_t chunk;
+        uint64_t next;
+    };
+    ParkedChunk m_parked;
+
+    void swapParkedChunk();
+    void releaseParkedChunk();
+    void seekChunk(uint64_t pos);
+    void advanceChunk(size_t skipLength = 0);
+
+    /*
+     * When reading, the whole file is memory mapped if the platform allows
+     * it, and chunks are decompressed straight from the mapping.  Otherwise
+     * m_mapping is NULL and chunks are read through m_stream.
+     */
+    const char *m_mapping;
+    uint64_t m_mappingSize;
+    uint64_t m_mappingPos;
+#ifdef _WIN32
+    HANDLE m_mappingHandle;
+#endif
+
+    /*
+     * Index state.  When writing, the position of every chunk written so far,
+     * as offsets returned by currentOffset() refer to chunks by sequence
+     * number.  When reading, the chunk positions and the index data from
+     * the index, if there was one.
+     */
+    std::vector<uint64_t> m_chunkPositions;
+    uint64_t m_writeChunks;
+    uint64_t m_writePos;
+    std::string m_index;
+    bool m_hasIndex;
+
+    /*
+     * Read-ahead state.
+     *
+     * When enabled, worker threads fetch and decompress the chunks following
+     * the current one into a ring of slots, while the parser consumes the
+     * current chunk.  Everything below is protected by m_readAheadMutex.
+     */
+    struct ReadAheadSlot {
+        enum State {
+            EMPTY,
+            BUSY,
+            READY
+        };
+        State state;
+        unsigned generation;
+        uint64_t offset;
+        uint64_t next;
+        bool eof;
+        char *compressed;
+        size_t compressedMaxSize;
+        char *data;
+        size_t dataSize;
+        size_t dataMaxSize;
+    };
+    std::vector<ReadAheadSlot> m_readAheadSlots;
+    std::vector<os::thread> m_readAheadThreads;
+    os::mutex m_readAheadMutex;
+    os::condition_variable m_readAheadWorkCond;
+    os::condition_variable m_readAheadReadyCond;
+    bool m_readAheadStop;
+    unsigned m_readAheadGeneration;
+    // next chunk to fetch
+    uint64_t m_fetchPos;
+    uint64_t m_fetchSeq;
+    bool m_fetchSeek;
+    bool m_fetchEof;
+    // next chunk to consume
+    uint64_t m_consumeSeq;
+    // whether the consumer reached the end of the file
+    bool m_eof;
+
+    /*
+     * Asynchronous compression state.
+     *
+     * When writing, full chunks are queued for a pool of background threads
+     * which compress them, and write them out in the original order, so that
+     * the thread writing into the file only pays for a memcpy.  Everything
+     * below but m_compressionCurrent is protected by m_compressionMutex.
+     */
+    struct CompressionChunk {
+        char *data;
+        size_t size;
+        char *compressed;
+        size_t compressedSize;
+        uint64_t seq;
+    };
+    unsigned m_compressionThreads;
+    std::vector<os::thread> m_compressionWorkers;
+    os::mutex m_compressionMutex;
+    os::condition_variable m_compressionWorkCond;
+    os::condition_variable m_compressionDoneCond;
+    // chunk whose data is m_cache
+    CompressionChunk *m_compressionCurrent;
+    std::vector<CompressionChunk *> m_compressionFree;
+    std::deque<CompressionChunk *> m_compressionPending;
+    // compressed chunks waiting for their turn to be written
+    std::map<uint64_t, CompressionChunk *> m_compressionDone;
+    uint64_t m_compressionNextSeq;
+    uint64_t m_compressionWriteSeq;
+    // number of chunks queued but not yet written
+    unsigned m_compressionInFlight;
+    bool m_compressionWriting;
+    bool m_compressionStop;
+
+    void compressChunk(const char *data, size_t length);
+    void writeCompressedChunk(const char *compressed, size_t length);
+    void startCompression();
+    void drainCompression();
+    void stopCompression();
+    static void *compressionThreadProc(ChunkedFile *_this);
+    void runCompression();
+
+    void startReadAhead(unsigned numThreads);
+    void stopReadAhead();
+    void flushReadAheadCache();
+    static void *readAheadThread(ChunkedFile *_this);
+    void runReadAhead();
+};
+
+
+} /* namespace trace */
+
+#endif /* TRACE_FILE_CHUNKED_HPP */
@@ -0,0 +1,155 @@
+/**************************************************************************
+ *
+ * Copyright 2011 Zack Rusin
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * LZ4 file format.
+ *
+ * Chunked file (see trace_file_chunked.hpp), with each chunk being
+ * chunk data {
+ *     uint32 - uncompressed length, in little endian
+ *     LZ4 compressed block
+ * }
+ * as raw LZ4 blocks don't record their uncompressed length.  Decompresses
+ * faster than snappy; compression levels above 1 select the slower LZ4 HC
+ * compressor, which only costs time when writing.
+ */
+
+
+#include "trace_file_chunked.hpp"
+
+#ifdef HAVE_LZ4
+
+#include <lz4.h>
+#include <lz4hc.h>
+
+
+#define LZ4_HEADER_SIZE 4
+
+
+using namespace trace;
+
+
+class LZ4File : public ChunkedFile {
+public:
+    LZ4File();
+    virtual ~LZ4File();
+
+    virtual void setCompressionLevel(int level);
+
+protected:
+    virtual size_t maxCompressedLength(size_t length);
+    virtual size_t compress(const char *data, size_t length,
+                            char *compressed);
+    virtual bool uncompressedLength(const char *compressed, size_t length,
+                                    size_t *result);
+    virtual bool uncompress(const char *compressed, size_t length,
+                            char *data, size_t dataLength);
+
+private:
+    int m_level;
+};
+
+LZ4File::LZ4File()
+    : ChunkedFile(LZ4_BYTE1, LZ4_BYTE2),
+      m_level(1)
+{
+}
+
+LZ4File::~LZ4File()
+{
+    close();
+}
+
+void LZ4File::setCompressionLevel(int level)
+{
+    m_level = level;
+}
+
+size_t LZ4File::maxCompressedLength(size_t length)
+{
+    return LZ4_HEADER_SIZE + LZ4_compressBound(length);
+}
+
+size_t LZ4File::compress(const char *data, size_t length,
+                         char *compressed)
+{
+    unsigned char *header = (unsigned char *)compressed;
+    header[0] = length & 0xff;
+    header[1] = (length >> 8) & 0xff;
+    header[2] = (length >> 16) & 0xff;
+    header[3] = (length >> 24) & 0xff;
+
+    char *block = compressed + LZ4_HEADER_SIZE;
+    int capacity = LZ4_compressBound(length);
+    int blockLength;
+    if (m_level > 1) {
+        blockLength = LZ4_compress_HC(data, block, length, capacity, m_level);
+    } else {
+        blockLength = LZ4_compress_default(data, block, length, capacity);
+    }
+    assert(blockLength > 0 || length == 0);
+    return LZ4_HEADER_SIZE + blockLength;
+}
+
+bool LZ4File::uncompressedLength(const char *compressed, size_t length,
+                                 size_t *result)
+{
+    if (length < LZ4_HEADER_SIZE) {
+        return false;
+    }
+    const unsigned char *header = (const unsigned char *)compressed;
+    *result = (size_t)header[0] |
+              ((size_t)header[1] << 8) |
+              ((size_t)header[2] << 16) |
+              ((size_t)header[3] << 24);
+    return true;
+}
+
+bool LZ4File::uncompress(const char *compressed, size_t length,
+                         char *data, size_t dataLength)
+{
+    if (length < LZ4_HEADER_SIZE) {
+        return false;
+    }
+    int result = LZ4_decompress_safe(compressed + LZ4_HEADER_SIZE, data,
+                                     length - LZ4_HEADER_SIZE, dataLength);
+    return result >= 0 && (size_t)result == dataLength;
+}
+
+
+File* File::createLZ4(void) {
+    return new LZ4File;
+}
+
+#else /* !HAVE_LZ4 */
+
+using namespace trace;
+
+File* File::createLZ4(void) {
+    return NULL;
+}
+
+#endif /* !HAVE_LZ4 */
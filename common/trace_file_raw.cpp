@@ -0,0 +1,99 @@
+/**************************************************************************
+ *
+ * Copyright 2011 Zack Rusin
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Uncompressed file format.
+ *
+ * Chunked file (see trace_file_chunked.hpp), with each chunk stored as is.
+ * Meant for handing the trace over to another process to compress, such as
+ * "apitrace collect", rather than for keeping on disk.
+ */
+
+
+#include "trace_file_chunked.hpp"
+
+
+using namespace trace;
+
+
+class RawFile : public ChunkedFile {
+public:
+    RawFile();
+    virtual ~RawFile();
+
+protected:
+    virtual size_t maxCompressedLength(size_t length);
+    virtual size_t compress(const char *data, size_t length,
+                            char *compressed);
+    virtual bool uncompressedLength(const char *compressed, size_t length,
+                                    size_t *result);
+    virtual bool uncompress(const char *compressed, size_t length,
+                            char *data, size_t dataLength);
+};
+
+RawFile::RawFile()
+    : ChunkedFile(RAW_BYTE1, RAW_BYTE2)
+{
+}
+
+RawFile::~RawFile()
+{
+    close();
+}
+
+size_t RawFile::maxCompressedLength(size_t length)
+{
+    return length;
+}
+
+size_t RawFile::compress(const char *data, size_t length,
+                         char *compressed)
+{
+    memcpy(compressed, data, length);
+    return length;
+}
+
+bool RawFile::uncompressedLength(const char *compressed, size_t length,
+                                 size_t *result)
+{
+    *result = length;
+    return true;
+}
+
+bool RawFile::uncompress(const char *compressed, size_t length,
+                         char *data, size_t dataLength)
+{
+    if (length != dataLength) {
+        return false;
+    }
+    memcpy(data, compressed, length);
+    return true;
+}
+
+
+File* File::createRaw(void) {
+    return new RawFile;
+}
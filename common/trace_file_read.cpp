@@ -25,17 +25,95 @@
 
 
 #include <fstream>
+#include <stdio.h>
 
 #include "os.hpp"
+#include "os_stream.hpp"
 #include "trace_file.hpp"
 
 
 using namespace trace;
 
 
+static File *
+createForMagic(const char *filename, unsigned char byte1, unsigned char byte2)
+{
+    File *file;
+    if (byte1 == SNAPPY_BYTE1 && byte2 == SNAPPY_BYTE2) {
+        file = File::createSnappy();
+    } else if (byte1 == ZSTD_BYTE1 && byte2 == ZSTD_BYTE2) {
+        file = File::createZstd();
+        if (!file) {
+            os::log("error: %s: zstd support not built in\n", filename);
+        }
+    } else if (byte1 == LZ4_BYTE1 && byte2 == LZ4_BYTE2) {
+        file = File::createLZ4();
+        if (!file) {
+            os::log("error: %s: lz4 support not built in\n", filename);
+        }
+    } else if (byte1 == RAW_BYTE1 && byte2 == RAW_BYTE2) {
+        file = File::createRaw();
+    } else if (byte1 == 0x1f && byte2 == 0x8b) {
+        file = File::createZLib();
+    } else  {
+        os::log("error: %s: unkwnown compression\n", filename);
+        return NULL;
+    }
+    return file;
+}
+
+
+/*
+ * Pipes, stdin and sockets can't be reopened, so peek at the identifier
+ * through the stream and hand the stream itself over to the file.
+ */
+static File *
+createForReadStream(const char *filename)
+{
+    std::streambuf *stream = os::openStream(filename, false);
+    if (!stream) {
+        os::log("error: failed to open %s\n", filename);
+        return NULL;
+    }
+
+    int byte1 = stream->sbumpc();
+    int byte2 = stream->sgetc();
+    if (byte1 == EOF || byte2 == EOF ||
+        stream->sungetc() == EOF) {
+        os::log("error: %s: unexpected end of stream\n", filename);
+        delete stream;
+        return NULL;
+    }
+
+    if (byte1 == 0x1f && byte2 == 0x8b) {
+        os::log("error: %s: gzip traces can't be read from a stream\n", filename);
+        delete stream;
+        return NULL;
+    }
+
+    File *file = createForMagic(filename, byte1, byte2);
+    if (!file) {
+        delete stream;
+        return NULL;
+    }
+
+    if (!file->open(stream, File::Read)) {
+        os::log("error: could not open %s for reading\n", filename);
+        delete file;
+        return NULL;
+    }
+
+    return file;
+}
+
+
 File *
 File::createForRead(const char *filename)
 {
+    if (os::isStream(filename)) {
+        return createForReadStream(filename);
+    }
+
     std::ifstream stream(filename, std::ifstream::binary | std::ifstream::in);
     if (!stream.is_open()) {
         os::log("error: failed to open %s\n", filename);
@@ -46,15 +124,7 @@ File::createForRead(const char *filename)
     stream >> byte2;
     stream.close();
 
-    File *file;
-    if (byte1 == SNAPPY_BYTE1 && byte2 == SNAPPY_BYTE2) {
-        file = File::createSnappy();
-    } else if (byte1 == 0x1f && byte2 == 0x8b) {
-        file = File::createZLib();
-    } else  {
-        os::log("error: %s: unkwnown compression\n", filename);
-        return NULL;
-    }
+    File *file = createForMagic(filename, byte1, byte2);
     if (!file) {
         return NULL;
     }
@@ -24,6 +24,8 @@
  **************************************************************************/
 
 
+#include <string.h>
+
 #include "os.hpp"
 #include "trace_file.hpp"
 
@@ -31,6 +33,31 @@
 using namespace trace;
 
 
+File *
+File::createForCodec(const char *codec)
+{
+    File *file = NULL;
+    if (strcmp(codec, "snappy") == 0) {
+        file = File::createSnappy();
+    } else if (strcmp(codec, "zstd") == 0) {
+        file = File::createZstd();
+    } else if (strcmp(codec, "lz4") == 0) {
+        file = File::createLZ4();
+    } else if (strcmp(codec, "none") == 0) {
+        file = File::createRaw();
+    } else if (strcmp(codec, "zlib") == 0 ||
+               strcmp(codec, "gzip") == 0) {
+        file = File::createZLib();
+    } else {
+        os::log("error: unknown codec %s\n", codec);
+        return NULL;
+    }
+    if (!file) {
+        os::log("error: %s support not built in\n", codec);
+    }
+    return file;
+}
+
 File *
 File::createForWrite(const char *filename)
 {
@@ -24,26 +24,59 @@
  **************************************************************************/
 
 
-#include "trace_file.hpp"
+/*
+ * Gzip traces.
+ *
+ * Gzip streams can't be seeked into, so when reading we keep zran-style
+ * access points: every SPAN_SIZE bytes of output, at a deflate block
+ * boundary, we record the compressed and uncompressed positions together
+ * with the last WINDOW_SIZE bytes of output, which is all the state the
+ * decompressor needs to resume from there.  Offsets are uncompressed
+ * positions, and seeking restores the nearest access point before the
+ * offset and decompresses forward from it.
+ *
+ * Access points are collected while reading, and once the whole file has
+ * been read they are saved next to it, as
+ * index {
+ *     INDEX_MAGIC
+ *     uint64 - size of the gzip file
+ *     uint64 - number of access points
+ *     access point {
+ *         uint64 - uncompressed position
+ *         uint64 - compressed position
+ *         uint32 - number of bits of the previous byte still to decode
+ *         uint32 - window length
+ *         window
+ *     }
+ * }
+ * in little endian, itself gzip compressed, so that later opens can seek
+ * right away.
+ */
 
 
+#include "trace_file.hpp"
+
 #include <assert.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <zlib.h>
-#include <gzguts.h>
 
-// for lseek
-#ifdef _WIN32
-#include <io.h>
-#else
-#include <sys/types.h>
-#include <unistd.h>
-#endif
+#include <algorithm>
+#include <fstream>
+#include <vector>
 
 #include "os.hpp"
 
-#include <iostream>
+
+#define IN_SIZE (64 * 1024)
+#define WINDOW_SIZE (32 * 1024)
+#define BUFFER_SIZE (256 * 1024)
+#define SPAN_SIZE (1024 * 1024)
+
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC "atgzidx1"
+#define INDEX_MAGIC_SIZE 8
 
 
 using namespace trace;
@@ -58,6 +91,7 @@ public:
 
     virtual bool supportsOffsets() const;
     virtual File::Offset currentOffset();
+    virtual void setCurrentOffset(const File::Offset &offset);
 protected:
     virtual bool rawOpen(const std::string &filename, File::Mode mode);
     virtual bool rawWrite(const void *buffer, size_t length);
@@ -68,14 +102,56 @@ protected:
     virtual bool rawSkip(size_t length);
     virtual int  rawPercentRead();
 private:
+    struct AccessPoint {
+        uint64_t out;
+        uint64_t in;
+        unsigned bits;
+        std::string window;
+    };
+
+    bool fill();
+    bool refill();
+    bool nextMember();
+    void addAccessPoint();
+    bool restart(const AccessPoint *point);
+    void loadIndex();
+    void saveIndex();
+
     gzFile m_gzFile;
-    double m_endOffset;
+
+    std::ifstream m_stream;
+    uint64_t m_endOffset;
+    z_stream m_strm;
+    bool m_inflating;
+    bool m_raw;
+    bool m_eof;
+    Bytef *m_in;
+    uint64_t m_inPos;
+
+    // Decompressed data up to m_readEnd, which corresponds to uncompressed
+    // position m_outPos, preceded by up to WINDOW_SIZE bytes of earlier
+    // output for the access points.
+    char *m_buffer;
+    uint64_t m_outPos;
+
+    std::string m_indexFilename;
+    std::vector<AccessPoint> m_points;
+    bool m_indexComplete;
 };
 
 ZLibFile::ZLibFile(const std::string &filename,
                    File::Mode mode)
     : File(filename, mode),
-      m_gzFile(NULL)
+      m_gzFile(NULL),
+      m_endOffset(0),
+      m_inflating(false),
+      m_raw(false),
+      m_eof(false),
+      m_in(NULL),
+      m_inPos(0),
+      m_buffer(NULL),
+      m_outPos(0),
+      m_indexComplete(false)
 {
 }
 
@@ -86,21 +162,26 @@ ZLibFile::~ZLibFile()
 
 bool ZLibFile::rawOpen(const std::string &filename, File::Mode mode)
 {
-    m_gzFile = gzopen(filename.c_str(),
-                      (mode == File::Write) ? "wb" : "rb");
+    if (mode == File::Write) {
+        m_gzFile = gzopen(filename.c_str(), "wb");
+        return m_gzFile != NULL;
+    }
 
-    if (mode == File::Read && m_gzFile) {
-        //XXX: unfortunately zlib doesn't support
-        //     SEEK_END or we could've done:
-        //m_endOffset = gzseek(m_gzFile, 0, SEEK_END);
-        //gzrewind(m_gzFile);
-        gz_state *state = (gz_state *)m_gzFile;
-        off_t loc = lseek(state->fd, 0, SEEK_CUR);
-        m_endOffset = lseek(state->fd, 0, SEEK_END);
-        lseek(state->fd, loc, SEEK_SET);
+    m_stream.open(filename.c_str(), std::fstream::binary | std::fstream::in);
+    if (!m_stream.is_open()) {
+        return false;
     }
+    m_stream.seekg(0, std::ios::end);
+    m_endOffset = m_stream.tellg();
+    m_stream.seekg(0, std::ios::beg);
 
-    return m_gzFile != NULL;
+    m_in = new Bytef[IN_SIZE];
+    m_buffer = new char[BUFFER_SIZE];
+
+    m_indexFilename = filename + INDEX_SUFFIX;
+    loadIndex();
+
+    return restart(NULL);
 }
 
 bool ZLibFile::rawWrite(const void *buffer, size_t length)
@@ -108,15 +189,183 @@ bool ZLibFile::rawWrite(const void *buffer, size_t length)
     return gzwrite(m_gzFile, buffer, length) != -1;
 }
 
+bool ZLibFile::refill()
+{
+    m_stream.read((char *)m_in, IN_SIZE);
+    size_t length = m_stream.gcount();
+    if (!length) {
+        return false;
+    }
+    m_inPos += length;
+    m_strm.next_in = m_in;
+    m_strm.avail_in = length;
+    return true;
+}
+
+bool ZLibFile::nextMember()
+{
+    if (m_raw) {
+        // Restarting from an access point inflates raw deflate data, which
+        // leaves the gzip trailer to us.
+        for (unsigned i = 0; i < 8; ++i) {
+            if (!m_strm.avail_in && !refill()) {
+                return false;
+            }
+            ++m_strm.next_in;
+            --m_strm.avail_in;
+        }
+    }
+
+    // Concatenated gzip members are valid gzip files
+    if (!m_strm.avail_in && !refill()) {
+        if (!m_indexComplete) {
+            m_indexComplete = true;
+            saveIndex();
+        }
+        return false;
+    }
+
+    inflateReset2(&m_strm, 15 + 16);
+    m_raw = false;
+    return true;
+}
+
+bool ZLibFile::fill()
+{
+    if (m_eof) {
+        return false;
+    }
+
+    // Everything was read, but keep the last window of output, for the
+    // access points
+    assert(m_readPtr == m_readEnd);
+    size_t bufferLength = m_readEnd - m_buffer;
+    if (bufferLength > WINDOW_SIZE) {
+        memmove(m_buffer, m_readEnd - WINDOW_SIZE, WINDOW_SIZE);
+        bufferLength = WINDOW_SIZE;
+    }
+    size_t start = bufferLength;
+
+    while (bufferLength < BUFFER_SIZE) {
+        if (!m_strm.avail_in && !refill()) {
+            // Truncated
+            m_eof = true;
+            break;
+        }
+
+        m_strm.next_out = (Bytef *)m_buffer + bufferLength;
+        m_strm.avail_out = BUFFER_SIZE - bufferLength;
+        int ret = inflate(&m_strm, Z_BLOCK);
+        size_t length = BUFFER_SIZE - bufferLength - m_strm.avail_out;
+        bufferLength += length;
+        m_outPos += length;
+        m_readEnd = m_buffer + bufferLength;
+
+        if (ret == Z_STREAM_END) {
+            if (!nextMember()) {
+                m_eof = true;
+                break;
+            }
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            m_eof = true;
+            break;
+        } else if ((m_strm.data_type & 128) && !(m_strm.data_type & 64)) {
+            addAccessPoint();
+        }
+    }
+
+    m_readPtr = m_buffer + start;
+    return m_readPtr < m_readEnd;
+}
+
+void ZLibFile::addAccessPoint()
+{
+    if (m_indexComplete ||
+        m_outPos < (m_points.empty() ? 0 : m_points.back().out) + SPAN_SIZE) {
+        return;
+    }
+
+    size_t windowLength = std::min((size_t)(m_readEnd - m_buffer),
+                                   (size_t)WINDOW_SIZE);
+
+    m_points.push_back(AccessPoint());
+    AccessPoint &point = m_points.back();
+    point.out = m_outPos;
+    point.in = m_inPos - m_strm.avail_in;
+    point.bits = m_strm.data_type & 7;
+    point.window.assign(m_readEnd - windowLength, windowLength);
+}
+
+bool ZLibFile::restart(const AccessPoint *point)
+{
+    if (m_inflating) {
+        inflateEnd(&m_strm);
+        m_inflating = false;
+    }
+
+    memset(&m_strm, 0, sizeof m_strm);
+    m_eof = false;
+    m_readPtr = m_buffer;
+    m_readEnd = m_buffer;
+    m_stream.clear();
+
+    if (!point) {
+        m_stream.seekg(0, std::ios::beg);
+        m_inPos = 0;
+        m_outPos = 0;
+        m_raw = false;
+        m_inflating = inflateInit2(&m_strm, 15 + 16) == Z_OK;
+        return m_inflating;
+    }
+
+    // The access point may be in the middle of a byte
+    uint64_t in = point->in - (point->bits ? 1 : 0);
+    m_stream.seekg(in, std::ios::beg);
+    m_inPos = in;
+    m_outPos = point->out;
+    m_raw = true;
+    if (inflateInit2(&m_strm, -15) != Z_OK) {
+        return false;
+    }
+    m_inflating = true;
+    if (point->bits) {
+        int c = m_stream.get();
+        if (c == EOF) {
+            return false;
+        }
+        ++m_inPos;
+        inflatePrime(&m_strm, point->bits, c >> (8 - point->bits));
+    }
+    inflateSetDictionary(&m_strm, (const Bytef *)point->window.data(),
+                         point->window.size());
+
+    memcpy(m_buffer, point->window.data(), point->window.size());
+    m_readPtr = m_buffer + point->window.size();
+    m_readEnd = m_readPtr;
+    return true;
+}
+
 size_t ZLibFile::rawRead(void *buffer, size_t length)
 {
-    int ret = gzread(m_gzFile, buffer, length);
-    return ret < 0 ? 0 : ret;
+    size_t read = 0;
+    while (read < length) {
+        if (m_readPtr == m_readEnd && !fill()) {
+            break;
+        }
+        size_t chunk = std::min(length - read, (size_t)(m_readEnd - m_readPtr));
+        memcpy((char *)buffer + read, m_readPtr, chunk);
+        m_readPtr += chunk;
+        read += chunk;
+    }
+    return read;
 }
 
 int ZLibFile::rawGetc()
 {
-    return gzgetc(m_gzFile);
+    if (m_readPtr == m_readEnd && !fill()) {
+        return -1;
+    }
+    return (unsigned char)*m_readPtr++;
 }
 
 void ZLibFile::rawClose()
@@ -125,6 +374,19 @@ void ZLibFile::rawClose()
         gzclose(m_gzFile);
         m_gzFile = NULL;
     }
+    if (m_inflating) {
+        inflateEnd(&m_strm);
+        m_inflating = false;
+    }
+    if (m_stream.is_open()) {
+        m_stream.close();
+    }
+    delete [] m_in;
+    m_in = NULL;
+    delete [] m_buffer;
+    m_buffer = NULL;
+    m_points.clear();
+    m_indexComplete = false;
 }
 
 void ZLibFile::rawFlush()
@@ -134,23 +396,173 @@ void ZLibFile::rawFlush()
 
 File::Offset ZLibFile::currentOffset()
 {
-    return File::Offset(gztell(m_gzFile));
+    if (m_mode == File::Write) {
+        return File::Offset(gztell(m_gzFile));
+    }
+    return File::Offset(m_outPos - (m_readEnd - m_readPtr));
+}
+
+void ZLibFile::setCurrentOffset(const File::Offset &offset)
+{
+    assert(m_mode == File::Read);
+
+    uint64_t target = offset.chunk;
+
+    // Still buffered
+    if (target <= m_outPos && target >= m_outPos - (m_readEnd - m_buffer)) {
+        m_readPtr = m_readEnd - (m_outPos - target);
+        return;
+    }
+
+    // Restart from the last access point before the target, unless
+    // decompressing forward from here gets there sooner.
+    const AccessPoint *point = NULL;
+    for (size_t i = m_points.size(); i-- > 0; ) {
+        if (m_points[i].out <= target) {
+            point = &m_points[i];
+            break;
+        }
+    }
+    if (target < m_outPos || (point && point->out > m_outPos)) {
+        if (!restart(point)) {
+            m_eof = true;
+            return;
+        }
+    }
+
+    rawSkip(target - currentOffset().chunk);
 }
 
 bool ZLibFile::supportsOffsets() const
 {
-    return false;
+    return m_mode == File::Read;
 }
 
-bool ZLibFile::rawSkip(size_t)
+bool ZLibFile::rawSkip(size_t length)
 {
-    return false;
+    while (length) {
+        if (m_readPtr == m_readEnd && !fill()) {
+            return false;
+        }
+        size_t chunk = std::min(length, (size_t)(m_readEnd - m_readPtr));
+        m_readPtr += chunk;
+        length -= chunk;
+    }
+    return true;
 }
 
 int ZLibFile::rawPercentRead()
 {
-    gz_state *state = (gz_state *)m_gzFile;
-    return 100 * (lseek(state->fd, 0, SEEK_CUR) / m_endOffset);
+    if (!m_endOffset) {
+        return 100;
+    }
+    return 100 * (m_inPos - m_strm.avail_in) / m_endOffset;
+}
+
+
+static void
+putUInt(std::string &buf, uint64_t value, unsigned size)
+{
+    for (unsigned i = 0; i < size; ++i) {
+        buf += (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static bool
+getUInt(gzFile file, uint64_t *value, unsigned size)
+{
+    unsigned char buf[8];
+    assert(size <= sizeof buf);
+    if (gzread(file, buf, size) != (int)size) {
+        return false;
+    }
+    *value = 0;
+    for (unsigned i = 0; i < size; ++i) {
+        *value |= (uint64_t)buf[i] << (8 * i);
+    }
+    return true;
+}
+
+void ZLibFile::loadIndex()
+{
+    gzFile file = gzopen(m_indexFilename.c_str(), "rb");
+    if (!file) {
+        return;
+    }
+
+    char magic[INDEX_MAGIC_SIZE];
+    uint64_t fileSize = 0;
+    uint64_t numPoints = 0;
+    bool valid =
+        gzread(file, magic, sizeof magic) == (int)sizeof magic &&
+        memcmp(magic, INDEX_MAGIC, INDEX_MAGIC_SIZE) == 0 &&
+        getUInt(file, &fileSize, 8) &&
+        fileSize == m_endOffset &&
+        getUInt(file, &numPoints, 8);
+
+    std::vector<AccessPoint> points;
+    for (uint64_t i = 0; valid && i < numPoints; ++i) {
+        AccessPoint point;
+        uint64_t bits = 0;
+        uint64_t windowLength = 0;
+        valid = getUInt(file, &point.out, 8) &&
+                getUInt(file, &point.in, 8) &&
+                getUInt(file, &bits, 4) &&
+                getUInt(file, &windowLength, 4) &&
+                bits < 8 &&
+                point.in > 0 && point.in <= m_endOffset &&
+                windowLength <= WINDOW_SIZE &&
+                (points.empty() || points.back().out < point.out);
+        if (valid) {
+            point.bits = bits;
+            point.window.resize(windowLength);
+            valid = gzread(file, &point.window[0], windowLength) ==
+                    (int)windowLength;
+            points.push_back(point);
+        }
+    }
+
+    gzclose(file);
+
+    if (valid) {
+        m_points.swap(points);
+        m_indexComplete = true;
+    }
+}
+
+void ZLibFile::saveIndex()
+{
+    if (m_indexFilename.empty()) {
+        return;
+    }
+
+    std::string header(INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    putUInt(header, m_endOffset, 8);
+    putUInt(header, m_points.size(), 8);
+
+    // Failing to save the index is harmless, as it will be rebuilt next time
+    gzFile file = gzopen(m_indexFilename.c_str(), "wb");
+    if (!file) {
+        return;
+    }
+    bool ok = gzwrite(file, header.data(), header.size()) == (int)header.size();
+    for (size_t i = 0; ok && i < m_points.size(); ++i) {
+        const AccessPoint &point = m_points[i];
+        std::string buf;
+        putUInt(buf, point.out, 8);
+        putUInt(buf, point.in, 8);
+        putUInt(buf, point.bits, 4);
+        putUInt(buf, point.window.size(), 4);
+        buf += point.window;
+        ok = gzwrite(file, buf.data(), buf.size()) == (int)buf.size();
+    }
+    if (gzclose(file) != Z_OK || !ok) {
+        remove(m_indexFilename.c_str());
+    }
+
+    // Only save once
+    m_indexFilename.clear();
 }
 
 
@@ -0,0 +1,136 @@
+/**************************************************************************
+ *
+ * Copyright 2011 Zack Rusin
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * Zstandard file format.
+ *
+ * Chunked file (see trace_file_chunked.hpp), with each chunk being a
+ * complete zstd frame, which records its own uncompressed size.  Compresses
+ * noticeably better than snappy, at a cost in compression speed which
+ * depends on the compression level.
+ */
+
+
+#include "trace_file_chunked.hpp"
+
+#ifdef HAVE_ZSTD
+
+#include <zstd.h>
+
+
+using namespace trace;
+
+
+class ZstdFile : public ChunkedFile {
+public:
+    ZstdFile();
+    virtual ~ZstdFile();
+
+    virtual void setCompressionLevel(int level);
+
+protected:
+    virtual size_t maxCompressedLength(size_t length);
+    virtual size_t compress(const char *data, size_t length,
+                            char *compressed);
+    virtual bool uncompressedLength(const char *compressed, size_t length,
+                                    size_t *result);
+    virtual bool uncompress(const char *compressed, size_t length,
+                            char *data, size_t dataLength);
+
+private:
+    int m_level;
+};
+
+ZstdFile::ZstdFile()
+    : ChunkedFile(ZSTD_BYTE1, ZSTD_BYTE2),
+      m_level(3)
+{
+}
+
+ZstdFile::~ZstdFile()
+{
+    close();
+}
+
+void ZstdFile::setCompressionLevel(int level)
+{
+    if (level > ZSTD_maxCLevel()) {
+        level = ZSTD_maxCLevel();
+    }
+    m_level = level;
+}
+
+size_t ZstdFile::maxCompressedLength(size_t length)
+{
+    return ZSTD_compressBound(length);
+}
+
+size_t ZstdFile::compress(const char *data, size_t length,
+                          char *compressed)
+{
+    // Called concurrently from the compression threads, so no context can
+    // be shared between calls.
+    size_t compressedLength =
+        ZSTD_compress(compressed, ZSTD_compressBound(length),
+                      data, length, m_level);
+    assert(!ZSTD_isError(compressedLength));
+    return compressedLength;
+}
+
+bool ZstdFile::uncompressedLength(const char *compressed, size_t length,
+                                  size_t *result)
+{
+    unsigned long long contentSize =
+        ZSTD_getFrameContentSize(compressed, length);
+    if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN ||
+        contentSize == ZSTD_CONTENTSIZE_ERROR) {
+        return false;
+    }
+    *result = contentSize;
+    return true;
+}
+
+bool ZstdFile::uncompress(const char *compressed, size_t length,
+                          char *data, size_t dataLength)
+{
+    size_t result = ZSTD_decompress(data, dataLength, compressed, length);
+    return !ZSTD_isError(result) && result == dataLength;
+}
+
+
+File* File::createZstd(void) {
+    return new ZstdFile;
+}
+
+#else /* !HAVE_ZSTD */
+
+using namespace trace;
+
+File* File::createZstd(void) {
+    return NULL;
+}
+
+#endif /* !HAVE_ZSTD */
@@ -72,17 +72,55 @@ namespace trace {
  *
  * - version 5:
  *   - new call detail flag CALL_BACKTRACE
+ *
+ * - version 6:
+ *   - blobs may refer to an identical blob written before, see BLOB_REF
+ *
+ * - version 7:
+ *   - new call detail CALL_TIME
+ *
+ * - version 8:
+ *   - new call detail CALL_STACK, referring to whole backtraces by id
+ *
+ * - version 9:
+ *   - new stack frame details ADDRESS and BUILD_ID, for symbolizing offline
+ *
+ * - version 10:
+ *   - trace properties after the version
+ *
+ * - version 11:
+ *   - new event EVENT_DEFINE, for traces which start midway
+ *
+ * - version 12:
+ *   - new definition FRAME, for self-describing rotated trace segments
+ *
+ * - version 13:
+ *   - enter and leave events give the length of their call details, see
+ *     EVENT_LENGTH_BYTES
  */
-#define TRACE_VERSION 5
+#define TRACE_VERSION 13
 
 
 /*
  * Grammar:
  *
- *   trace = event* EOF
+ *   trace = version property* end event* EOF
+ *
+ *   property = name value
  *
- *   event = EVENT_ENTER thread_id call_sig call_detail+
- *         | EVENT_LEAVE call_no call_detail+
+ *   end = ""
+ *
+ *   event = EVENT_ENTER thread_id call_sig length call_detail+
+ *         | EVENT_LEAVE call_no length call_detail+
+ *         | EVENT_DEFINE definition* END
+ *
+ *   definition = FUNCTION call_sig
+ *              | STRUCT struct_sig
+ *              | ENUM enum_sig
+ *              | BITMASK bitmask_sig
+ *              | STACK stack
+ *              | FRAME frame
+ *              | CALL_NO uint
  *
  *   call_sig = sig_id ( name arg_names )?
  *
@@ -90,6 +128,8 @@ namespace trace {
  *               | RET value
  *               | THREAD int
  *               | BACKTRACE int frame*
+ *               | TIME uint
+ *               | STACK stack
  *               | END
  *
  *   value = NULL
@@ -107,6 +147,10 @@ namespace trace {
  *         | STRUCT struct_sig value+
  *         | OPAQUE int
  *         | REPR value value
+ *         | BLOB_REF distance offset
+ *
+ *   stack = id count frame*
+ *         | id
  *
  *   frame = id frame_detail+
  *         | id
@@ -116,6 +160,8 @@ namespace trace {
  *                | FILENAME string
  *                | LINENUMBER uint
  *                | OFFSET uint
+ *                | ADDRESS uint
+ *                | BUILD_ID string
  *                | END
  *
  *   call_sig = id name arg_name*
@@ -132,9 +178,155 @@ namespace trace {
  */
 
 
+/*
+ * Event lengths.
+ *
+ * The length of an event's call details, END included, lets readers which
+ * only want the call itself skip straight to the next event.  It is zero
+ * when not known, as well as for events which readers must go through
+ * anyway, because they define signatures, stacks or frames, or write or
+ * refer to blobs which may be referred to later (see BLOB_REF).
+ *
+ * Writers fill it in once the event is complete, so it always takes
+ * EVENT_LENGTH_BYTES bytes, with the unused high bytes of the uint encoded
+ * as 0x80 continuations, and events too long for that have no length.
+ */
+#define EVENT_LENGTH_BYTES 2
+
+
+/*
+ * Trace properties.
+ *
+ * Name and value strings telling how the trace was recorded, e.g.:
+ *
+ * - "filter": the APITRACE_FILTER policy, when calls were left out while
+ *   tracing
+ * - "flight_recorder": why the flight recorder dumped the trace, see
+ *   APITRACE_FLIGHT_RECORDER
+ * - "replayable": "no" when the calls made before the trace starts are
+ *   missing, so that it can be looked at but not replayed
+ *
+ * An empty name ends the list.
+ */
+
+
+/*
+ * Definitions.
+ *
+ * Traces which start midway, such as flight recorder dumps, lack the events
+ * where the signatures and stacks in use were first defined.  A DEFINE event
+ * at the start defines them instead, and gives the number of the next call
+ * entered, as the calls before it were left out.
+ *
+ * Rotated traces are split into segments which can each be read on their
+ * own, so every segment after the first starts with a DEFINE event repeating
+ * everything defined before it.  Definitions in a DEFINE event are always
+ * given in full, even when the reader knows them already from a previous
+ * segment.  A manifest lists the segments, see trace_manifest.hpp.
+ */
+
+
+/*
+ * Call times.
+ *
+ * Traces may record when each call was made, in nanoseconds.  The TIME
+ * detail of an enter event is the time since the trace was started, and the
+ * TIME detail of the matching leave event is the time since the enter, so
+ * that the common case of short calls takes few bytes.
+ */
+
+
+/*
+ * Call stacks.
+ *
+ * Calls are often made from the same few places, so instead of listing the
+ * frames of every backtrace, the STACK detail names the whole stack by id,
+ * and lists its frames only the first time it appears, like signatures.
+ */
+
+
+/*
+ * Deferred symbolization.
+ *
+ * Resolving symbols while tracing is slow, so frames may instead carry the
+ * path and GNU build-id of their module, and the ADDRESS of the frame relative
+ * to where the module was loaded, i.e., as in the module's ELF file.  Readers
+ * resolve frames which have an ADDRESS but no FUNCTION.
+ */
+
+
+/*
+ * Blob references.
+ *
+ * Applications often upload the same data over and over, so instead of
+ * repeating a blob the writer may refer to an identical one written before.
+ * Readers resolve references by keeping the recently written blobs, the same
+ * way the writer does:
+ *
+ * - every blob of BLOB_DEDUP_MIN_SIZE to BLOB_DEDUP_MAX_SIZE bytes gets the
+ *   next number, starting from zero, and is added to a least recently used
+ *   list;
+ * - a reference moves the blob it refers to to the end of the list;
+ * - the least recently used blobs are dropped from the list while it holds
+ *   more than BLOB_DEDUP_ENTRIES blobs, or more than BLOB_DEDUP_WINDOW bytes.
+ *
+ * References only ever refer to blobs still in the list, by the difference
+ * between the next blob number and theirs.  They also carry the offset of
+ * the referred blob's length, as in the index, which readers can seek to when
+ * they didn't read the blob, e.g. after seeking past it.
+ */
+#define BLOB_DEDUP_MIN_SIZE 256
+#define BLOB_DEDUP_MAX_SIZE (16*1024*1024)
+#define BLOB_DEDUP_ENTRIES 4096
+#define BLOB_DEDUP_WINDOW (64*1024*1024)
+
+
+/*
+ * Trace index.
+ *
+ * When a trace is closed cleanly the writer may append an index, stored by
+ * the file layer after the end of the event stream, so that readers can seek
+ * to any frame without scanning the whole trace first.  Truncated traces
+ * simply lack it.  Offsets are the file offsets of the writer, which the file
+ * layer maps to real file offsets when reading.
+ *
+ *   index = INDEX_VERSION index_entry* INDEX_END
+ *
+ *   index_entry = FUNCTION_SIG offset
+ *               | STRUCT_SIG offset
+ *               | ENUM_SIG offset
+ *               | BITMASK_SIG offset
+ *               | STACK_FRAME offset
+ *               | STACK offset
+ *               | CALL offset call_no
+ *               | FRAME offset call_no num_calls last_call_no
+ *               | TAIL offset call_no num_calls
+ *
+ *   offset = chunk offset_in_chunk
+ *
+ * Signature entries point at the id of the signature definitions, in order,
+ * so that all signatures can be known upfront.  CALL entries point at the
+ * first call entered in each chunk.  FRAME entries describe frames ending
+ * with a CALL_FLAG_END_FRAME call, and TAIL the calls after the last one.
+ */
+#define TRACE_INDEX_VERSION 1
+
+
 enum Event {
     EVENT_ENTER = 0,
     EVENT_LEAVE,
+    EVENT_DEFINE,
+};
+
+enum Definition {
+    DEFINE_END = 0,
+    DEFINE_FUNCTION,
+    DEFINE_STRUCT,
+    DEFINE_ENUM,
+    DEFINE_BITMASK,
+    DEFINE_STACK,
+    DEFINE_CALL_NO,
+    DEFINE_FRAME,
 };
 
 enum CallDetail {
@@ -143,6 +335,8 @@ enum CallDetail {
     CALL_RET,
     CALL_THREAD,
     CALL_BACKTRACE,
+    CALL_TIME,
+    CALL_STACK,
 };
 
 enum Type {
@@ -161,6 +355,7 @@ enum Type {
     TYPE_STRUCT,
     TYPE_OPAQUE,
     TYPE_REPR,
+    TYPE_BLOB_REF,
 };
 
 enum BacktraceDetail {
@@ -170,6 +365,21 @@ enum BacktraceDetail {
     BACKTRACE_FILENAME,
     BACKTRACE_LINENUMBER,
     BACKTRACE_OFFSET,
+    BACKTRACE_ADDRESS,
+    BACKTRACE_BUILD_ID,
+};
+
+enum IndexEntry {
+    INDEX_END = 0,
+    INDEX_FUNCTION_SIG,
+    INDEX_STRUCT_SIG,
+    INDEX_ENUM_SIG,
+    INDEX_BITMASK_SIG,
+    INDEX_STACK_FRAME,
+    INDEX_CALL,
+    INDEX_FRAME,
+    INDEX_TAIL,
+    INDEX_STACK,
 };
 
 
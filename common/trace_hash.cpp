@@ -0,0 +1,139 @@
+/**************************************************************************
+ *
+ * Copyright 2011-2012 Jose Fonseca
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+/*
+ * This is the XXH64 algorithm, from the xxHash library by Yann Collet.
+ */
+
+
+#include <string.h>
+
+#include "trace_hash.hpp"
+
+
+namespace trace {
+
+
+static const unsigned long long PRIME1 = 11400714785074694791ULL;
+static const unsigned long long PRIME2 = 14029467366897019727ULL;
+static const unsigned long long PRIME3 = 1609587929392839161ULL;
+static const unsigned long long PRIME4 = 9650029242287828579ULL;
+static const unsigned long long PRIME5 = 2870177450012600261ULL;
+
+
+static inline unsigned long long
+rotl(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long
+read64(const unsigned char *p) {
+    unsigned long long value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static inline unsigned long long
+read32(const unsigned char *p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+static inline unsigned long long
+accumulate(unsigned long long acc, unsigned long long input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline unsigned long long
+mergeRound(unsigned long long acc, unsigned long long value) {
+    acc ^= accumulate(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+
+unsigned long long
+hash64(const void *data, size_t size) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    const unsigned char *end = p + size;
+    unsigned long long h;
+
+    if (size >= 32) {
+        const unsigned char *limit = end - 32;
+        unsigned long long v1 = PRIME1 + PRIME2;
+        unsigned long long v2 = PRIME2;
+        unsigned long long v3 = 0;
+        unsigned long long v4 = 0 - PRIME1;
+        do {
+            v1 = accumulate(v1, read64(p));
+            v2 = accumulate(v2, read64(p + 8));
+            v3 = accumulate(v3, read64(p + 16));
+            v4 = accumulate(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    } else {
+        h = PRIME5;
+    }
+
+    h += size;
+
+    while (p + 8 <= end) {
+        h ^= accumulate(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+} /* namespace trace */
@@ -50,6 +50,23 @@ bool Loader::open(const char *filename)
         return false;
     }
 
+    // Frames are readily available from the index, if the trace has one.
+    if (m_frameMarker == FrameMarker_SwapBuffers &&
+        m_parser.loadIndex()) {
+        const FrameIndex &frameIndex = m_parser.getFrameIndex();
+        unsigned numOfFrames = 0;
+        for (FrameIndex::const_iterator it = frameIndex.begin();
+             it != frameIndex.end(); ++it) {
+            if (it->complete) {
+                FrameBookmark frameBookmark(it->start);
+                frameBookmark.numberOfCalls = it->numberOfCalls;
+                m_frameBookmarks[numOfFrames] = frameBookmark;
+                ++numOfFrames;
+            }
+        }
+        return true;
+    }
+
     trace::Call *call;
     ParseBookmark startBookmark;
     unsigned numOfFrames = 0;
@@ -118,6 +135,11 @@ std::vector<trace::Call *> Loader::frame(unsigned idx)
         std::vector<trace::Call*> calls(numOfCalls);
         m_parser.setBookmark(frameBookmark.start);
 
+        // Free the whole frame's values at once
+        trace::Arena *arena = new trace::Arena;
+        m_parser.setArena(arena);
+        arena->unref();
+
         trace::Call *call;
         unsigned parsedCalls = 0;
         while ((call = m_parser.parse_call())) {
@@ -130,6 +152,7 @@ std::vector<trace::Call *> Loader::frame(unsigned idx)
             }
 
         }
+        m_parser.setArena(NULL);
         assert(parsedCalls == numOfCalls);
         return calls;
     }
@@ -0,0 +1,173 @@
+/**************************************************************************
+ *
+ * Copyright 2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os_string.hpp"
+#include "trace_manifest.hpp"
+
+
+namespace trace {
+
+
+static const char manifestHeader[] = "# apitrace manifest";
+
+
+static void
+writeNumber(FILE *fp, unsigned number) {
+    if (number == ManifestSegment::UNKNOWN) {
+        fputs("- ", fp);
+    } else {
+        fprintf(fp, "%u ", number);
+    }
+}
+
+
+static bool
+readNumber(char *&p, unsigned &number) {
+    while (*p == ' ' || *p == '\t') {
+        ++p;
+    }
+    if (*p == '-') {
+        number = ManifestSegment::UNKNOWN;
+        ++p;
+        return true;
+    }
+    char *end;
+    number = strtoul(p, &end, 10);
+    if (end == p) {
+        return false;
+    }
+    p = end;
+    return true;
+}
+
+
+static bool
+readLine(FILE *fp, std::string &line) {
+    line.clear();
+    char buf[512];
+    while (fgets(buf, sizeof buf, fp)) {
+        line += buf;
+        if (!line.empty() && line[line.length() - 1] == '\n') {
+            break;
+        }
+    }
+    while (!line.empty() &&
+           (line[line.length() - 1] == '\n' || line[line.length() - 1] == '\r')) {
+        line.erase(line.length() - 1);
+    }
+    return !line.empty() || !feof(fp);
+}
+
+
+bool
+Manifest::isManifest(const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+    char buf[sizeof manifestHeader - 1];
+    bool result = fread(buf, 1, sizeof buf, fp) == sizeof buf &&
+                  memcmp(buf, manifestHeader, sizeof buf) == 0;
+    fclose(fp);
+    return result;
+}
+
+
+bool
+Manifest::read(const char *filename) {
+    segments.clear();
+
+    FILE *fp = fopen(filename, "rt");
+    if (!fp) {
+        return false;
+    }
+
+    os::String dir(filename);
+    dir.trimFilename();
+
+    std::string line;
+    if (!readLine(fp, line) || line != manifestHeader) {
+        fclose(fp);
+        return false;
+    }
+
+    while (readLine(fp, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        ManifestSegment segment;
+        char *p = &line[0];
+        if (!readNumber(p, segment.firstCall) ||
+            !readNumber(p, segment.endCall) ||
+            !readNumber(p, segment.firstFrame) ||
+            !readNumber(p, segment.endFrame) ||
+            *p != ' ') {
+            fclose(fp);
+            segments.clear();
+            return false;
+        }
+
+        os::String path(dir);
+        path.join(os::String(p + 1));
+        segment.filename = path.str();
+        segments.push_back(segment);
+    }
+
+    fclose(fp);
+    return !segments.empty();
+}
+
+
+bool
+Manifest::write(const char *filename) const {
+    FILE *fp = fopen(filename, "wt");
+    if (!fp) {
+        return false;
+    }
+
+    fprintf(fp, "%s\n", manifestHeader);
+    for (unsigned i = 0; i < segments.size(); ++i) {
+        const ManifestSegment &segment = segments[i];
+        os::String name(segment.filename.c_str());
+        name.trimDirectory();
+        writeNumber(fp, segment.firstCall);
+        writeNumber(fp, segment.endCall);
+        writeNumber(fp, segment.firstFrame);
+        writeNumber(fp, segment.endFrame);
+        fprintf(fp, "%s\n", name.str());
+    }
+
+    bool result = !ferror(fp);
+    return fclose(fp) == 0 && result;
+}
+
+
+} /* namespace trace */
@@ -0,0 +1,101 @@
+/**************************************************************************
+ *
+ * Copyright 2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Manifests of rotated traces.
+ *
+ * A trace rotated with APITRACE_ROTATE_SIZE or APITRACE_ROTATE_FRAMES is
+ * split into segments, name.0001.trace, name.0002.trace, and so on, which can
+ * each be read on their own.  The manifest, a small text file at name.trace,
+ * lists them in order, e.g.:
+ *
+ *     # apitrace manifest
+ *     0 51234 0 300 name.0001.trace
+ *     51234 - 300 - name.0002.trace
+ *
+ * with the first call, the call after the last, the first frame, and the
+ * frame after the last of each segment, or "-" where not known yet, followed
+ * by the segment file name relative to the manifest.
+ */
+
+#ifndef _TRACE_MANIFEST_HPP_
+#define _TRACE_MANIFEST_HPP_
+
+
+#include <string>
+#include <vector>
+
+
+namespace trace {
+
+
+    struct ManifestSegment {
+        std::string filename;
+        unsigned firstCall;
+        unsigned endCall;
+        unsigned firstFrame;
+        unsigned endFrame;
+
+        // Marks ends not known yet
+        static const unsigned UNKNOWN = ~0U;
+
+        ManifestSegment() :
+            firstCall(0),
+            endCall(UNKNOWN),
+            firstFrame(0),
+            endFrame(UNKNOWN)
+        {}
+    };
+
+
+    class Manifest {
+    public:
+        std::vector<ManifestSegment> segments;
+
+        /**
+         * Whether the file is a manifest rather than a trace.
+         */
+        static bool
+        isManifest(const char *filename);
+
+        /**
+         * Read a manifest.  Segment file names are made relative to the
+         * current directory.
+         */
+        bool
+        read(const char *filename);
+
+        /**
+         * Write a manifest, with segment file names relative to it.
+         */
+        bool
+        write(const char *filename) const;
+    };
+
+
+} /* namespace trace */
+
+
+#endif /* _TRACE_MANIFEST_HPP_ */
@@ -24,12 +24,116 @@
  **************************************************************************/
 
 
+#include <string.h>
+
+#include <algorithm>
+#include <new>
+
+#include "os_thread.hpp"
 #include "trace_model.hpp"
+#include "trace_file.hpp"
 
 
 namespace trace {
 
 
+#define ARENA_ALIGNMENT sizeof(double)
+#define ARENA_MIN_BLOCK_SIZE (4 * 1024)
+#define ARENA_MAX_BLOCK_SIZE (1024 * 1024)
+
+
+Arena::Arena() :
+    m_ptr(m_inline.data),
+    m_end(m_inline.data + sizeof m_inline.data),
+    m_blocks(NULL),
+    m_blockSize(ARENA_MIN_BLOCK_SIZE),
+    m_refCount(1)
+{
+}
+
+Arena::~Arena()
+{
+    while (m_blocks) {
+        Block *next = m_blocks->next;
+        free(m_blocks);
+        m_blocks = next;
+    }
+}
+
+void *Arena::alloc(size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (size > (size_t)(m_end - m_ptr)) {
+        size_t blockSize = sizeof(Block) + size;
+        bool dedicated = size > m_blockSize / 2;
+        if (!dedicated) {
+            blockSize = std::max(blockSize, m_blockSize);
+        }
+        Block *block = (Block *)malloc(blockSize);
+        if (!block) {
+            throw std::bad_alloc();
+        }
+        block->next = m_blocks;
+        m_blocks = block;
+        char *data = (char *)(block + 1);
+        if (dedicated) {
+            // Big values, like blobs, don't waste what's left of the
+            // current block
+            return data;
+        }
+        m_ptr = data;
+        m_end = (char *)block + blockSize;
+        m_blockSize = std::min(m_blockSize * 2, (size_t)ARENA_MAX_BLOCK_SIZE);
+    }
+    void *ptr = m_ptr;
+    m_ptr += size;
+    return ptr;
+}
+
+void Arena::ref(void)
+{
+    os::atomic_fetch_add(&m_refCount, 1U);
+}
+
+void Arena::unref(void)
+{
+    unsigned previous = os::atomic_fetch_add(&m_refCount, -1U);
+    assert(previous > 0);
+    if (previous == 1) {
+        delete this;
+    }
+}
+
+
+/*
+ * Every value is preceded by the arena it was allocated from, if any.
+ */
+union ValueHeader {
+    Arena *arena;
+    double align;
+};
+
+void *Value::operator new(size_t size, Arena *arena) {
+    ValueHeader *header;
+    if (arena) {
+        header = (ValueHeader *)arena->alloc(sizeof *header + size);
+    } else {
+        header = (ValueHeader *)::operator new(sizeof *header + size);
+    }
+    header->arena = arena;
+    return header + 1;
+}
+
+void Value::operator delete(void *ptr) {
+    if (ptr) {
+        ValueHeader *header = (ValueHeader *)ptr - 1;
+        if (!header->arena) {
+            ::operator delete(header);
+        }
+    }
+}
+
+
 Call::~Call() {
     for (unsigned i = 0; i < args.size(); ++i) {
         delete args[i].value;
@@ -38,11 +142,20 @@ Call::~Call() {
     if (ret) {
         delete ret;
     }
+
+    delete lazy;
+
+    // After the values, as destroying them still touches the arena
+    if (arena) {
+        arena->unref();
+    }
 }
 
 
 String::~String() {
-    delete [] value;
+    if (!arena) {
+        delete [] value;
+    }
 }
 
 
@@ -67,11 +180,28 @@ Blob::~Blob() {
     // effectively means we have to leak them.  A better solution would be to
     // keep a list of bound pointers, and defer the destruction to when the
     // trace in question has been fully processed.
-    if (!bound) {
+    if (chunk) {
+        chunk->unref();
+    } else if (!bound && !arena) {
         delete [] buf;
     }
 }
 
+void Blob::unshare(void) {
+    // Bound blobs are leaked, so they must not keep the whole chunk they
+    // point into alive, nor point into an arena which will be freed.
+    if (chunk || arena) {
+        char *copy = new char[size];
+        memcpy(copy, buf, size);
+        if (chunk) {
+            chunk->unref();
+        }
+        chunk = NULL;
+        arena = NULL;
+        buf = copy;
+    }
+}
+
 StackFrame::~StackFrame() {
     if (module != NULL) {
         delete [] module;
@@ -82,6 +212,9 @@ StackFrame::~StackFrame() {
     if (filename != NULL) {
         delete [] filename;
     }
+    if (build_id != NULL) {
+        delete [] build_id;
+    }
 }
 
 
@@ -153,7 +286,7 @@ void * Repr   ::toPointer(void) const { return machineValue->toPointer(); }
 
 void * Value  ::toPointer(bool bind) { assert(0); return NULL; }
 void * Null   ::toPointer(bool bind) { return NULL; }
-void * Blob   ::toPointer(bool bind) { if (bind) bound = true; return buf; }
+void * Blob   ::toPointer(bool bind) { if (bind) { unshare(); bound = true; } return buf; }
 void * Pointer::toPointer(bool bind) { return (void *)value; }
 void * Repr   ::toPointer(bool bind) { return machineValue->toPointer(bind); }
 
@@ -35,6 +35,7 @@
 #include <stdlib.h>
 
 #include <map>
+#include <string>
 #include <vector>
 
 
@@ -44,6 +45,15 @@ namespace trace {
 typedef unsigned Id;
 
 
+/**
+ * Facts about how a trace was recorded, by name, see trace_format.hpp.
+ */
+typedef std::map<std::string, std::string> Properties;
+
+
+class SharedChunk;
+
+
 struct FunctionSig {
     Id id;
     const char *name;
@@ -86,6 +96,48 @@ struct BitmaskSig {
 };
 
 
+/**
+ * Bump allocator for the values of parsed calls, so that all values of a
+ * call, or of a whole frame of calls, are freed at once.
+ *
+ * Reference counted, as the calls of a frame may share one.
+ */
+class Arena
+{
+public:
+    Arena();
+
+    /**
+     * Memory aligned for any value, which lives as long as the arena.
+     */
+    void *alloc(size_t size);
+
+    void ref(void);
+    void unref(void);
+
+private:
+    ~Arena();
+
+    union Block {
+        Block *next;
+        double align;
+    };
+
+    char *m_ptr;
+    char *m_end;
+    Block *m_blocks;
+    size_t m_blockSize;
+    volatile unsigned m_refCount;
+
+    // Enough for the values of most calls, so that they take no other
+    // allocation
+    union {
+        double align;
+        char data[512];
+    } m_inline;
+};
+
+
 class Visitor;
 
 
@@ -95,6 +147,19 @@ public:
     virtual ~Value() {}
     virtual void visit(Visitor &visitor) = 0;
 
+    /*
+     * Values may be allocated from an arena, in which case deleting them
+     * only destroys them, and their memory is freed with the arena.
+     */
+    static void *operator new(size_t size, Arena *arena);
+    static void *operator new(size_t size) {
+        return operator new(size, (Arena *)NULL);
+    }
+    static void operator delete(void *ptr);
+    static void operator delete(void *ptr, Arena *arena) {
+        operator delete(ptr);
+    }
+
     virtual bool toBool(void) const = 0;
     virtual signed long long toSInt(void) const;
     virtual unsigned long long toUInt(void) const;
@@ -209,7 +274,9 @@ public:
 class String : public Value
 {
 public:
-    String(const char * _value) : value(_value) {}
+    String(const char * _value) : value(_value), arena(NULL) {}
+    // Characters allocated from the arena, rather than owned
+    String(const char * _value, Arena *_arena) : value(_value), arena(_arena) {}
     ~String();
 
     bool toBool(void) const;
@@ -217,6 +284,7 @@ public:
     void visit(Visitor &visitor);
 
     const char * value;
+    Arena *arena;
 };
 
 
@@ -292,6 +360,26 @@ public:
         size = _size;
         buf = new char[_size];
         bound = false;
+        chunk = NULL;
+        arena = NULL;
+    }
+
+    // Points into the decompressed trace, taking over a chunk reference
+    Blob(size_t _size, char *_buf, SharedChunk *_chunk) {
+        size = _size;
+        buf = _buf;
+        bound = false;
+        chunk = _chunk;
+        arena = NULL;
+    }
+
+    // Contents allocated from the arena
+    Blob(size_t _size, Arena *_arena) {
+        size = _size;
+        buf = (char *)_arena->alloc(_size);
+        bound = false;
+        chunk = NULL;
+        arena = _arena;
     }
 
     ~Blob();
@@ -304,6 +392,11 @@ public:
     size_t size;
     char *buf;
     bool bound;
+    SharedChunk *chunk;
+    Arena *arena;
+
+private:
+    void unshare(void);
 };
 
 
@@ -355,12 +448,18 @@ struct RawStackFrame {
     const char * filename;
     int linenumber;
     long long offset;
+    // Address within the module, and its GNU build-id in hex, for frames to
+    // be symbolized later
+    long long address;
+    const char * build_id;
     RawStackFrame() :
         module(0),
         function(0),
         filename(0),
         linenumber(-1),
-        offset(-1)
+        offset(-1),
+        address(-1),
+        build_id(0)
     {
     }
 };
@@ -482,6 +581,21 @@ struct Arg
 };
 
 
+class Call;
+
+
+/**
+ * Decodes the arguments of a call parsed lazily, on their first access
+ * through Call::arg().
+ */
+class LazyArgs
+{
+public:
+    virtual ~LazyArgs() {}
+    virtual Value *decode(Call *call, unsigned index) = 0;
+};
+
+
 class Call
 {
 public:
@@ -494,13 +608,31 @@ public:
     CallFlags flags;
     Backtrace* backtrace;
 
+    // Where the values were allocated from, if they were parsed
+    Arena *arena;
+
+    // Arguments not decoded yet, when parsed lazily, in which case args
+    // must only be accessed through arg(), or after decodeArgs()
+    LazyArgs *lazy;
+
+    // When the call was entered, in nanoseconds since the trace was started,
+    // and how long it took, if recorded while tracing
+    bool timed;
+    unsigned long long enter_time;
+    unsigned long long duration;
+
     Call(const FunctionSig *_sig, const CallFlags &_flags, unsigned _thread_id) :
         thread_id(_thread_id), 
         sig(_sig), 
         args(_sig->num_args), 
         ret(0),
         flags(_flags),
-        backtrace(0) {
+        backtrace(0),
+        arena(0),
+        lazy(0),
+        timed(false),
+        enter_time(0),
+        duration(0) {
     }
 
     ~Call();
@@ -511,8 +643,25 @@ public:
 
     inline Value & arg(unsigned index) {
         assert(index < args.size());
+        if (!args[index].value && lazy) {
+            args[index].value = lazy->decode(this, index);
+        }
         return *(args[index].value);
     }
+
+    /**
+     * Decode all arguments of a call parsed lazily, for code which goes
+     * through args directly.
+     */
+    inline void decodeArgs(void) {
+        if (lazy) {
+            for (unsigned i = 0; i < args.size(); ++i) {
+                if (!args[i].value) {
+                    args[i].value = lazy->decode(this, i);
+                }
+            }
+        }
+    }
 };
 
 
@@ -29,13 +29,20 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "os_thread.hpp"
+#include "trace_backtrace.hpp"
 #include "trace_file.hpp"
 #include "trace_dump.hpp"
+#include "trace_manifest.hpp"
 #include "trace_parser.hpp"
 
 
 #define TRACE_VERBOSE 0
 
+// Arguments of calls parsed lazily which take up to this many bytes are
+// decoded all at once when any is first accessed
+#define LAZY_ARG_BATCH_SIZE 256
+
 
 namespace trace {
 
@@ -45,6 +52,14 @@ Parser::Parser() {
     next_call_no = 0;
     version = 0;
     api = API_UNKNOWN;
+    zeroCopyBlobs = false;
+    master = NULL;
+    numShared = 0;
+    sharedArena = NULL;
+    valueArena = NULL;
+    numBlobs = 0;
+    blobCacheSize = 0;
+    blobsNumbered = true;
 
     glGetErrorSig = NULL;
 }
@@ -52,26 +67,151 @@ Parser::Parser() {
 
 Parser::~Parser() {
     close();
+    setArena(NULL);
+}
+
+
+void Parser::setArena(Arena *arena) {
+    if (arena) {
+        arena->ref();
+    }
+    if (sharedArena) {
+        sharedArena->unref();
+    }
+    sharedArena = arena;
 }
 
 
 bool Parser::open(const char *filename) {
     assert(!file);
+    segments.clear();
+    segment = 0;
+    fileName = filename;
+
+    if (Manifest::isManifest(filename)) {
+        Manifest manifest;
+        if (!manifest.read(filename)) {
+            std::cerr << "error: malformed trace manifest " << filename << "\n";
+            return false;
+        }
+        for (unsigned i = 0; i < manifest.segments.size(); ++i) {
+            segments.push_back(manifest.segments[i].filename);
+        }
+        return open_segment(0);
+    }
+
     file = File::createForRead(filename);
     if (!file) {
         return false;
     }
 
+    return read_header();
+}
+
+
+bool Parser::openShared(const Parser &other) {
+    assert(!file);
+    assert(other.file);
+    if (!other.file->supportsOffsets()) {
+        std::cerr << "error: " << other.fileName << " can't be parsed by many parsers at once\n";
+        return false;
+    }
+
+    segments = other.segments;
+    segment = 0;
+    fileName = other.fileName;
+    if (segments.empty()) {
+        file = File::createForRead(fileName.c_str());
+        if (!file || !read_header()) {
+            return false;
+        }
+    } else if (!open_segment(0)) {
+        return false;
+    }
+    api = other.api;
+
+    // Copies of the tables, so that looking signatures up never resizes the
+    // master's, but pointing to the same immutable signatures
+    master = &other;
+    functions = other.functions;
+    structs = other.structs;
+    enums = other.enums;
+    bitmasks = other.bitmasks;
+    frames = other.frames;
+    stacks = other.stacks;
+    glGetErrorSig = other.glGetErrorSig;
+
+    frameIndex = other.frameIndex;
+    callIndex = other.callIndex;
+    zeroCopyBlobs = other.zeroCopyBlobs;
+
+    os::atomic_fetch_add(&other.numShared, 1U);
+    return true;
+}
+
+
+/**
+ * Read the version and properties at the start of the file.
+ */
+bool Parser::read_header(void) {
     version = read_uint();
     if (version > TRACE_VERSION) {
         std::cerr << "error: unsupported trace format version " << version << "\n";
         return false;
     }
     api = API_UNKNOWN;
+    blobsNumbered = true;
+
+    properties.clear();
+    if (version >= 10) {
+        while (true) {
+            const char *name = read_string();
+            if (!name[0]) {
+                delete [] name;
+                break;
+            }
+            const char *value = read_string();
+            properties[name] = value;
+            delete [] name;
+            delete [] value;
+        }
+    }
 
     return true;
 }
 
+
+/**
+ * Switch to another segment of a rotated trace, past its header.  Calls
+ * pending and signatures carry over, but blobs are only referred to within
+ * the segment they were written in.
+ */
+bool Parser::open_segment(unsigned index) {
+    assert(index < segments.size());
+    File *next = File::createForRead(segments[index].c_str());
+    if (!next) {
+        return false;
+    }
+    if (file) {
+        file->close();
+        delete file;
+    }
+    file = next;
+    segment = index;
+
+    clear_blob_cache();
+    blobOffsets.clear();
+
+    API saved = api;
+    if (!read_header()) {
+        return false;
+    }
+    if (index > 0) {
+        api = saved;
+    }
+    return true;
+}
+
 template <typename Iter>
 inline void
 deleteAll(Iter begin, Iter end)
@@ -90,7 +230,22 @@ deleteAll(Container &c)
     c.clear();
 }
 
+/*
+ * Whether a signature belongs to the master parser rather than to us.
+ */
+template <class T>
+inline bool
+isShared(const std::vector<T *> *masterMap, const std::vector<T *> &map,
+         typename std::vector<T *>::const_iterator it)
+{
+    size_t index = it - map.begin();
+    return masterMap && index < masterMap->size() && (*masterMap)[index] == *it;
+}
+
 void Parser::close(void) {
+    // Parsers sharing our signatures would be left pointing to freed ones
+    assert(numShared == 0);
+
     if (file) {
         file->close();
         delete file;
@@ -104,7 +259,7 @@ void Parser::close(void) {
 
     for (FunctionMap::iterator it = functions.begin(); it != functions.end(); ++it) {
         FunctionSigState *sig = *it;
-        if (sig) {
+        if (sig && !isShared(master ? &master->functions : NULL, functions, it)) {
             delete [] sig->name;
             for (unsigned arg = 0; arg < sig->num_args; ++arg) {
                 delete [] sig->arg_names[arg];
@@ -117,7 +272,7 @@ void Parser::close(void) {
 
     for (StructMap::iterator it = structs.begin(); it != structs.end(); ++it) {
         StructSigState *sig = *it;
-        if (sig) {
+        if (sig && !isShared(master ? &master->structs : NULL, structs, it)) {
             delete [] sig->name;
             for (unsigned member = 0; member < sig->num_members; ++member) {
                 delete [] sig->member_names[member];
@@ -130,7 +285,7 @@ void Parser::close(void) {
 
     for (EnumMap::iterator it = enums.begin(); it != enums.end(); ++it) {
         EnumSigState *sig = *it;
-        if (sig) {
+        if (sig && !isShared(master ? &master->enums : NULL, enums, it)) {
             for (unsigned value = 0; value < sig->num_values; ++value) {
                 delete [] sig->values[value].name;
             }
@@ -142,7 +297,7 @@ void Parser::close(void) {
     
     for (BitmaskMap::iterator it = bitmasks.begin(); it != bitmasks.end(); ++it) {
         BitmaskSigState *sig = *it;
-        if (sig) {
+        if (sig && !isShared(master ? &master->bitmasks : NULL, bitmasks, it)) {
             for (unsigned flag = 0; flag < sig->num_flags; ++flag) {
                 delete [] sig->flags[flag].name;
             }
@@ -152,26 +307,272 @@ void Parser::close(void) {
     }
     bitmasks.clear();
 
+    for (StackMap::iterator it = stacks.begin(); it != stacks.end(); ++it) {
+        if (!isShared(master ? &master->stacks : NULL, stacks, it)) {
+            delete *it;
+        }
+    }
+    stacks.clear();
+    if (master) {
+        os::atomic_fetch_add(&master->numShared, -1U);
+        master = NULL;
+    }
+
+    frameIndex.clear();
+    callIndex.clear();
+
+    clear_blob_cache();
+    blobOffsets.clear();
+
+    segments.clear();
+    segment = 0;
+
     next_call_no = 0;
 }
 
 
 void Parser::getBookmark(ParseBookmark &bookmark) {
-    bookmark.offset = file->currentOffset();
+    bookmark.offset = current_offset();
     bookmark.next_call_no = next_call_no;
 }
 
 
 void Parser::setBookmark(const ParseBookmark &bookmark) {
-    file->setCurrentOffset(bookmark.offset);
+    File::Offset offset = bookmark.offset;
+    unsigned index = offset.chunk >> TRACE_SEGMENT_SHIFT;
+    offset.chunk &= ((uint64_t)1 << TRACE_SEGMENT_SHIFT) - 1;
+    if (index != segment && !open_segment(index)) {
+        std::cerr << "error: failed to open " << segments[index] << "\n";
+        exit(1);
+    }
+    file->setCurrentOffset(offset);
     next_call_no = bookmark.next_call_no;
     
     // Simply ignore all pending calls
     deleteAll(calls);
+
+    // Blobs can't be numbered as the writer did anymore, so references can
+    // only be resolved through their offsets from now on.
+    clear_blob_cache();
+    blobsNumbered = false;
+}
+
+
+static bool
+read_index_uint(const char * &p, const char *end, unsigned long long &value) {
+    value = 0;
+    unsigned shift = 0;
+    unsigned char c;
+    do {
+        if (p == end || shift >= 64) {
+            return false;
+        }
+        c = *p++;
+        value |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
+
+
+static bool
+read_index_bookmark(File *file, const char * &p, const char *end,
+                    ParseBookmark &bookmark, bool withCallNo = true) {
+    unsigned long long chunk, offsetInChunk, call_no = 0;
+    if (!read_index_uint(p, end, chunk) ||
+        !read_index_uint(p, end, offsetInChunk) ||
+        (withCallNo && !read_index_uint(p, end, call_no))) {
+        return false;
+    }
+    bookmark.offset = File::Offset(chunk, offsetInChunk);
+    bookmark.next_call_no = call_no;
+    return file->resolveOffset(bookmark.offset);
+}
+
+
+static inline void
+tag_segment(ParseBookmark &bookmark, unsigned segment) {
+    bookmark.offset.chunk |= (uint64_t)segment << TRACE_SEGMENT_SHIFT;
+}
+
+
+bool Parser::loadIndex(void) {
+    if (segments.empty()) {
+        return load_segment_index();
+    }
+
+    // Load the index of every segment, joining frames split between them
+    unsigned current = segment;
+    File::Offset offset = file->currentOffset();
+    bool ok = true;
+    for (unsigned i = 0; ok && i < segments.size(); ++i) {
+        size_t numFrames = frameIndex.size();
+        ok = (i == segment || open_segment(i)) &&
+             load_segment_index();
+        if (ok && numFrames > 0 &&
+            !frameIndex[numFrames - 1].complete &&
+            frameIndex.size() > numFrames) {
+            FrameIndexEntry &tail = frameIndex[numFrames - 1];
+            FrameIndexEntry &next = frameIndex[numFrames];
+            next.start = tail.start;
+            next.numberOfCalls += tail.numberOfCalls;
+            frameIndex.erase(frameIndex.begin() + (numFrames - 1));
+        }
+    }
+    if (segment != current) {
+        open_segment(current);
+        blobsNumbered = false;
+    }
+    file->setCurrentOffset(offset);
+
+    if (!ok) {
+        frameIndex.clear();
+        callIndex.clear();
+    }
+    return ok;
+}
+
+
+/**
+ * Load the index of the file being read, adding to the one loaded so far.
+ */
+bool Parser::load_segment_index(void) {
+    std::string index;
+    if (!file->readIndex(index)) {
+        return false;
+    }
+
+    const char *p = index.data();
+    const char *end = p + index.size();
+    unsigned long long indexVersion;
+    if (!read_index_uint(p, end, indexVersion) ||
+        indexVersion != TRACE_INDEX_VERSION) {
+        return false;
+    }
+
+    File::Offset current = file->currentOffset();
+
+    bool ok = true;
+    bool done = false;
+    while (ok && !done) {
+        unsigned long long entry;
+        ParseBookmark bookmark;
+        unsigned long long numberOfCalls, lastCallNo;
+        if (!read_index_uint(p, end, entry)) {
+            ok = false;
+            break;
+        }
+        switch (entry) {
+        case trace::INDEX_END:
+            done = true;
+            break;
+        case trace::INDEX_FUNCTION_SIG:
+        case trace::INDEX_STRUCT_SIG:
+        case trace::INDEX_ENUM_SIG:
+        case trace::INDEX_BITMASK_SIG:
+        case trace::INDEX_STACK_FRAME:
+        case trace::INDEX_STACK:
+            // Parse the signature definition where it was written, so that
+            // it is recognized and skipped when parsing over it later.
+            ok = read_index_bookmark(file, p, end, bookmark, false);
+            if (!ok) {
+                break;
+            }
+            file->setCurrentOffset(bookmark.offset);
+            switch (entry) {
+            case trace::INDEX_FUNCTION_SIG:
+                parse_function_sig();
+                break;
+            case trace::INDEX_STRUCT_SIG:
+                parse_struct_sig();
+                break;
+            case trace::INDEX_ENUM_SIG:
+                if (version >= 3) {
+                    parse_enum_sig();
+                } else {
+                    parse_old_enum_sig();
+                }
+                break;
+            case trace::INDEX_BITMASK_SIG:
+                parse_bitmask_sig();
+                break;
+            case trace::INDEX_STACK_FRAME:
+                parse_backtrace_frame(SCAN);
+                break;
+            case trace::INDEX_STACK:
+                parse_stack(SCAN);
+                break;
+            }
+            break;
+        case trace::INDEX_CALL:
+            ok = read_index_bookmark(file, p, end, bookmark);
+            if (ok) {
+                tag_segment(bookmark, segment);
+                callIndex.push_back(bookmark);
+            }
+            break;
+        case trace::INDEX_FRAME:
+        case trace::INDEX_TAIL:
+            ok = read_index_bookmark(file, p, end, bookmark) &&
+                 read_index_uint(p, end, numberOfCalls);
+            lastCallNo = 0;
+            if (ok && entry == trace::INDEX_FRAME) {
+                ok = read_index_uint(p, end, lastCallNo);
+            }
+            if (ok) {
+                tag_segment(bookmark, segment);
+                FrameIndexEntry frame;
+                frame.start = bookmark;
+                frame.numberOfCalls = numberOfCalls;
+                frame.lastCallNo = lastCallNo;
+                frame.complete = entry == trace::INDEX_FRAME;
+                frameIndex.push_back(frame);
+            }
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    file->setCurrentOffset(current);
+
+    if (!ok) {
+        std::cerr << "warning: ignoring malformed trace index\n";
+        frameIndex.clear();
+        callIndex.clear();
+    }
+    return ok;
+}
+
+
+bool Parser::findCallBookmark(unsigned call_no, ParseBookmark &bookmark) const {
+    // Find the last call entered at or before the given one
+    std::vector<ParseBookmark>::const_iterator lo = callIndex.begin();
+    std::vector<ParseBookmark>::const_iterator hi = callIndex.end();
+    while (lo != hi) {
+        std::vector<ParseBookmark>::const_iterator mid = lo + (hi - lo) / 2;
+        if (mid->next_call_no <= call_no) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == callIndex.begin()) {
+        return false;
+    }
+    bookmark = *(lo - 1);
+    return true;
 }
 
 
 Call *Parser::parse_call(Mode mode) {
+    if (mode == LAZY &&
+        (!file->supportsOffsets() || segments.size() > 1)) {
+        // No going back to the arguments
+        mode = FULL;
+    }
+
     do {
         Call *call;
         int c = read_byte();
@@ -192,10 +593,22 @@ Call *Parser::parse_call(Mode mode) {
                 return call;
             }
             break;
+        case trace::EVENT_DEFINE:
+#if TRACE_VERBOSE
+            std::cerr << "\tDEFINE\n";
+#endif
+            parse_define(mode);
+            break;
         default:
             std::cerr << "error: unknown event " << c << "\n";
             exit(1);
         case -1:
+            if (segment + 1 < segments.size()) {
+                if (open_segment(segment + 1)) {
+                    break;
+                }
+                std::cerr << "error: failed to open " << segments[segment + 1] << "\n";
+            }
             if (!calls.empty()) {
                 call = calls.front();
                 call->flags |= CALL_FLAG_INCOMPLETE;
@@ -209,6 +622,51 @@ Call *Parser::parse_call(Mode mode) {
 }
 
 
+bool Parser::parse_event(ParseHandler &handler) {
+    do {
+        int c = read_byte();
+        switch (c) {
+        case trace::EVENT_ENTER:
+            {
+                unsigned thread_id = version >= 4 ? read_uint() : 0;
+                FunctionSigFlags *sig = parse_function_sig();
+                handler.onEnter(sig, sig->flags, thread_id, next_call_no++);
+            }
+            if (version >= 13) {
+                skip_uint(); // length
+            }
+            if (parse_event_details(handler)) {
+                handler.onEnd();
+            }
+            return true;
+        case trace::EVENT_LEAVE:
+            handler.onLeave(read_uint());
+            if (version >= 13) {
+                skip_uint(); // length
+            }
+            if (parse_event_details(handler)) {
+                handler.onEnd();
+            }
+            return true;
+        case trace::EVENT_DEFINE:
+            parse_define(SCAN);
+            break;
+        default:
+            std::cerr << "error: unknown event " << c << "\n";
+            exit(1);
+        case -1:
+            if (segment + 1 < segments.size()) {
+                if (open_segment(segment + 1)) {
+                    break;
+                }
+                std::cerr << "error: failed to open " << segments[segment + 1] << "\n";
+            }
+            return false;
+        }
+    } while(true);
+}
+
+
 /**
  * Helper function to lookup an ID in a vector, resizing the vector if it doesn't fit.
  */
@@ -224,7 +682,7 @@ T *lookup(std::vector<T *> &map, size_t index) {
 
 
 Parser::FunctionSigFlags *
-Parser::parse_function_sig(void) {
+Parser::parse_function_sig(bool defining) {
     size_t id = read_uint();
 
     FunctionSigState *sig = lookup(functions, id);
@@ -241,7 +699,7 @@ Parser::parse_function_sig(void) {
         }
         sig->arg_names = arg_names;
         sig->flags = lookupCallFlags(sig->name);
-        sig->fileOffset = file->currentOffset();
+        sig->fileOffset = current_offset();
         functions[id] = sig;
 
         /**
@@ -279,7 +737,7 @@ Parser::parse_function_sig(void) {
             glGetErrorSig = sig;
         }
 
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (defining || current_offset() < sig->fileOffset) {
         /* skip over the signature */
         skip_string(); /* name */
         unsigned num_args = read_uint();
@@ -293,7 +751,7 @@ Parser::parse_function_sig(void) {
 }
 
 
-StructSig *Parser::parse_struct_sig() {
+StructSig *Parser::parse_struct_sig(bool defining) {
     size_t id = read_uint();
 
     StructSigState *sig = lookup(structs, id);
@@ -309,9 +767,9 @@ StructSig *Parser::parse_struct_sig() {
             member_names[i] = read_string();
         }
         sig->member_names = member_names;
-        sig->fileOffset = file->currentOffset();
+        sig->fileOffset = current_offset();
         structs[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (defining || current_offset() < sig->fileOffset) {
         /* skip over the signature */
         skip_string(); /* name */
         unsigned num_members = read_uint();
@@ -345,9 +803,9 @@ EnumSig *Parser::parse_old_enum_sig() {
         values->name = read_string();
         values->value = read_sint();
         sig->values = values;
-        sig->fileOffset = file->currentOffset();
+        sig->fileOffset = current_offset();
         enums[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (current_offset() < sig->fileOffset) {
         /* skip over the signature */
         skip_string(); /*name*/
         scan_value();
@@ -358,7 +816,7 @@ EnumSig *Parser::parse_old_enum_sig() {
 }
 
 
-EnumSig *Parser::parse_enum_sig() {
+EnumSig *Parser::parse_enum_sig(bool defining) {
     size_t id = read_uint();
 
     EnumSigState *sig = lookup(enums, id);
@@ -374,9 +832,9 @@ EnumSig *Parser::parse_enum_sig() {
             it->value = read_sint();
         }
         sig->values = values;
-        sig->fileOffset = file->currentOffset();
+        sig->fileOffset = current_offset();
         enums[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (defining || current_offset() < sig->fileOffset) {
         /* skip over the signature */
         int num_values = read_uint();
         for (int i = 0; i < num_values; ++i) {
@@ -390,7 +848,7 @@ EnumSig *Parser::parse_enum_sig() {
 }
 
 
-BitmaskSig *Parser::parse_bitmask_sig() {
+BitmaskSig *Parser::parse_bitmask_sig(bool defining) {
     size_t id = read_uint();
 
     BitmaskSigState *sig = lookup(bitmasks, id);
@@ -409,9 +867,9 @@ BitmaskSig *Parser::parse_bitmask_sig() {
             }
         }
         sig->flags = flags;
-        sig->fileOffset = file->currentOffset();
+        sig->fileOffset = current_offset();
         bitmasks[id] = sig;
-    } else if (file->currentOffset() < sig->fileOffset) {
+    } else if (defining || current_offset() < sig->fileOffset) {
         /* skip over the signature */
         int num_flags = read_uint();
         for (int i = 0; i < num_flags; ++i) {
@@ -440,7 +898,7 @@ void Parser::parse_enter(Mode mode) {
 
     call->no = next_call_no++;
 
-    if (parse_call_details(call, mode)) {
+    if (skip_call_details(call, mode)) {
         calls.push_back(call);
     } else {
         delete call;
@@ -465,12 +923,12 @@ Call *Parser::parse_leave(Mode mode) {
          */
         const FunctionSig sig = {0, NULL, 0, NULL};
         call = new Call(&sig, 0, 0);
-        parse_call_details(call, SCAN);
+        skip_call_details(call, SKIP);
         delete call;
         return NULL;
     }
 
-    if (parse_call_details(call, mode)) {
+    if (skip_call_details(call, mode)) {
         return call;
     } else {
         delete call;
@@ -479,6 +937,72 @@ Call *Parser::parse_leave(Mode mode) {
 }
 
 
+void Parser::parse_define(Mode mode) {
+    do {
+        int c = read_byte();
+        switch (c) {
+        case trace::DEFINE_END:
+            return;
+        // Definitions always come in full, even if known already
+        case trace::DEFINE_FUNCTION:
+            parse_function_sig(true);
+            break;
+        case trace::DEFINE_STRUCT:
+            parse_struct_sig(true);
+            break;
+        case trace::DEFINE_ENUM:
+            parse_enum_sig(true);
+            break;
+        case trace::DEFINE_BITMASK:
+            parse_bitmask_sig(true);
+            break;
+        case trace::DEFINE_STACK:
+            parse_stack(mode, true);
+            break;
+        case trace::DEFINE_FRAME:
+            parse_backtrace_frame(mode, true);
+            break;
+        case trace::DEFINE_CALL_NO:
+            next_call_no = read_uint();
+            break;
+        default:
+            std::cerr << "error: unknown definition " << c << "\n";
+            exit(1);
+        case -1:
+            return;
+        }
+    } while(true);
+}
+
+
+/**
+ * Parse the call details of an event, or skip them if asked to and their
+ * length is known.
+ */
+bool Parser::skip_call_details(Call *call, Mode mode) {
+    if (version < 13) {
+        return parse_call_details(call, mode);
+    }
+
+    size_t length = read_uint();
+    if (mode != SKIP || length == 0) {
+        return parse_call_details(call, mode);
+    }
+
+    // The details end with CALL_END, which is worth checking for
+    file->skip(length - 1);
+    int c = read_byte();
+    if (c == trace::CALL_END) {
+        return true;
+    }
+    if (c != -1) {
+        std::cerr << "error: bad length for call " << call->no << "\n";
+        exit(1);
+    }
+    return false;
+}
+
+
 bool Parser::parse_call_details(Call *call, Mode mode) {
     do {
         int c = read_byte();
@@ -498,7 +1022,12 @@ bool Parser::parse_call_details(Call *call, Mode mode) {
 #if TRACE_VERBOSE
             std::cerr << "\tCALL_RET\n";
 #endif
-            call->ret = parse_value(mode);
+            {
+                // Return values are small, and often looked at
+                Mode retMode = mode == LAZY ? FULL : mode;
+                use_call_arena(call, retMode);
+                call->ret = parse_value(retMode);
+            }
             break;
         case trace::CALL_BACKTRACE:
 #if TRACE_VERBOSE
@@ -506,6 +1035,24 @@ bool Parser::parse_call_details(Call *call, Mode mode) {
 #endif
             parse_call_backtrace(call, mode);
             break;
+        case trace::CALL_STACK:
+#if TRACE_VERBOSE
+            std::cerr << "\tCALL_STACK\n";
+#endif
+            call->backtrace = new Backtrace(*parse_stack(mode));
+            break;
+        case trace::CALL_TIME:
+#if TRACE_VERBOSE
+            std::cerr << "\tCALL_TIME\n";
+#endif
+            // The enter event's time comes first
+            if (call->timed) {
+                call->duration = read_uint();
+            } else {
+                call->enter_time = read_uint();
+                call->timed = true;
+            }
+            break;
         default:
             std::cerr << "error: ("<<call->name()<< ") unknown call detail "
                       << c << "\n";
@@ -516,6 +1063,45 @@ bool Parser::parse_call_details(Call *call, Mode mode) {
     } while(true);
 }
 
+bool Parser::parse_event_details(ParseHandler &handler) {
+    do {
+        int c = read_byte();
+        switch (c) {
+        case trace::CALL_END:
+            return true;
+        case trace::CALL_ARG:
+            handler.onArg(read_uint());
+            parse_event_value(handler);
+            break;
+        case trace::CALL_RET:
+            handler.onRet();
+            parse_event_value(handler);
+            break;
+        case trace::CALL_BACKTRACE:
+            {
+                unsigned num_frames = read_uint();
+                eventBacktrace.resize(num_frames);
+                for (unsigned i = 0; i < num_frames; ++i) {
+                    eventBacktrace[i] = parse_backtrace_frame(SCAN);
+                }
+                handler.onBacktrace(eventBacktrace);
+            }
+            break;
+        case trace::CALL_STACK:
+            handler.onBacktrace(*parse_stack(SCAN));
+            break;
+        case trace::CALL_TIME:
+            handler.onTime(read_uint());
+            break;
+        default:
+            std::cerr << "error: unknown call detail " << c << "\n";
+            exit(1);
+        case -1:
+            return false;
+        }
+    } while(true);
+}
+
 bool Parser::parse_call_backtrace(Call *call, Mode mode) {
     unsigned num_frames = read_uint();
     Backtrace* backtrace = new Backtrace(num_frames);
@@ -526,7 +1112,31 @@ bool Parser::parse_call_backtrace(Call *call, Mode mode) {
     return true;
 }
 
-StackFrame * Parser::parse_backtrace_frame(Mode mode) {
+const Backtrace * Parser::parse_stack(Mode mode, bool defining) {
+    size_t id = read_uint();
+
+    StackState *stack = lookup(stacks, id);
+
+    if (!stack) {
+        stack = new StackState;
+        unsigned num_frames = read_uint();
+        stack->resize(num_frames);
+        for (unsigned i = 0; i < num_frames; ++i) {
+            (*stack)[i] = parse_backtrace_frame(mode);
+        }
+        stack->fileOffset = current_offset();
+        stacks[id] = stack;
+    } else if (defining || current_offset() < stack->fileOffset) {
+        unsigned num_frames = read_uint();
+        for (unsigned i = 0; i < num_frames; ++i) {
+            parse_backtrace_frame(mode);
+        }
+    }
+
+    return stack;
+}
+
+StackFrame * Parser::parse_backtrace_frame(Mode mode, bool defining) {
     size_t id = read_uint();
 
     StackFrameState *frame = lookup(frames, id);
@@ -552,6 +1162,12 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
             case trace::BACKTRACE_OFFSET:
                 frame->offset = read_uint();
                 break;
+            case trace::BACKTRACE_ADDRESS:
+                frame->address = read_uint();
+                break;
+            case trace::BACKTRACE_BUILD_ID:
+                frame->build_id = read_string();
+                break;
             default:
                 std::cerr << "error: unknown backtrace detail "
                           << c << "\n";
@@ -560,9 +1176,13 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
             c = read_byte();
         }
 
-        frame->fileOffset = file->currentOffset();
+        if (frame->address >= 0 && frame->function == NULL) {
+            symbolize_stack_frame(frame);
+        }
+
+        frame->fileOffset = current_offset();
         frames[id] = frame;
-    } else if (file->currentOffset() < frame->fileOffset) {
+    } else if (defining || current_offset() < frame->fileOffset) {
         int c = read_byte();
         while (c != trace::BACKTRACE_END &&
                c != -1) {
@@ -582,6 +1202,12 @@ StackFrame * Parser::parse_backtrace_frame(Mode mode) {
             case trace::BACKTRACE_OFFSET:
                 scan_uint();
                 break;
+            case trace::BACKTRACE_ADDRESS:
+                scan_uint();
+                break;
+            case trace::BACKTRACE_BUILD_ID:
+                scan_string();
+                break;
             default:
                 std::cerr << "error: unknown backtrace detail "
                           << c << "\n";
@@ -609,8 +1235,30 @@ void Parser::adjust_call_flags(Call *call) {
     }
 }
 
+/**
+ * Allocate the call's values from the shared arena if there's one, or else
+ * from one of its own.
+ */
+void Parser::use_call_arena(Call *call, Mode mode) {
+    if (mode == FULL && !call->arena) {
+        if (sharedArena) {
+            sharedArena->ref();
+            call->arena = sharedArena;
+        } else {
+            call->arena = new Arena;
+        }
+    }
+    valueArena = call->arena;
+}
+
+
 void Parser::parse_arg(Call *call, Mode mode) {
     unsigned index = read_uint();
+    if (mode == LAZY) {
+        parse_lazy_arg(call, index);
+        return;
+    }
+    use_call_arena(call, mode);
     Value *value = parse_value(mode);
     if (value) {
         if (index >= call->args.size()) {
@@ -621,19 +1269,91 @@ void Parser::parse_arg(Call *call, Mode mode) {
 }
 
 
+/**
+ * Note down where the argument is, and skip it.
+ */
+void Parser::parse_lazy_arg(Call *call, unsigned index) {
+    LazyCallArgs *lazy = static_cast<LazyCallArgs *>(call->lazy);
+    if (!lazy) {
+        lazy = new LazyCallArgs(this);
+        lazy->args.reserve(call->args.size());
+        call->lazy = lazy;
+    }
+    if (index >= call->args.size()) {
+        call->args.resize(index + 1);
+    }
+    if (index >= lazy->args.size()) {
+        LazyCallArgs::Arg absent;
+        absent.present = false;
+        lazy->args.resize(index + 1, absent);
+    }
+    LazyCallArgs::Arg &arg = lazy->args[index];
+    if (!arg.present) {
+        lazy->order.push_back(index);
+    }
+    arg.offset = file->currentOffset();
+    arg.present = true;
+    int type = read_byte();
+    scan_value(type);
+    File::Offset end = file->currentOffset();
+    // Blob references are short, but resolved by going back to the blob
+    arg.small = type != trace::TYPE_BLOB_REF &&
+                end.chunk == arg.offset.chunk &&
+                end.offsetInChunk - arg.offset.offsetInChunk <= LAZY_ARG_BATCH_SIZE;
+}
+
+
+Value *Parser::LazyCallArgs::decode(Call *call, unsigned index) {
+    if (index >= args.size() || !args[index].present) {
+        return NULL;
+    }
+    parser->decode_lazy_args(call, *this, index);
+    return call->args[index].value;
+}
+
+
+/**
+ * Go back to decode the given argument, along with all the small ones not
+ * decoded yet, in the order they are in the file, and return to where
+ * parsing was.  They usually share a chunk, so that only going there and
+ * back may decompress anything.
+ */
+void Parser::decode_lazy_args(Call *call, LazyCallArgs &lazy, unsigned index) {
+    File::Offset saved = file->currentOffset();
+
+    // Blobs were already numbered while scanning, so references are
+    // resolved through the offsets noted down then
+    bool numbered = blobsNumbered;
+    blobsNumbered = false;
+
+    use_call_arena(call, FULL);
+    for (size_t i = 0; i < lazy.order.size(); ++i) {
+        LazyCallArgs::Arg &arg = lazy.args[lazy.order[i]];
+        if (arg.present && (arg.small || lazy.order[i] == index)) {
+            file->setCurrentOffset(arg.offset);
+            call->args[lazy.order[i]].value = parse_value();
+            arg.present = false;
+        }
+    }
+
+    blobsNumbered = numbered;
+    file->setCurrentOffset(saved);
+}
+
+
 Value *Parser::parse_value(void) {
     int c;
     Value *value;
     c = read_byte();
     switch (c) {
     case trace::TYPE_NULL:
-        value = new Null;
+        value = new (valueArena) Null;
         break;
     case trace::TYPE_FALSE:
-        value = new Bool(false);
+        value = new (valueArena) Bool(false);
         break;
     case trace::TYPE_TRUE:
-        value = new Bool(true);
+        value = new (valueArena) Bool(true);
         break;
     case trace::TYPE_SINT:
         value = parse_sint();
@@ -671,6 +1391,9 @@ Value *Parser::parse_value(void) {
     case trace::TYPE_REPR:
         value = parse_repr();
         break;
+    case trace::TYPE_BLOB_REF:
+        value = parse_blob_ref();
+        break;
     default:
         std::cerr << "error: unknown type " << c << "\n";
         exit(1);
@@ -690,7 +1413,11 @@ Value *Parser::parse_value(void) {
 
 
 void Parser::scan_value(void) {
-    int c = read_byte();
+    scan_value(read_byte());
+}
+
+
+void Parser::scan_value(int c) {
     switch (c) {
     case trace::TYPE_NULL:
     case trace::TYPE_FALSE:
@@ -732,6 +1459,107 @@ void Parser::scan_value(void) {
     case trace::TYPE_REPR:
         scan_repr();
         break;
+    case trace::TYPE_BLOB_REF:
+        scan_blob_ref();
+        break;
+    default:
+        std::cerr << "error: unknown type " << c << "\n";
+        exit(1);
+    case -1:
+        break;
+    }
+}
+
+
+void Parser::parse_event_value(ParseHandler &handler) {
+    int c = read_byte();
+    switch (c) {
+    case trace::TYPE_NULL:
+        handler.onNull();
+        break;
+    case trace::TYPE_FALSE:
+        handler.onBool(false);
+        break;
+    case trace::TYPE_TRUE:
+        handler.onBool(true);
+        break;
+    case trace::TYPE_SINT:
+        handler.onSInt(-(signed long long)read_uint());
+        break;
+    case trace::TYPE_UINT:
+        handler.onUInt(read_uint());
+        break;
+    case trace::TYPE_FLOAT:
+        {
+            float value;
+            file->read(&value, sizeof value);
+            handler.onFloat(value);
+        }
+        break;
+    case trace::TYPE_DOUBLE:
+        {
+            double value;
+            file->read(&value, sizeof value);
+            handler.onDouble(value);
+        }
+        break;
+    case trace::TYPE_STRING:
+        {
+            size_t len = read_uint();
+            handler.onString(read_event_data(len), len);
+        }
+        break;
+    case trace::TYPE_ENUM:
+        if (version >= 3) {
+            EnumSig *sig = parse_enum_sig();
+            handler.onEnum(sig, read_sint());
+        } else {
+            EnumSig *sig = parse_old_enum_sig();
+            assert(sig->num_values == 1);
+            handler.onEnum(sig, sig->values->value);
+        }
+        break;
+    case trace::TYPE_BITMASK:
+        {
+            BitmaskSig *sig = parse_bitmask_sig();
+            handler.onBitmask(sig, read_uint());
+        }
+        break;
+    case trace::TYPE_ARRAY:
+        {
+            size_t len = read_uint();
+            handler.beginArray(len);
+            for (size_t i = 0; i < len; ++i) {
+                parse_event_value(handler);
+            }
+            handler.endArray();
+        }
+        break;
+    case trace::TYPE_STRUCT:
+        {
+            StructSig *sig = parse_struct_sig();
+            handler.beginStruct(sig);
+            for (size_t i = 0; i < sig->num_members; ++i) {
+                parse_event_value(handler);
+            }
+            handler.endStruct();
+        }
+        break;
+    case trace::TYPE_BLOB:
+        parse_event_blob(handler);
+        break;
+    case trace::TYPE_OPAQUE:
+        handler.onPointer(read_uint());
+        break;
+    case trace::TYPE_REPR:
+        handler.beginRepr();
+        parse_event_value(handler);
+        parse_event_value(handler);
+        handler.endRepr();
+        break;
+    case trace::TYPE_BLOB_REF:
+        parse_event_blob_ref(handler);
+        break;
     default:
         std::cerr << "error: unknown type " << c << "\n";
         exit(1);
@@ -742,7 +1570,7 @@ void Parser::scan_value(void) {
 
 
 Value *Parser::parse_sint() {
-    return new SInt(-(signed long long)read_uint());
+    return new (valueArena) SInt(-(signed long long)read_uint());
 }
 
 
@@ -752,7 +1580,7 @@ void Parser::scan_sint() {
 
 
 Value *Parser::parse_uint() {
-    return new UInt(read_uint());
+    return new (valueArena) UInt(read_uint());
 }
 
 
@@ -764,7 +1592,7 @@ void Parser::scan_uint() {
 Value *Parser::parse_float() {
     float value;
     file->read(&value, sizeof value);
-    return new Float(value);
+    return new (valueArena) Float(value);
 }
 
 
@@ -776,7 +1604,7 @@ void Parser::scan_float() {
 Value *Parser::parse_double() {
     double value;
     file->read(&value, sizeof value);
-    return new Double(value);
+    return new (valueArena) Double(value);
 }
 
 
@@ -786,7 +1614,16 @@ void Parser::scan_double() {
 
 
 Value *Parser::parse_string() {
-    return new String(read_string());
+    if (!valueArena) {
+        return new String(read_string());
+    }
+    size_t len = read_uint();
+    char *value = (char *)valueArena->alloc(len + 1);
+    if (len) {
+        file->read(value, len);
+    }
+    value[len] = 0;
+    return new (valueArena) String(value, valueArena);
 }
 
 
@@ -806,7 +1643,7 @@ Value *Parser::parse_enum() {
         assert(sig->num_values == 1);
         value = sig->values->value;
     }
-    return new Enum(sig, value);
+    return new (valueArena) Enum(sig, value);
 }
 
 
@@ -825,7 +1662,7 @@ Value *Parser::parse_bitmask() {
 
     unsigned long long value = read_uint();
 
-    return new Bitmask(sig, value);
+    return new (valueArena) Bitmask(sig, value);
 }
 
 
@@ -837,7 +1674,7 @@ void Parser::scan_bitmask() {
 
 Value *Parser::parse_array(void) {
     size_t len = read_uint();
-    Array *array = new Array(len);
+    Array *array = new (valueArena) Array(len);
     for (size_t i = 0; i < len; ++i) {
         array->values[i] = parse_value();
     }
@@ -853,27 +1690,262 @@ void Parser::scan_array(void) {
 }
 
 
+/**
+ * Number a blob as the writer did, returning its cache entry if it may be
+ * referred to later.
+ */
+Parser::BlobCacheEntry *
+Parser::add_cached_blob(size_t size, const File::Offset &offset) {
+    if (version < 6 ||
+        !blobsNumbered ||
+        size < BLOB_DEDUP_MIN_SIZE ||
+        size > BLOB_DEDUP_MAX_SIZE) {
+        return NULL;
+    }
+
+    BlobCacheEntry entry;
+    entry.id = numBlobs++;
+    entry.size = size;
+    entry.data = NULL;
+    entry.offset = offset;
+    BlobCache::iterator it = blobCache.insert(blobCache.end(), entry);
+    blobCacheMap[entry.id] = it;
+    blobCacheSize += size;
+
+    while (blobCache.size() > BLOB_DEDUP_ENTRIES ||
+           blobCacheSize > BLOB_DEDUP_WINDOW) {
+        BlobCacheEntry &front = blobCache.front();
+        blobCacheMap.erase(front.id);
+        blobCacheSize -= front.size;
+        delete [] front.data;
+        blobCache.pop_front();
+    }
+
+    return &*it;
+}
+
+
+/**
+ * Look up the blob a reference refers to, marking it as recently used.
+ */
+Parser::BlobCacheEntry *
+Parser::touch_cached_blob(unsigned long long distance) {
+    if (!blobsNumbered || distance == 0 || distance > numBlobs) {
+        return NULL;
+    }
+    std::map<unsigned long long, BlobCache::iterator>::iterator it;
+    it = blobCacheMap.find(numBlobs - distance);
+    if (it == blobCacheMap.end()) {
+        return NULL;
+    }
+    blobCache.splice(blobCache.end(), blobCache, it->second);
+    return &*it->second;
+}
+
+
+void Parser::clear_blob_cache(void) {
+    for (BlobCache::iterator it = blobCache.begin(); it != blobCache.end(); ++it) {
+        delete [] it->data;
+    }
+    blobCache.clear();
+    blobCacheMap.clear();
+    numBlobs = 0;
+    blobCacheSize = 0;
+}
+
+
+Blob *Parser::new_blob(size_t size) {
+    if (valueArena) {
+        return new (valueArena) Blob(size, valueArena);
+    }
+    return new Blob(size);
+}
+
+
 Value *Parser::parse_blob(void) {
+    File::Offset offset;
+    bool offsets = file->supportsOffsets();
+    if (version >= 6 && offsets) {
+        offset = file->currentOffset();
+    }
     size_t size = read_uint();
-    Blob *blob = new Blob(size);
-    if (size) {
-        file->read(blob->buf, size);
+    BlobCacheEntry *entry = add_cached_blob(size, offset);
+    Blob *blob = NULL;
+    if (zeroCopyBlobs && size) {
+        SharedChunk *chunk;
+        char *buf = file->readShared(size, chunk);
+        if (buf) {
+            blob = new (valueArena) Blob(size, buf, chunk);
+        }
+    }
+    if (!blob) {
+        blob = new_blob(size);
+        if (size) {
+            file->read(blob->buf, size);
+        }
+    }
+    if (entry && !offsets) {
+        // No going back for it later
+        entry->data = new char[size];
+        memcpy(entry->data, blob->buf, size);
     }
     return blob;
 }
 
 
 void Parser::scan_blob(void) {
+    File::Offset offset;
+    bool offsets = file->supportsOffsets();
+    if (version >= 6 && offsets) {
+        offset = file->currentOffset();
+    }
     size_t size = read_uint();
-    if (size) {
+    BlobCacheEntry *entry = add_cached_blob(size, offset);
+    if (entry && !offsets) {
+        // No going back for it later
+        entry->data = new char[size];
+        file->read(entry->data, size);
+    } else if (size) {
         file->skip(size);
     }
 }
 
 
+Value *Parser::parse_blob_ref(void) {
+    unsigned long long distance = read_uint();
+    BlobOffsetKey key;
+    key.first = read_uint();
+    key.second = read_uint();
+
+    BlobCacheEntry *entry = touch_cached_blob(distance);
+    if (entry && entry->data) {
+        Blob *blob = new_blob(entry->size);
+        memcpy(blob->buf, entry->data, entry->size);
+        return blob;
+    }
+
+    File::Offset offset;
+    bool found = false;
+    if (entry) {
+        offset = entry->offset;
+        blobOffsets[key] = offset;
+        found = file->supportsOffsets();
+    } else {
+        std::map<BlobOffsetKey, File::Offset>::iterator it = blobOffsets.find(key);
+        if (it != blobOffsets.end()) {
+            offset = it->second;
+            found = true;
+        } else {
+            offset = File::Offset(key.first, key.second);
+            found = file->resolveOffset(offset);
+        }
+    }
+    if (!found) {
+        std::cerr << "warning: unresolved blob reference\n";
+        return new_blob(0);
+    }
+
+    File::Offset saved = file->currentOffset();
+    file->setCurrentOffset(offset);
+    size_t size = read_uint();
+    Blob *blob = new_blob(size);
+    if (size) {
+        file->read(blob->buf, size);
+    }
+    file->setCurrentOffset(saved);
+
+    if (entry) {
+        // Blobs referred to once tend to be again, so spare seeking back
+        entry->data = new char[size];
+        memcpy(entry->data, blob->buf, size);
+    }
+    return blob;
+}
+
+
+void Parser::scan_blob_ref(void) {
+    unsigned long long distance = read_uint();
+    BlobOffsetKey key;
+    key.first = read_uint();
+    key.second = read_uint();
+
+    BlobCacheEntry *entry = touch_cached_blob(distance);
+    if (entry && file->supportsOffsets()) {
+        blobOffsets[key] = entry->offset;
+    }
+}
+
+
+void Parser::parse_event_blob(ParseHandler &handler) {
+    File::Offset offset;
+    bool offsets = file->supportsOffsets();
+    if (version >= 6 && offsets) {
+        offset = file->currentOffset();
+    }
+    size_t size = read_uint();
+    BlobCacheEntry *entry = add_cached_blob(size, offset);
+    const char *data = read_event_data(size);
+    if (entry && !offsets) {
+        // No going back for it later
+        entry->data = new char[size];
+        memcpy(entry->data, data, size);
+    }
+    handler.onBlob(data, size);
+}
+
+
+void Parser::parse_event_blob_ref(ParseHandler &handler) {
+    unsigned long long distance = read_uint();
+    BlobOffsetKey key;
+    key.first = read_uint();
+    key.second = read_uint();
+
+    BlobCacheEntry *entry = touch_cached_blob(distance);
+    if (entry && entry->data) {
+        handler.onBlob(entry->data, entry->size);
+        return;
+    }
+
+    File::Offset offset;
+    bool found = false;
+    if (entry) {
+        offset = entry->offset;
+        blobOffsets[key] = offset;
+        found = file->supportsOffsets();
+    } else {
+        std::map<BlobOffsetKey, File::Offset>::iterator it = blobOffsets.find(key);
+        if (it != blobOffsets.end()) {
+            offset = it->second;
+            found = true;
+        } else {
+            offset = File::Offset(key.first, key.second);
+            found = file->resolveOffset(offset);
+        }
+    }
+    if (!found) {
+        std::cerr << "warning: unresolved blob reference\n";
+        handler.onBlob(NULL, 0);
+        return;
+    }
+
+    File::Offset saved = file->currentOffset();
+    file->setCurrentOffset(offset);
+    size_t size = read_uint();
+    const char *data = read_event_data(size);
+    if (entry) {
+        // Blobs referred to once tend to be again, so spare seeking back
+        entry->data = new char[size];
+        memcpy(entry->data, data, size);
+    }
+    // Before going back, as that may well invalidate the data
+    handler.onBlob(data, size);
+    file->setCurrentOffset(saved);
+}
+
+
 Value *Parser::parse_struct() {
     StructSig *sig = parse_struct_sig();
-    Struct *value = new Struct(sig);
+    Struct *value = new (valueArena) Struct(sig);
 
     for (size_t i = 0; i < sig->num_members; ++i) {
         value->members[i] = parse_value();
@@ -894,7 +1966,7 @@ void Parser::scan_struct() {
 Value *Parser::parse_opaque() {
     unsigned long long addr;
     addr = read_uint();
-    return new Pointer(addr);
+    return new (valueArena) Pointer(addr);
 }
 
 
@@ -906,7 +1978,7 @@ void Parser::scan_opaque() {
 Value *Parser::parse_repr() {
     Value *humanValue = parse_value();
     Value *machineValue = parse_value();
-    return new Repr(humanValue, machineValue);
+    return new (valueArena) Repr(humanValue, machineValue);
 }
 
 
@@ -930,6 +2002,26 @@ const char * Parser::read_string(void) {
 }
 
 
+/**
+ * Read data for parse_event() to pass on, in place if possible.
+ */
+const char * Parser::read_event_data(size_t length) {
+    if (!length) {
+        return "";
+    }
+    const char *data = file->readInPlace(length);
+    if (!data) {
+        if (eventBuffer.size() < length) {
+            eventBuffer.resize(length);
+        }
+        size_t read = file->read(&eventBuffer[0], length);
+        memset(&eventBuffer[read], 0, length - read);
+        data = &eventBuffer[0];
+    }
+    return data;
+}
+
+
 void Parser::skip_string(void) {
     size_t len = read_uint();
     file->skip(len);
@@ -29,6 +29,10 @@
 
 #include <iostream>
 #include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "trace_file.hpp"
 #include "trace_format.hpp"
@@ -46,6 +50,75 @@ struct ParseBookmark
 };
 
 
+/**
+ * Frame boundaries, as found in the trace index.
+ */
+struct FrameIndexEntry
+{
+    ParseBookmark start;
+    unsigned numberOfCalls;
+    unsigned lastCallNo;
+    // false for the calls past the last frame
+    bool complete;
+};
+
+typedef std::vector<FrameIndexEntry> FrameIndex;
+
+
+/**
+ * Receives what the trace holds as Parser::parse_event() decodes it, for
+ * callers which have no use for calls and values being built.  Pointers
+ * passed are only valid for the duration of each callback, and strings are
+ * not NUL terminated.
+ */
+class ParseHandler
+{
+public:
+    virtual ~ParseHandler() {}
+
+    /*
+     * Events, each followed by the details of its call and then by onEnd(),
+     * unless the trace is cut short.
+     */
+    virtual void onEnter(const FunctionSig *sig, CallFlags flags,
+                         unsigned thread_id, unsigned call_no) {}
+    virtual void onLeave(unsigned call_no) {}
+    virtual void onEnd(void) {}
+
+    /*
+     * Call details.  onArg() and onRet() are followed by a value.  The time
+     * is when the call was entered in the enter event, and how long it took
+     * in the leave event.
+     */
+    virtual void onArg(unsigned index) {}
+    virtual void onRet(void) {}
+    virtual void onTime(unsigned long long time) {}
+    virtual void onBacktrace(const Backtrace &backtrace) {}
+
+    /*
+     * Values.  Arrays and structs are followed by their elements and members,
+     * and then by their end; reprs by their human and machine values.
+     */
+    virtual void onNull(void) {}
+    virtual void onBool(bool value) {}
+    virtual void onSInt(signed long long value) {}
+    virtual void onUInt(unsigned long long value) {}
+    virtual void onFloat(float value) {}
+    virtual void onDouble(double value) {}
+    virtual void onString(const char *str, size_t len) {}
+    virtual void onEnum(const EnumSig *sig, signed long long value) {}
+    virtual void onBitmask(const BitmaskSig *sig, unsigned long long value) {}
+    virtual void onPointer(unsigned long long value) {}
+    virtual void onBlob(const void *data, size_t size) {}
+    virtual void beginArray(size_t length) {}
+    virtual void endArray(void) {}
+    virtual void beginStruct(const StructSig *sig) {}
+    virtual void endStruct(void) {}
+    virtual void beginRepr(void) {}
+    virtual void endRepr(void) {}
+};
+
+
 class Parser
 {
 protected:
@@ -54,12 +127,38 @@ protected:
     enum Mode {
         FULL = 0,
         SCAN,
-        SKIP
+        // skip whole events when their length is known
+        SKIP,
+        // scan the arguments, to decode them on demand
+        LAZY
     };
 
     typedef std::list<Call *> CallList;
     CallList calls;
 
+    /*
+     * Where the arguments of a call parsed lazily are in the file.
+     */
+    class LazyCallArgs : public LazyArgs {
+    public:
+        LazyCallArgs(Parser *_parser) : parser(_parser) {}
+
+        Value *decode(Call *call, unsigned index);
+
+        struct Arg {
+            File::Offset offset;
+            // whether the argument is in the file and not decoded yet
+            bool present;
+            // whether it is small enough to decode along with others
+            bool small;
+        };
+
+        Parser *parser;
+        std::vector<Arg> args;
+        // indices of the arguments, in the order they are in the file
+        std::vector<unsigned> order;
+    };
+
     struct FunctionSigFlags : public FunctionSig {
         CallFlags flags;
     };
@@ -79,26 +178,84 @@ protected:
     typedef SigState<EnumSig> EnumSigState;
     typedef SigState<BitmaskSig> BitmaskSigState;
     typedef SigState<StackFrame> StackFrameState;
+    typedef SigState<Backtrace> StackState;
 
     typedef std::vector<FunctionSigState *> FunctionMap;
     typedef std::vector<StructSigState *> StructMap;
     typedef std::vector<EnumSigState *> EnumMap;
     typedef std::vector<BitmaskSigState *> BitmaskMap;
     typedef std::vector<StackFrameState *> StackFrameMap;
+    typedef std::vector<StackState *> StackMap;
 
     FunctionMap functions;
     StructMap structs;
     EnumMap enums;
     BitmaskMap bitmasks;
     StackFrameMap frames;
+    StackMap stacks;
 
     FunctionSig *glGetErrorSig;
 
     unsigned next_call_no;
 
+    bool zeroCopyBlobs;
+
+    // Arena for the calls parsed next to share, if any
+    Arena *sharedArena;
+    // Arena of the call whose values are being parsed
+    Arena *valueArena;
+
+    FrameIndex frameIndex;
+    std::vector<ParseBookmark> callIndex;
+
+    /*
+     * Recently written blobs, mirroring the writer's to resolve references,
+     * see BLOB_REF in trace_format.hpp.
+     */
+    struct BlobCacheEntry {
+        unsigned long long id;
+        size_t size;
+        // copy of the contents, only kept when the file can't seek back to
+        // them, or once they were referred to, or NULL
+        char *data;
+        // where the blob's length is, if the file supports offsets
+        File::Offset offset;
+    };
+    typedef std::list<BlobCacheEntry> BlobCache;
+    BlobCache blobCache;
+    std::map<unsigned long long, BlobCache::iterator> blobCacheMap;
+    unsigned long long numBlobs;
+    unsigned long long blobCacheSize;
+    // whether blobs were numbered from the start, i.e., not after seeking
+    bool blobsNumbered;
+    // where referred blobs were found, by writer offset, to find them again
+    // after seeking in traces without index
+    typedef std::pair<unsigned long long, unsigned long long> BlobOffsetKey;
+    std::map<BlobOffsetKey, File::Offset> blobOffsets;
+
+    /*
+     * Segment files of a rotated trace, see trace_manifest.hpp.  Offsets of
+     * signatures and bookmarks carry the segment in the upper bits of the
+     * chunk, while blob offsets are local to the segment being read.
+     */
+    std::vector<std::string> segments;
+    unsigned segment;
+
+    std::string fileName;
+
+    // Parser whose signatures this one shares, see openShared()
+    const Parser *master;
+    // Number of parsers sharing our signatures
+    mutable volatile unsigned numShared;
+
+    // Room for strings and blobs which parse_event() can't pass in place
+    std::vector<char> eventBuffer;
+    Backtrace eventBacktrace;
+
 public:
     unsigned long long version;
     API api;
+    Properties properties;
 
     Parser();
 
@@ -106,6 +263,20 @@ public:
 
     bool open(const char *filename);
 
+    /**
+     * Open the trace another parser has open, sharing its signatures instead
+     * of reading them again, so that many parsers can parse separate frames
+     * at once, on separate threads, from bookmarks like those in the index.
+     *
+     * The master parser must know all signatures already, through
+     * loadIndex() or by having scanned the whole trace, and must neither
+     * parse further nor be closed while parsers sharing it are open, as
+     * they point into its signatures and tell them from their own by
+     * comparing with its tables.  Closing or destroying the master first
+     * fails an assertion.
+     */
+    bool openShared(const Parser &master);
+
     void close(void);
 
     Call *parse_call(void) {
@@ -123,24 +294,107 @@ public:
 
     int percentRead()
     {
+        if (segments.size() > 1) {
+            return (segment * 100 + file->percentRead()) / segments.size();
+        }
         return file->percentRead();
     }
 
+    /**
+     * Parse just the number, signature, thread and flags of a call.  Events
+     * whose length the trace records (see EVENT_LENGTH_BYTES) are skipped
+     * in one go, so the times and backtraces of their calls are missing.
+     */
     Call *scan_call() {
+        return parse_call(SKIP);
+    }
+
+    /**
+     * Like scan_call(), but going through all events, to get the times and
+     * backtraces of calls.
+     */
+    Call *scan_call_details() {
         return parse_call(SCAN);
     }
 
+    /**
+     * Parse a call, but only decode each argument when first accessed
+     * through Call::arg(), which must happen on this thread, and before
+     * this parser is closed or set to another bookmark.  Small arguments
+     * are all decoded on the first such access, so that only large ones
+     * cost a trip back each.  The return value is decoded right away.
+     * Streams and rotated traces are parsed fully.
+     */
+    Call *lazy_call() {
+        return parse_call(LAZY);
+    }
+
+    /**
+     * Decode the next call event, passing what it holds to the handler
+     * instead of building a call.  Calls aren't kept track of from their
+     * enter to their leave event, so this is not to be mixed with
+     * parse_call() and the like.  Returns false at the end of the trace.
+     */
+    bool parse_event(ParseHandler &handler);
+
+    /**
+     * Load the trace index, if the trace has one.  This makes all signatures
+     * known upfront, so that parsing can start from any bookmark without
+     * scanning the trace first.
+     */
+    bool loadIndex(void);
+
+    const FrameIndex &getFrameIndex(void) const {
+        return frameIndex;
+    }
+
+    /**
+     * Get a bookmark from the index for a call entered at or before the
+     * given call.
+     */
+    bool findCallBookmark(unsigned call_no, ParseBookmark &bookmark) const;
+
+    /**
+     * Let blobs point into the decompressed trace data instead of copying
+     * it, when the file supports it.  The data is then kept alive for as
+     * long as any such blob, so this only suits callers which don't hold on
+     * to calls.
+     */
+    void setZeroCopyBlobs(bool enabled) {
+        zeroCopyBlobs = enabled;
+    }
+
+    /**
+     * Have the calls entered from now on allocate their values from the
+     * given arena, such as one for a whole frame, until called again with
+     * NULL.  Otherwise every call gets an arena of its own.
+     */
+    void setArena(Arena *arena);
+
+    /**
+     * How the trace was recorded, see trace_format.hpp.
+     */
+    const Properties &getProperties(void) const {
+        return properties;
+    }
+
+    static CallFlags
+    lookupCallFlags(const char *name);
+
 protected:
+    bool read_header(void);
+    bool open_segment(unsigned index);
+    bool load_segment_index(void);
+
+    inline File::Offset current_offset(void);
+
     Call *parse_call(Mode mode);
 
-    FunctionSigFlags *parse_function_sig(void);
-    StructSig *parse_struct_sig();
+    FunctionSigFlags *parse_function_sig(bool defining = false);
+    StructSig *parse_struct_sig(bool defining = false);
     EnumSig *parse_old_enum_sig();
-    EnumSig *parse_enum_sig();
-    BitmaskSig *parse_bitmask_sig();
-    
-    static CallFlags
-    lookupCallFlags(const char *name);
+    EnumSig *parse_enum_sig(bool defining = false);
+    BitmaskSig *parse_bitmask_sig(bool defining = false);
 
     Call *parse_Call(Mode mode);
 
@@ -148,17 +402,27 @@ protected:
 
     Call *parse_leave(Mode mode);
 
+    void parse_define(Mode mode);
+
     bool parse_call_details(Call *call, Mode mode);
+    bool skip_call_details(Call *call, Mode mode);
+    bool parse_event_details(ParseHandler &handler);
 
     bool parse_call_backtrace(Call *call, Mode mode);
-    StackFrame * parse_backtrace_frame(Mode mode);
+    StackFrame * parse_backtrace_frame(Mode mode, bool defining = false);
+    const Backtrace * parse_stack(Mode mode, bool defining = false);
 
     void adjust_call_flags(Call *call);
 
     void parse_arg(Call *call, Mode mode);
+    void parse_lazy_arg(Call *call, unsigned index);
+    void decode_lazy_args(Call *call, LazyCallArgs &lazy, unsigned index);
+
+    void use_call_arena(Call *call, Mode mode);
 
     Value *parse_value(void);
     void scan_value(void);
+    void scan_value(int type);
     inline Value *parse_value(Mode mode) {
         if (mode == FULL) {
             return parse_value();
@@ -168,6 +432,11 @@ protected:
         }
     }
 
+    void parse_event_value(ParseHandler &handler);
+    void parse_event_blob(ParseHandler &handler);
+    void parse_event_blob_ref(ParseHandler &handler);
+    const char *read_event_data(size_t length);
+
     Value *parse_sint();
     void scan_sint();
 
@@ -192,9 +461,17 @@ protected:
     Value *parse_array(void);
     void scan_array(void);
 
+    Blob *new_blob(size_t size);
     Value *parse_blob(void);
     void scan_blob(void);
 
+    Value *parse_blob_ref(void);
+    void scan_blob_ref(void);
+
+    BlobCacheEntry *add_cached_blob(size_t size, const File::Offset &offset);
+    BlobCacheEntry *touch_cached_blob(unsigned long long distance);
+    void clear_blob_cache(void);
+
     Value *parse_struct();
     void scan_struct();
 
@@ -218,6 +495,21 @@ protected:
 };
 
 
+// Segments are told apart in the upper bits of the chunk of offsets
+#define TRACE_SEGMENT_SHIFT 48
+
+
+/**
+ * The current offset, tagged with the segment being read.
+ */
+inline File::Offset
+Parser::current_offset(void) {
+    File::Offset offset = file->currentOffset();
+    offset.chunk |= (uint64_t)segment << TRACE_SEGMENT_SHIFT;
+    return offset;
+}
+
+
 } /* namespace trace */
 
 #endif /* _TRACE_PARSER_HPP_ */
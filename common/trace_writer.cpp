@@ -29,19 +29,42 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "os.hpp"
 #include "trace_file.hpp"
+#include "trace_hash.hpp"
 #include "trace_writer.hpp"
 #include "trace_format.hpp"
 #include "trace_backtrace.hpp"
+#include "trace_parser.hpp"
 
 namespace trace {
 
 
+static void
+indexUInt(std::string &index, unsigned long long value) {
+    do {
+        char c = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            c |= 0x80;
+        }
+        index += c;
+    } while (value);
+}
+
+
 Writer::Writer() :
-    call_no(0)
+    call_no(0),
+    m_stagePtr(m_stage),
+    m_eventLength(NULL),
+    m_indexing(true),
+    m_flushFrames(false),
+    m_trackFrames(false),
+    m_blobDedup(true)
 {
     m_file = File::createSnappy();
     close();
@@ -56,9 +79,31 @@ Writer::~Writer()
 
 void
 Writer::close(void) {
+    _flushStage();
+    // Calls still in progress would be returned as incomplete calls at the
+    // end of the trace, which the index doesn't account for.
+    if (m_indexing &&
+        m_file->isOpened() &&
+        m_file->mode() == File::Write &&
+        m_numLeaves == call_no - m_firstCall) {
+        if (m_frameCalls) {
+            indexUInt(m_index, trace::INDEX_TAIL);
+            m_index += m_frameStart;
+            indexUInt(m_index, m_frameCalls);
+        }
+        indexUInt(m_index, trace::INDEX_END);
+        m_file->writeIndex(m_index);
+    }
     m_file->close();
 }
 
+void
+Writer::setFile(File *file) {
+    close();
+    delete m_file;
+    m_file = file;
+}
+
 bool
 Writer::open(const char *filename) {
     close();
@@ -67,45 +112,137 @@ Writer::open(const char *filename) {
         return false;
     }
 
+    _start();
+    return true;
+}
+
+bool
+Writer::open(std::streambuf *stream) {
+    close();
+
+    if (!m_file->open(stream, File::Write)) {
+        return false;
+    }
+
+    _start();
+    return true;
+}
+
+/**
+ * Start a new trace in the file just opened.
+ */
+void
+Writer::_start(void) {
+    m_stagePtr = m_stage;
+    m_eventLength = NULL;
+    m_numBytes = 0;
+
     call_no = 0;
     functions.clear();
     structs.clear();
     enums.clear();
     bitmasks.clear();
     frames.clear();
+    stacks.clear();
 
     _writeUInt(TRACE_VERSION);
 
-    return true;
+    for (Properties::const_iterator it = m_properties.begin();
+         it != m_properties.end(); ++it) {
+        if (!it->first.empty()) {
+            _writeString(it->first.c_str());
+            _writeString(it->second.c_str());
+        }
+    }
+    _writeString("");
+
+    m_flushFrames = m_file->isStream();
+    m_trackFrames = m_indexing || m_flushFrames;
+    m_index.clear();
+    m_frameEnders.clear();
+    m_pendingFrameEnds.clear();
+    m_leavingFrameEnd = false;
+    m_leavingCall = 0;
+    m_frameCalls = 0;
+    m_numLeaves = 0;
+    m_firstCall = 0;
+    m_numFrames = 0;
+    m_indexedChunk = ~0ULL;
+    m_blobs.clear();
+    m_blobMap.clear();
+    m_numBlobs = 0;
+    m_blobsSize = 0;
+    if (m_indexing) {
+        indexUInt(m_index, TRACE_INDEX_VERSION);
+        _indexFrameStart();
+    }
 }
 
-void inline
-Writer::_write(const void *sBuffer, size_t dwBytesToWrite) {
-    m_file->write(sBuffer, dwBytesToWrite);
+/**
+ * Write what doesn't fit in the staging buffer.
+ */
+void
+Writer::_writeSlow(const void *sBuffer, size_t dwBytesToWrite) {
+    _flushStage();
+    if (dwBytesToWrite < STAGE_SIZE) {
+        memcpy(m_stagePtr, sBuffer, dwBytesToWrite);
+        m_stagePtr += dwBytesToWrite;
+    } else {
+        m_file->write(sBuffer, dwBytesToWrite);
+        m_numBytes += dwBytesToWrite;
+    }
 }
 
-void inline
-Writer::_writeByte(char c) {
-    _write(&c, 1);
+/**
+ * Hand the staged data to the file.  Must be done before asking the file for
+ * the current offset, or closing or flushing it.
+ */
+void
+Writer::_flushStage(void) {
+    // Too late to fill in the length of the event being written
+    m_eventLength = NULL;
+    if (m_stagePtr != m_stage) {
+        m_file->write(m_stage, m_stagePtr - m_stage);
+        m_numBytes += m_stagePtr - m_stage;
+        m_stagePtr = m_stage;
+    }
 }
 
-void inline
-Writer::_writeUInt(unsigned long long value) {
-    char buf[2 * sizeof value];
-    unsigned len;
-
-    len = 0;
-    do {
-        assert(len < sizeof buf);
-        buf[len] = 0x80 | (value & 0x7f);
-        value >>= 7;
-        ++len;
-    } while (value);
-
-    assert(len);
-    buf[len - 1] &= 0x7f;
+/**
+ * Leave room for the length of the call details which follow, see
+ * EVENT_LENGTH_BYTES.
+ */
+void
+Writer::_beginEventDetails(void) {
+    if ((size_t)(m_stage + STAGE_SIZE - m_stagePtr) < EVENT_LENGTH_BYTES) {
+        _flushStage();
+    }
+    char *ptr = m_stagePtr;
+    for (unsigned i = 0; i + 1 < EVENT_LENGTH_BYTES; ++i) {
+        *ptr++ = (char)0x80;
+    }
+    *ptr++ = 0;
+    m_eventLength = m_stagePtr;
+    m_stagePtr = ptr;
+}
 
-    _write(buf, len);
+/**
+ * Fill in the length of the call details just written, if the whole event
+ * is still staged and readers may skip it.
+ */
+void
+Writer::_endEventDetails(void) {
+    if (m_eventLength) {
+        size_t length = m_stagePtr - (m_eventLength + EVENT_LENGTH_BYTES);
+        if (length < (1ULL << (7 * EVENT_LENGTH_BYTES))) {
+            for (unsigned i = 0; i + 1 < EVENT_LENGTH_BYTES; ++i) {
+                m_eventLength[i] = 0x80 | (length & 0x7f);
+                length >>= 7;
+            }
+            m_eventLength[EVENT_LENGTH_BYTES - 1] = length;
+        }
+        m_eventLength = NULL;
+    }
 }
 
 void inline
@@ -127,6 +264,36 @@ Writer::_writeString(const char *str) {
     _write(str, len);
 }
 
+void
+Writer::_indexOffset(std::string &index) {
+    _flushStage();
+    File::Offset offset = m_file->currentOffset();
+    indexUInt(index, offset.chunk);
+    indexUInt(index, offset.offsetInChunk);
+}
+
+/**
+ * Record where a signature is about to be defined.
+ */
+void
+Writer::_indexSig(IndexEntry entry) {
+    if (m_indexing) {
+        indexUInt(m_index, entry);
+        _indexOffset(m_index);
+    }
+}
+
+/**
+ * Record that a frame starts here.
+ */
+void
+Writer::_indexFrameStart(void) {
+    m_frameStart.clear();
+    _indexOffset(m_frameStart);
+    indexUInt(m_frameStart, call_no);
+    m_frameCalls = 0;
+}
+
 inline bool lookup(std::vector<bool> &map, size_t index) {
     if (index >= map.size()) {
         map.resize(index + 1);
@@ -136,6 +303,11 @@ inline bool lookup(std::vector<bool> &map, size_t index) {
     }
 }
 
+void Writer::writeTime(unsigned long long time) {
+    _writeByte(trace::CALL_TIME);
+    _writeUInt(time);
+}
+
 void Writer::beginBacktrace(unsigned num_frames) {
     if (num_frames) {
         _writeByte(trace::CALL_BACKTRACE);
@@ -143,9 +315,33 @@ void Writer::beginBacktrace(unsigned num_frames) {
     }
 }
 
+bool Writer::beginStack(unsigned id, unsigned num_frames) {
+    _writeByte(trace::CALL_STACK);
+    return _writeStack(id, num_frames);
+}
+
+bool Writer::_writeStack(unsigned id, unsigned num_frames) {
+    bool defined = lookup(stacks, id);
+    if (!defined) {
+        _indexSig(trace::INDEX_STACK);
+    }
+    _writeUInt(id);
+    if (defined) {
+        return false;
+    }
+    _writeUInt(num_frames);
+    stacks[id] = true;
+    m_eventLength = NULL;
+    return true;
+}
+
 void Writer::writeStackFrame(const RawStackFrame *frame) {
+    bool defined = lookup(frames, frame->id);
+    if (!defined) {
+        _indexSig(trace::INDEX_STACK_FRAME);
+    }
     _writeUInt(frame->id);
-    if (!lookup(frames, frame->id)) {
+    if (!defined) {
         if (frame->module != NULL) {
             _writeByte(trace::BACKTRACE_MODULE);
             _writeString(frame->module);
@@ -166,38 +362,117 @@ void Writer::writeStackFrame(const RawStackFrame *frame) {
             _writeByte(trace::BACKTRACE_OFFSET);
             _writeUInt(frame->offset);
         }
+        if (frame->address >= 0) {
+            _writeByte(trace::BACKTRACE_ADDRESS);
+            _writeUInt(frame->address);
+        }
+        if (frame->build_id != NULL) {
+            _writeByte(trace::BACKTRACE_BUILD_ID);
+            _writeString(frame->build_id);
+        }
         _writeByte(trace::BACKTRACE_END);
         frames[frame->id] = true;
+        m_eventLength = NULL;
     }
 }
 
 unsigned Writer::beginEnter(const FunctionSig *sig, unsigned thread_id) {
+    if (m_indexing) {
+        // Note down the first call entered in each chunk
+        _flushStage();
+        File::Offset offset = m_file->currentOffset();
+        if (offset.chunk != m_indexedChunk) {
+            indexUInt(m_index, trace::INDEX_CALL);
+            indexUInt(m_index, offset.chunk);
+            indexUInt(m_index, offset.offsetInChunk);
+            indexUInt(m_index, call_no);
+            m_indexedChunk = offset.chunk;
+        }
+    }
+
     _writeByte(trace::EVENT_ENTER);
     _writeUInt(thread_id);
+    _writeFunctionSig(sig);
+    _beginEventDetails();
+
+    if (m_trackFrames &&
+        sig->id < m_frameEnders.size() &&
+        m_frameEnders[sig->id]) {
+        m_pendingFrameEnds.push_back(call_no);
+    }
+
+    return call_no++;
+}
+
+void Writer::_writeFunctionSig(const FunctionSig *sig) {
+    bool defined = lookup(functions, sig->id);
+    if (!defined) {
+        _indexSig(trace::INDEX_FUNCTION_SIG);
+    }
     _writeUInt(sig->id);
-    if (!lookup(functions, sig->id)) {
+    if (!defined) {
         _writeString(sig->name);
         _writeUInt(sig->num_args);
         for (unsigned i = 0; i < sig->num_args; ++i) {
             _writeString(sig->arg_names[i]);
         }
         functions[sig->id] = true;
-    }
 
-    return call_no++;
+        if (m_trackFrames) {
+            m_frameEnders.resize(functions.size());
+            m_frameEnders[sig->id] =
+                Parser::lookupCallFlags(sig->name) & CALL_FLAG_END_FRAME;
+        }
+    }
 }
 
 void Writer::endEnter(void) {
     _writeByte(trace::CALL_END);
+    _endEventDetails();
+    _flushStage();
 }
 
 void Writer::beginLeave(unsigned call) {
+    if (m_trackFrames) {
+        std::vector<unsigned>::iterator it =
+            std::find(m_pendingFrameEnds.begin(), m_pendingFrameEnds.end(), call);
+        m_leavingFrameEnd = it != m_pendingFrameEnds.end();
+        if (m_leavingFrameEnd) {
+            m_pendingFrameEnds.erase(it);
+        }
+        m_leavingCall = call;
+    }
+
     _writeByte(trace::EVENT_LEAVE);
     _writeUInt(call);
+    _beginEventDetails();
 }
 
 void Writer::endLeave(void) {
     _writeByte(trace::CALL_END);
+    _endEventDetails();
+    _flushStage();
+
+    if (m_trackFrames) {
+        // Calls are parsed when left, so frames are delimited by leave events
+        ++m_numLeaves;
+        ++m_frameCalls;
+        if (m_leavingFrameEnd) {
+            ++m_numFrames;
+            if (m_indexing) {
+                indexUInt(m_index, trace::INDEX_FRAME);
+                m_index += m_frameStart;
+                indexUInt(m_index, m_frameCalls);
+                indexUInt(m_index, m_leavingCall);
+
+                _indexFrameStart();
+            }
+            if (m_flushFrames) {
+                m_file->flush();
+            }
+            m_leavingFrameEnd = false;
+        }
+    }
 }
 
 void Writer::beginArg(unsigned index) {
@@ -216,14 +491,23 @@ void Writer::beginArray(size_t length) {
 
 void Writer::beginStruct(const StructSig *sig) {
     _writeByte(trace::TYPE_STRUCT);
+    _writeStructSig(sig);
+}
+
+void Writer::_writeStructSig(const StructSig *sig) {
+    bool defined = lookup(structs, sig->id);
+    if (!defined) {
+        _indexSig(trace::INDEX_STRUCT_SIG);
+    }
     _writeUInt(sig->id);
-    if (!lookup(structs, sig->id)) {
+    if (!defined) {
         _writeString(sig->name);
         _writeUInt(sig->num_members);
         for (unsigned i = 0; i < sig->num_members; ++i) {
             _writeString(sig->member_names[i]);
         }
         structs[sig->id] = true;
+        m_eventLength = NULL;
     }
 }
 
@@ -288,13 +572,76 @@ void Writer::writeWString(const wchar_t *str) {
     _writeString("<wide-string>");
 }
 
+/**
+ * Start writing a blob whose contents hash to the given digest.  Returns true
+ * when a reference to an identical blob was written instead, in which case
+ * the contents must not follow.
+ */
+bool
+Writer::_beginBlob(size_t size, unsigned long long digest) {
+    if (!m_blobDedup ||
+        size < BLOB_DEDUP_MIN_SIZE ||
+        size > BLOB_DEDUP_MAX_SIZE) {
+        _writeByte(trace::TYPE_BLOB);
+        _writeUInt(size);
+        return false;
+    }
+
+    // Readers number such blobs, so must go through the event
+    m_eventLength = NULL;
+
+    BlobKey key(digest, size);
+    std::map<BlobKey, BlobList::iterator>::iterator it = m_blobMap.find(key);
+    if (it != m_blobMap.end()) {
+        BlobList::iterator entry = it->second;
+        _writeByte(trace::TYPE_BLOB_REF);
+        _writeUInt(m_numBlobs - entry->id);
+        _writeUInt(entry->chunk);
+        _writeUInt(entry->offsetInChunk);
+        m_blobs.splice(m_blobs.end(), m_blobs, entry);
+        return true;
+    }
+
+    _writeByte(trace::TYPE_BLOB);
+
+    _flushStage();
+    File::Offset offset = m_file->currentOffset();
+    BlobEntry entry;
+    entry.id = m_numBlobs++;
+    entry.digest = digest;
+    entry.size = size;
+    entry.chunk = offset.chunk;
+    entry.offsetInChunk = offset.offsetInChunk;
+    m_blobMap[key] = m_blobs.insert(m_blobs.end(), entry);
+    m_blobsSize += size;
+
+    // Evict exactly as readers do, so references stay resolvable
+    while (m_blobs.size() > BLOB_DEDUP_ENTRIES ||
+           m_blobsSize > BLOB_DEDUP_WINDOW) {
+        BlobEntry &front = m_blobs.front();
+        m_blobMap.erase(BlobKey(front.digest, front.size));
+        m_blobsSize -= front.size;
+        m_blobs.pop_front();
+    }
+
+    _writeUInt(size);
+    return false;
+}
+
 void Writer::writeBlob(const void *data, size_t size) {
     if (!data) {
         Writer::writeNull();
         return;
     }
-    _writeByte(trace::TYPE_BLOB);
-    _writeUInt(size);
+    unsigned long long digest = 0;
+    if (m_blobDedup &&
+        size >= BLOB_DEDUP_MIN_SIZE &&
+        size <= BLOB_DEDUP_MAX_SIZE) {
+        digest = hash64(data, size);
+    }
+    if (_beginBlob(size, digest)) {
+        return;
+    }
     if (size) {
         _write(data, size);
     }
@@ -302,22 +649,40 @@ void Writer::writeBlob(const void *data, size_t size) {
 
 void Writer::writeEnum(const EnumSig *sig, signed long long value) {
     _writeByte(trace::TYPE_ENUM);
+    _writeEnumSig(sig);
+    writeSInt(value);
+}
+
+void Writer::_writeEnumSig(const EnumSig *sig) {
+    bool defined = lookup(enums, sig->id);
+    if (!defined) {
+        _indexSig(trace::INDEX_ENUM_SIG);
+    }
     _writeUInt(sig->id);
-    if (!lookup(enums, sig->id)) {
+    if (!defined) {
         _writeUInt(sig->num_values);
         for (unsigned i = 0; i < sig->num_values; ++i) {
             _writeString(sig->values[i].name);
             writeSInt(sig->values[i].value);
         }
         enums[sig->id] = true;
+        m_eventLength = NULL;
     }
-    writeSInt(value);
 }
 
 void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
     _writeByte(trace::TYPE_BITMASK);
+    _writeBitmaskSig(sig);
+    _writeUInt(value);
+}
+
+void Writer::_writeBitmaskSig(const BitmaskSig *sig) {
+    bool defined = lookup(bitmasks, sig->id);
+    if (!defined) {
+        _indexSig(trace::INDEX_BITMASK_SIG);
+    }
     _writeUInt(sig->id);
-    if (!lookup(bitmasks, sig->id)) {
+    if (!defined) {
         _writeUInt(sig->num_flags);
         for (unsigned i = 0; i < sig->num_flags; ++i) {
             if (i != 0 && sig->flags[i].value == 0) {
@@ -327,8 +692,75 @@ void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
             _writeUInt(sig->flags[i].value);
         }
         bitmasks[sig->id] = true;
+        m_eventLength = NULL;
     }
-    _writeUInt(value);
+}
+
+void Writer::beginDefine(void) {
+    _writeByte(trace::EVENT_DEFINE);
+}
+
+void Writer::defineFunction(const FunctionSig *sig) {
+    if (!lookup(functions, sig->id)) {
+        _writeByte(trace::DEFINE_FUNCTION);
+        _writeFunctionSig(sig);
+    }
+}
+
+void Writer::defineStruct(const StructSig *sig) {
+    if (!lookup(structs, sig->id)) {
+        _writeByte(trace::DEFINE_STRUCT);
+        _writeStructSig(sig);
+    }
+}
+
+void Writer::defineEnum(const EnumSig *sig) {
+    if (!lookup(enums, sig->id)) {
+        _writeByte(trace::DEFINE_ENUM);
+        _writeEnumSig(sig);
+    }
+}
+
+void Writer::defineBitmask(const BitmaskSig *sig) {
+    if (!lookup(bitmasks, sig->id)) {
+        _writeByte(trace::DEFINE_BITMASK);
+        _writeBitmaskSig(sig);
+    }
+}
+
+bool Writer::defineStack(unsigned id, unsigned num_frames) {
+    if (lookup(stacks, id)) {
+        return false;
+    }
+    _writeByte(trace::DEFINE_STACK);
+    return _writeStack(id, num_frames);
+}
+
+void Writer::defineFrame(const RawStackFrame *frame) {
+    if (!lookup(frames, frame->id)) {
+        _writeByte(trace::DEFINE_FRAME);
+        writeStackFrame(frame);
+    }
+}
+
+void Writer::defineCallNo(unsigned no) {
+    _writeByte(trace::DEFINE_CALL_NO);
+    _writeUInt(no);
+    call_no = no;
+    m_firstCall = no;
+}
+
+void Writer::endDefine(void) {
+    _writeByte(trace::DEFINE_END);
+    _flushStage();
+    // The first frame starts after the definitions, with the right call number
+    if (m_indexing && m_frameCalls == 0) {
+        _indexFrameStart();
+    }
+}
+
+void Writer::writeRaw(const void *data, size_t size) {
+    _write(data, size);
 }
 
 void Writer::writeNull(void) {
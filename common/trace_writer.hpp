@@ -32,10 +32,17 @@
 
 
 #include <stddef.h>
+#include <string.h>
 
+#include <list>
+#include <map>
+#include <streambuf>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "trace_model.hpp"
+#include "trace_format.hpp"
 #include "trace_backtrace.hpp"
 
 namespace trace {
@@ -46,19 +53,133 @@ namespace trace {
         File *m_file;
         unsigned call_no;
 
+        /*
+         * The event being written is staged here and handed to the file in
+         * one go once complete, rather than in many tiny writes.
+         */
+        enum {
+            STAGE_SIZE = 4096
+        };
+        char m_stage[STAGE_SIZE];
+        char *m_stagePtr;
+        // length of the event being written, while it can still be filled
+        // in, see EVENT_LENGTH_BYTES
+        char *m_eventLength;
+
         std::vector<bool> functions;
         std::vector<bool> structs;
         std::vector<bool> enums;
         std::vector<bool> bitmasks;
         std::vector<bool> frames;
+        std::vector<bool> stacks;
+
+        /*
+         * Trace index state, see trace_format.hpp.
+         */
+        bool m_indexing;
+        // whether to flush the file at the end of each frame, so that
+        // readers on the other end of a pipe or socket can keep up
+        bool m_flushFrames;
+        // whether frame ends are being tracked, for either of the above
+        bool m_trackFrames;
+        std::string m_index;
+        // whether each function ends a frame
+        std::vector<bool> m_frameEnders;
+        // frame-ending calls entered but not left yet
+        std::vector<unsigned> m_pendingFrameEnds;
+        bool m_leavingFrameEnd;
+        unsigned m_leavingCall;
+        // offset and call number where the current frame started
+        std::string m_frameStart;
+        unsigned m_frameCalls;
+        unsigned m_numLeaves;
+        // number of the first call, for traces which start midway
+        unsigned m_firstCall;
+        unsigned m_numFrames;
+        unsigned long long m_numBytes;
+        unsigned long long m_indexedChunk;
+
+        /*
+         * Recently written blobs, see BLOB_REF in trace_format.hpp.
+         */
+        struct BlobEntry {
+            unsigned long long id;
+            unsigned long long digest;
+            size_t size;
+            unsigned long long chunk;
+            unsigned long long offsetInChunk;
+        };
+        typedef std::list<BlobEntry> BlobList;
+        typedef std::pair<unsigned long long, size_t> BlobKey;
+        bool m_blobDedup;
+        BlobList m_blobs;
+        std::map<BlobKey, BlobList::iterator> m_blobMap;
+        unsigned long long m_numBlobs;
+        unsigned long long m_blobsSize;
+
+        Properties m_properties;
 
     public:
         Writer();
         ~Writer();
 
+        /**
+         * Record a fact about how the trace was made, see trace_format.hpp.
+         * To be set before opening.
+         */
+        void setProperty(const std::string &name, const std::string &value) {
+            m_properties[name] = value;
+        }
+
+        void setProperties(const Properties &properties) {
+            m_properties = properties;
+        }
+
+        /**
+         * Whether to append an index when closing the trace, to be set before
+         * opening.  Enabled by default.
+         */
+        void setIndexing(bool enable) {
+            m_indexing = enable;
+        }
+
+        /**
+         * Whether to refer to identical blobs written before instead of
+         * repeating them, to be set before opening.  Enabled by default.
+         */
+        void setBlobDedup(bool enable) {
+            m_blobDedup = enable;
+        }
+
+        /**
+         * Replace the file to write to, e.g. to use another codec, before
+         * opening.  The writer takes ownership of the file.
+         */
+        void setFile(File *file);
+
         bool open(const char *filename);
+
+        /**
+         * Write to an already opened stream instead, taking ownership of it.
+         */
+        bool open(std::streambuf *stream);
+
         void close(void);
 
+        /**
+         * Uncompressed bytes written since opening.
+         */
+        unsigned long long bytesWritten(void) const {
+            return m_numBytes;
+        }
+
+        /**
+         * Frames ended since opening, when frames are tracked.
+         */
+        unsigned framesWritten(void) const {
+            return m_numFrames;
+        }
+
         unsigned beginEnter(const FunctionSig *sig, unsigned thread_id);
         void endEnter(void);
 
@@ -71,10 +192,25 @@ namespace trace {
         void beginReturn(void);
         inline void endReturn(void) {}
 
+        /**
+         * Record when the call being entered started, or how long the call
+         * being left took, in nanoseconds.  See CALL_TIME.
+         */
+        void writeTime(unsigned long long time);
+
         void beginBacktrace(unsigned num_frames);
         void writeStackFrame(const RawStackFrame *frame);
         inline void endBacktrace(void) {}
 
+        /**
+         * Record the backtrace of the call being entered by the id of the
+         * whole stack.  Returns true if the stack wasn't written before, in
+         * which case its num_frames frames must follow, through
+         * writeStackFrame().  See CALL_STACK.
+         */
+        bool beginStack(unsigned id, unsigned num_frames);
+        inline void endStack(void) {}
+
         void beginArray(size_t length);
         inline void endArray(void) {}
 
@@ -103,16 +239,95 @@ namespace trace {
 
         void writeCall(Call *call);
 
+        /**
+         * Define signatures, stacks, and the number of the next call upfront,
+         * for traces which start midway.  See EVENT_DEFINE.  Nothing is
+         * written for what was defined already.  Stacks which weren't
+         * defined before must be followed by their frames, as with
+         * beginStack().
+         */
+        void beginDefine(void);
+        void defineFunction(const FunctionSig *sig);
+        void defineStruct(const StructSig *sig);
+        void defineEnum(const EnumSig *sig);
+        void defineBitmask(const BitmaskSig *sig);
+        bool defineStack(unsigned id, unsigned num_frames);
+        void defineFrame(const RawStackFrame *frame);
+        void defineCallNo(unsigned no);
+        void endDefine(void);
+
+        /**
+         * Copy whole events encoded by another writer, whose signatures
+         * this trace defines as well.
+         */
+        void writeRaw(const void *data, size_t size);
+
     protected:
-        void inline _write(const void *sBuffer, size_t dwBytesToWrite);
-        void inline _writeByte(char c);
-        void inline _writeUInt(unsigned long long value);
+        inline void _write(const void *sBuffer, size_t dwBytesToWrite);
+        inline void _writeByte(char c);
+        inline void _writeUInt(unsigned long long value);
         void inline _writeFloat(float value);
         void inline _writeDouble(double value);
         void inline _writeString(const char *str);
 
+        void _writeSlow(const void *sBuffer, size_t dwBytesToWrite);
+        void _flushStage(void);
+        void _beginEventDetails(void);
+        void _endEventDetails(void);
+        void _start(void);
+
+        void _indexOffset(std::string &index);
+        void _indexSig(IndexEntry entry);
+        void _indexFrameStart(void);
+
+        bool _beginBlob(size_t size, unsigned long long digest);
+
+        void _writeFunctionSig(const FunctionSig *sig);
+        void _writeStructSig(const StructSig *sig);
+        void _writeEnumSig(const EnumSig *sig);
+        void _writeBitmaskSig(const BitmaskSig *sig);
+        bool _writeStack(unsigned id, unsigned num_frames);
+
     };
 
+    inline void
+    Writer::_write(const void *sBuffer, size_t dwBytesToWrite) {
+        if (dwBytesToWrite <= (size_t)(m_stage + STAGE_SIZE - m_stagePtr)) {
+            memcpy(m_stagePtr, sBuffer, dwBytesToWrite);
+            m_stagePtr += dwBytesToWrite;
+        } else {
+            _writeSlow(sBuffer, dwBytesToWrite);
+        }
+    }
+
+    inline void
+    Writer::_writeByte(char c) {
+        if (m_stagePtr < m_stage + STAGE_SIZE) {
+            *m_stagePtr++ = c;
+        } else {
+            _writeSlow(&c, 1);
+        }
+    }
+
+    inline void
+    Writer::_writeUInt(unsigned long long value) {
+        char buf[2 * sizeof value];
+        // Encode in place when there's room, as is almost always the case
+        char *ptr = (size_t)(m_stage + STAGE_SIZE - m_stagePtr) >= sizeof buf
+                  ? m_stagePtr : buf;
+        char *start = ptr;
+        do {
+            *ptr++ = 0x80 | (value & 0x7f);
+            value >>= 7;
+        } while (value);
+        ptr[-1] &= 0x7f;
+        if (start == m_stagePtr) {
+            m_stagePtr = ptr;
+        } else {
+            _writeSlow(buf, ptr - buf);
+        }
+    }
+
 } /* namespace trace */
 
 #endif /* _TRACE_WRITER_HPP_ */
@@ -25,18 +25,31 @@
 
 
 #include <assert.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <deque>
+#include <streambuf>
+#include <utility>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include "os.hpp"
 #include "os_thread.hpp"
 #include "os_string.hpp"
+#include "os_process.hpp"
+#include "os_time.hpp"
 #include "trace_file.hpp"
+#include "trace_hash.hpp"
 #include "trace_writer_local.hpp"
 #include "trace_format.hpp"
 #include "trace_backtrace.hpp"
+#include "trace_parser.hpp"
 
 
 namespace trace {
@@ -55,26 +68,639 @@ static const char *realloc_args[2] = {"ptr", "size"};
 const FunctionSig realloc_sig = {3, "realloc", 2, realloc_args};
 
 
+/*
+ * Events are serialized into the thread buffers mostly as they will appear
+ * in the file.  Only what depends on what was written before, such as
+ * signatures which are defined on first use, or the index, is recorded as an
+ * operation for the merging thread to replay through the Writer, in the
+ * final order.
+ */
+enum Op {
+    OP_RAW,         // uint32 length, bytes
+    OP_ENTER,       // uint64 event, sig
+    OP_LEAVE,       // uint64 event, uint32 call handle
+    OP_END_ENTER,
+    OP_END_LEAVE,
+    OP_STRUCT,      // sig
+    OP_ENUM,        // sig, int64 value
+    OP_BITMASK,     // sig, uint64 value
+    OP_STACK,       // const Stack *
+    OP_BLOB,        // uint64 digest, size, followed by OP_RAW with the bytes
+    OP_NEXT_BLOCK,
+};
+
+#define BLOCK_SIZE (256 * 1024)
+#define MAX_RAW_SIZE (1 << 30)
+
+// How much a thread can get ahead of the merging thread before waiting
+#define MAX_PENDING_SIZE (32 * 1024 * 1024)
+
+// How long the merging thread sleeps when waiting for an event which other
+// threads' committed events are queued behind
+#define MERGE_RETRY_MS 1
+
+#define NO_EVENT (~0ULL)
+
+// Whether functions need a backtrace, as far as each thread knows
+enum BacktraceDecision {
+    BACKTRACE_UNKNOWN = 0,
+    BACKTRACE_NEEDED,
+    BACKTRACE_NOT_NEEDED,
+};
+
+
+struct LocalWriter::Stack {
+    unsigned id;
+    std::vector<RawStackFrame> frames;
+};
+
+
+struct LocalWriter::Definitions {
+    std::vector<const FunctionSig *> functions;
+    std::vector<const StructSig *> structs;
+    std::vector<const EnumSig *> enums;
+    std::vector<const BitmaskSig *> bitmasks;
+    std::vector<const Stack *> stacks;
+
+    void
+    append(const Definitions &other) {
+        functions.insert(functions.end(), other.functions.begin(), other.functions.end());
+        structs.insert(structs.end(), other.structs.begin(), other.structs.end());
+        enums.insert(enums.end(), other.enums.begin(), other.enums.end());
+        bitmasks.insert(bitmasks.end(), other.bitmasks.begin(), other.bitmasks.end());
+        stacks.insert(stacks.end(), other.stacks.begin(), other.stacks.end());
+    }
+
+    void
+    clear(void) {
+        functions.clear();
+        structs.clear();
+        enums.clear();
+        bitmasks.clear();
+        stacks.clear();
+    }
+};
+
+
+/*
+ * The flight recorder is the stream the file writes its compressed chunks
+ * to.  These are grouped into segments starting and ending with whole events,
+ * and the oldest segments are dropped once they take more than the size
+ * limit.  Signatures and stacks are only defined where first used, so those
+ * defined in the dropped segments are kept, to be defined upfront in dumps.
+ */
+class LocalWriter::FlightRecorder : public std::streambuf {
+public:
+    struct Segment {
+        std::string data;
+        unsigned firstCall;
+        Definitions definitions;
+    };
+
+    size_t limit;
+    // The file identifier
+    std::string header;
+    std::deque<Segment *> segments;
+    size_t size;
+    Segment *current;
+    Definitions dropped;
+    unsigned numDropped;
+
+    FlightRecorder(size_t _limit) :
+        limit(_limit),
+        size(0),
+        current(new Segment),
+        numDropped(0)
+    {
+        current->firstCall = 0;
+    }
+
+    ~FlightRecorder() {
+        for (size_t i = 0; i < segments.size(); ++i) {
+            delete segments[i];
+        }
+        delete current;
+    }
+
+    /**
+     * Keep the file identifier written so far, but not the version and
+     * properties, which dumps write anew.  The file must be flushed.
+     */
+    void
+    start(void) {
+        header = current->data.substr(0, 2);
+        current->data.clear();
+    }
+
+    /**
+     * Close the current segment, which the file must have been flushed into,
+     * and drop the oldest ones which the others make up for the size limit
+     * without.
+     */
+    void
+    endSegment(unsigned nextCall) {
+        if (current->data.empty()) {
+            return;
+        }
+        size += current->data.size();
+        segments.push_back(current);
+        current = new Segment;
+        current->firstCall = nextCall;
+
+        while (segments.size() > 1 &&
+               size - segments.front()->data.size() >= limit) {
+            Segment *segment = segments.front();
+            segments.pop_front();
+            size -= segment->data.size();
+            dropped.append(segment->definitions);
+            ++numDropped;
+            delete segment;
+        }
+    }
+
+    /**
+     * Reads back the file identifier and the segments, as one file.
+     */
+    class Reader : public std::streambuf {
+        const FlightRecorder &recorder;
+        size_t next;
+        bool started;
+
+    public:
+        Reader(const FlightRecorder &_recorder) :
+            recorder(_recorder),
+            next(0),
+            started(false)
+        {}
+
+    protected:
+        int
+        underflow(void) {
+            const std::string *data;
+            do {
+                if (!started) {
+                    data = &recorder.header;
+                    started = true;
+                } else if (next < recorder.segments.size()) {
+                    data = &recorder.segments[next++]->data;
+                } else {
+                    return EOF;
+                }
+            } while (data->empty());
+            char *begin = const_cast<char *>(data->data());
+            setg(begin, begin, begin + data->size());
+            return (unsigned char)*begin;
+        }
+    };
+
+protected:
+    std::streamsize
+    xsputn(const char *s, std::streamsize n) {
+        current->data.append(s, n);
+        return n;
+    }
+
+    int
+    overflow(int c) {
+        if (c != EOF) {
+            current->data += (char)c;
+        }
+        return c;
+    }
+};
+
+
+static inline bool
+isDefined(const std::vector<bool> &map, size_t id) {
+    return id < map.size() && map[id];
+}
+
+
+struct Block {
+    Block *next;
+    size_t size;
+
+    inline char *
+    data(void) {
+        return reinterpret_cast<char *>(this + 1);
+    }
+};
+
+
+/**
+ * Single producer, single consumer queue of the events of one thread.
+ *
+ * The traced thread appends to a chain of blocks, and publishes complete
+ * events by advancing the committed pointer.  The merging thread consumes
+ * them, freeing the blocks it is done with.
+ */
+class LocalWriter::ThreadBuffer
+{
+public:
+    unsigned threadId;
+
+    /*
+     * Traced thread side.
+     */
+    Block *writeBlock;
+    char *writePtr;
+    char *writeEnd;
+    // where the length of the current OP_RAW goes, or NULL
+    char *rawLength;
+    // block being written when the merging thread was last woken up
+    Block *signaledBlock;
+    // BacktraceDecision of each function, by signature id
+    std::vector<unsigned char> backtraceNeeded;
+    // call being entered, and when the calls not left yet were entered
+    unsigned enteringCall;
+    std::vector< std::pair<unsigned, long long> > enterTimes;
+
+    /*
+     * Shared.
+     */
+    char * volatile committed;
+    // total size of the blocks not freed yet
+    volatile unsigned long long pending;
+    volatile bool waiting;
+    // set once the thread exited, after its last event
+    volatile bool retired;
+    // a freed block, handed back for reuse
+    Block * volatile spare;
+    os::mutex drainMutex;
+    os::condition_variable drained;
+
+    /*
+     * Merging thread side.
+     */
+    Block *readBlock;
+    const char *readPtr;
+    // calls entered but not left yet, by the handle beginEnter() returned,
+    // and their numbers in the trace
+    std::vector< std::pair<unsigned, unsigned> > openCalls;
+
+    ThreadBuffer(unsigned id) :
+        threadId(id),
+        writeBlock(NULL),
+        pending(0),
+        waiting(false),
+        retired(false),
+        spare(NULL),
+        readBlock(NULL)
+    {
+        reset();
+    }
+
+    ~ThreadBuffer() {
+        freeBlocks();
+    }
+
+    static void
+    threadExit(void *buffer);
+
+    void
+    freeBlocks(void) {
+        Block *block = readBlock;
+        while (block) {
+            Block *next = block == writeBlock ? NULL : block->next;
+            free(block);
+            block = next;
+        }
+        free(spare);
+        spare = NULL;
+    }
+
+    /**
+     * Drop everything, for forked children.
+     */
+    void
+    reset(void) {
+        freeBlocks();
+        pending = 0;
+        waiting = false;
+        writeBlock = newBlock(BLOCK_SIZE);
+        writePtr = writeBlock->data();
+        writeEnd = writePtr + writeBlock->size;
+        rawLength = NULL;
+        signaledBlock = writeBlock;
+        enterTimes.clear();
+        openCalls.clear();
+        committed = writePtr;
+        readBlock = writeBlock;
+        readPtr = writePtr;
+    }
+
+    Block *
+    newBlock(size_t size) {
+        Block *block = spare;
+        if (block && size == BLOCK_SIZE) {
+            os::memory_barrier();
+            spare = NULL;
+        } else {
+            block = static_cast<Block *>(malloc(sizeof(Block) + size));
+            if (!block) {
+                os::log("apitrace: error: out of memory\n");
+                os::abort();
+            }
+        }
+        block->next = NULL;
+        block->size = size;
+        os::atomic_fetch_add(&pending, size);
+        return block;
+    }
+
+    /**
+     * Continue in a new block with room for at least size bytes.  The last
+     * byte of every block is kept for the OP_NEXT_BLOCK.
+     */
+    void
+    nextBlock(size_t size) {
+        size += 1;
+        Block *block = newBlock(size > BLOCK_SIZE ? size : BLOCK_SIZE);
+        *writePtr = OP_NEXT_BLOCK;
+        writeBlock->next = block;
+        writeBlock = block;
+        writePtr = block->data();
+        writeEnd = writePtr + block->size;
+    }
+
+    inline void
+    closeRaw(void) {
+        if (rawLength) {
+            uint32_t length = writePtr - (rawLength + sizeof length);
+            memcpy(rawLength, &length, sizeof length);
+            rawLength = NULL;
+        }
+    }
+
+    /**
+     * Room for an operation of the given size.
+     */
+    inline char *
+    reserveOp(size_t size) {
+        closeRaw();
+        if ((size_t)(writeEnd - writePtr) <= size) {
+            nextBlock(size);
+        }
+        return writePtr;
+    }
+
+    void
+    openRaw(size_t size) {
+        closeRaw();
+        size_t opSize = 1 + sizeof(uint32_t) + size;
+        if ((size_t)(writeEnd - writePtr) <= opSize) {
+            nextBlock(opSize);
+        }
+        *writePtr++ = OP_RAW;
+        rawLength = writePtr;
+        writePtr += sizeof(uint32_t);
+    }
+
+    /**
+     * Room for size bytes of serialized data.
+     */
+    inline char *
+    reserveRaw(size_t size) {
+        if (!rawLength || (size_t)(writeEnd - writePtr) <= size) {
+            openRaw(size);
+        }
+        return writePtr;
+    }
+
+    template< class T >
+    inline void
+    writeOp(Op op, const T &value) {
+        char *ptr = reserveOp(1 + sizeof value);
+        *ptr++ = op;
+        memcpy(ptr, &value, sizeof value);
+        writePtr = ptr + sizeof value;
+    }
+
+    inline void
+    writeOp(Op op) {
+        char *ptr = reserveOp(1);
+        *ptr++ = op;
+        writePtr = ptr;
+    }
+
+    inline void
+    writeByte(char c) {
+        char *ptr = reserveRaw(1);
+        *ptr++ = c;
+        writePtr = ptr;
+    }
+
+    inline void
+    writeUInt(unsigned long long value) {
+        char *ptr = reserveRaw(2 * sizeof value);
+        do {
+            *ptr++ = 0x80 | (value & 0x7f);
+            value >>= 7;
+        } while (value);
+        ptr[-1] &= 0x7f;
+        writePtr = ptr;
+    }
+
+    void
+    writeBytes(const void *data, size_t size) {
+        if (rawLength && (size_t)(writeEnd - writePtr) > size) {
+            memcpy(writePtr, data, size);
+            writePtr += size;
+            return;
+        }
+        const char *src = static_cast<const char *>(data);
+        while (size) {
+            size_t length = size < MAX_RAW_SIZE ? size : MAX_RAW_SIZE;
+            openRaw(length);
+            memcpy(writePtr, src, length);
+            writePtr += length;
+            src += length;
+            size -= length;
+        }
+    }
+
+    inline void
+    writeString(const char *str, size_t length) {
+        writeUInt(length);
+        writeBytes(str, length);
+    }
+
+    /*
+     * Merging thread side.
+     */
+
+    /**
+     * Position of the next committed event, or NO_EVENT.
+     */
+    inline unsigned long long
+    peekEvent(void) const {
+        const char *end = committed;
+        os::memory_barrier();
+        const char *ptr = readPtr;
+        if (ptr == end) {
+            return NO_EVENT;
+        }
+        if (*ptr == OP_NEXT_BLOCK) {
+            ptr = readBlock->next->data();
+            if (ptr == end) {
+                return NO_EVENT;
+            }
+        }
+        assert(*ptr == OP_ENTER || *ptr == OP_LEAVE);
+        unsigned long long event;
+        memcpy(&event, ptr + 1, sizeof event);
+        return event;
+    }
+
+    inline bool
+    hasCommitted(void) const {
+        const char *end = committed;
+        os::memory_barrier();
+        return readPtr != end;
+    }
+
+    /**
+     * Whether skipBlockEnd() would free a block.
+     */
+    inline bool
+    canSkipBlockEnd(void) const {
+        return hasCommitted() && *readPtr == OP_NEXT_BLOCK;
+    }
+
+    /**
+     * Whether the thread exited and all its events were merged.
+     */
+    inline bool
+    isDrained(void) const {
+        if (!retired) {
+            return false;
+        }
+        os::memory_barrier();
+        return !hasCommitted();
+    }
+
+    /**
+     * Move on to the next block if the current one was done with.
+     */
+    inline void
+    skipBlockEnd(void) {
+        if (*readPtr == OP_NEXT_BLOCK) {
+            Block *block = readBlock;
+            readBlock = block->next;
+            readPtr = readBlock->data();
+            os::atomic_fetch_add(&pending, -(unsigned long long)block->size);
+            // Blocks are big enough for malloc to map and unmap them each
+            // time, so keep one around
+            if (block->size == BLOCK_SIZE && !spare) {
+                os::memory_barrier();
+                spare = block;
+            } else {
+                free(block);
+            }
+            if (waiting) {
+                os::unique_lock<os::mutex> lock(drainMutex);
+                drained.signal();
+            }
+        }
+    }
+
+    template< class T >
+    inline T
+    read(void) {
+        T value;
+        memcpy(&value, readPtr, sizeof value);
+        readPtr += sizeof value;
+        return value;
+    }
+};
+
+
+// Buffer of the calling thread
+static OS_THREAD_SPECIFIC_PTR(LocalWriter::ThreadBuffer)
+threadBuffer;
+
+// Same, but to retire it when the thread exits, which compiler TLS can't
+static os::thread_specific_ptr<LocalWriter::ThreadBuffer>
+exitingThreadBuffer(LocalWriter::ThreadBuffer::threadExit);
+
+// Whether the calling thread is writing to the file
+static OS_THREAD_SPECIFIC_PTR(void)
+merging;
+
+
 static void exceptionCallback(void)
 {
     localWriter.flush();
 }
 
+// Set by dumpSignalHandler, for the merging thread to dump the flight
+// recorder
+static volatile sig_atomic_t dumpRequested = 0;
+
+#ifndef _WIN32
+static void dumpSignalHandler(int sig)
+{
+    dumpRequested = 1;
+}
+#endif
+
 
 LocalWriter::LocalWriter() :
-    acquired(0)
+    nextPosition(0),
+    nextEvent(0),
+    numThreads(0),
+    nextThreadId(0),
+    mergerSleeping(false),
+    stopMerger(false),
+    lastThread(NULL),
+    opened(false),
+    numStacks(0),
+    filterDecisions(NULL),
+    timing(false),
+    timeBase(0),
+    newDefinitions(NULL),
+    recorder(NULL),
+    numDumps(0),
+    triggered(NULL),
+    rotateSize(0),
+    rotateFrames(0),
+    allDefinitions(NULL),
+    checkedFrames(0),
+    rotatePending(false)
 {
     os::log("apitrace: loaded\n");
 
+    _loadFilter();
+
     // Install the signal handlers as early as possible, to prevent
     // interfering with the application's signal handling.
     os::setExceptionCallback(exceptionCallback);
+
+#ifndef _WIN32
+    pthread_atfork(_prepareFork, _parentFork, _childFork);
+#endif
 }
 
 LocalWriter::~LocalWriter()
 {
     os::resetExceptionCallback();
-    checkProcessId();
+    if (opened) {
+        _stopMerger();
+        if (!manifest.segments.empty() && !rotatePending) {
+            ManifestSegment &last = manifest.segments.back();
+            last.endCall = call_no;
+            last.endFrame = last.firstFrame + m_numFrames;
+            _writeManifest();
+        }
+    }
+    delete allDefinitions;
+    for (StackMap::iterator it = stacks.begin(); it != stacks.end(); ++it) {
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            delete it->second[i];
+        }
+    }
+    delete [] filterDecisions;
+    filterDecisions = NULL;
 }
 
 void
@@ -119,112 +745,1235 @@ LocalWriter::open(void) {
         }
     }
 
-    os::log("apitrace: tracing to %s\n", lpFileName);
+    const char *flightRecorder = getenv("APITRACE_FLIGHT_RECORDER");
+    size_t recorderSize = flightRecorder ? atoi(flightRecorder) : 0;
+    const char *rotateSizeEnv = getenv("APITRACE_ROTATE_SIZE");
+    const char *rotateFramesEnv = getenv("APITRACE_ROTATE_FRAMES");
+    rotateSize = rotateSizeEnv ? atoi(rotateSizeEnv) * 1024ULL * 1024ULL : 0;
+    rotateFrames = rotateFramesEnv ? atoi(rotateFramesEnv) : 0;
+    if (recorderSize) {
+        os::log("apitrace: flight recording the last %u MB, to dump to %s\n",
+                (unsigned)recorderSize, lpFileName);
+        if (rotateSize || rotateFrames) {
+            os::log("apitrace: warning: not rotating the flight recorder's dumps\n");
+            rotateSize = 0;
+            rotateFrames = 0;
+        }
+    } else if (rotateSize || rotateFrames) {
+        os::log("apitrace: tracing to segments listed in %s\n", lpFileName);
+    } else {
+        os::log("apitrace: tracing to %s\n", lpFileName);
+    }
 
-    if (!Writer::open(lpFileName)) {
+    // The file is not opened yet, so it can still be swapped for one using
+    // another codec.
+    const char *codec = getenv("APITRACE_CODEC");
+    if (codec && recorderSize) {
+        // For the dumps, as the recorder needs a chunked file
+        dumpCodec = codec;
+    } else if (codec) {
+        File *file = File::createForCodec(codec);
+        if (file) {
+            setFile(file);
+        }
+    } else if (strncmp(lpFileName, "shm:", 4) == 0 && !recorderSize) {
+        // Leave compressing to the collector
+        setFile(File::createRaw());
+        m_file->setCompressionThreads(0);
+    }
+
+    const char *level = getenv("APITRACE_COMPRESSION_LEVEL");
+    if (level) {
+        m_file->setCompressionLevel(atoi(level));
+    }
+
+    const char *threads = getenv("APITRACE_COMPRESSION_THREADS");
+    if (threads) {
+        m_file->setCompressionThreads(atoi(threads));
+    }
+
+    const char *index = getenv("APITRACE_INDEX");
+    if (index) {
+        setIndexing(atoi(index) != 0);
+    }
+
+    const char *dedup = getenv("APITRACE_DEDUP");
+    if (dedup) {
+        setBlobDedup(atoi(dedup) != 0);
+    }
+
+    const char *timingEnv = getenv("APITRACE_TIMING");
+    timing = timingEnv && atoi(timingEnv) != 0;
+    timeBase = os::getTime();
+
+    if (filterDecisions) {
+        setProperty("filter", callFilter.policy);
+    }
+
+    if (recorderSize) {
+        dumpFileName = lpFileName;
+        _openRecorder(recorderSize * 1024 * 1024);
+    } else if (rotateSize || rotateFrames) {
+        manifestFileName = lpFileName;
+        manifest.segments.clear();
+        if (!allDefinitions) {
+            allDefinitions = new Definitions;
+        }
+        allDefinitions->clear();
+        newDefinitions = allDefinitions;
+
+        ManifestSegment segment;
+        segment.filename = _segmentFileName(1);
+        if (!Writer::open(segment.filename.c_str())) {
+            os::log("apitrace: error: failed to open %s\n", segment.filename.c_str());
+            os::abort();
+        }
+        m_trackFrames = true;
+        checkedFrames = 0;
+        rotatePending = false;
+        manifest.segments.push_back(segment);
+        _writeManifest();
+    } else if (!Writer::open(lpFileName)) {
         os::log("apitrace: error: failed to open %s\n", lpFileName);
         os::abort();
     }
 
-    pid = os::getCurrentProcessId();
+    stopMerger = false;
+    mergerThread = os::thread(mergerThreadProc, this);
+}
+
+/**
+ * Start recording the trace in memory, keeping the last size bytes of it, to
+ * be dumped on a crash, on SIGUSR2, or after a call to one of the functions
+ * listed in APITRACE_FLIGHT_RECORDER_TRIGGER.
+ */
+void
+LocalWriter::_openRecorder(size_t size) {
+    const char *names = getenv("APITRACE_FLIGHT_RECORDER_TRIGGER");
+    if (names) {
+        std::string list(names);
+        size_t pos = 0;
+        while ((pos = list.find_first_not_of(" \t,", pos)) != std::string::npos) {
+            size_t end = list.find_first_of(" \t,", pos);
+            triggerNames.insert(list.substr(pos, end - pos));
+            pos = end;
+        }
+    }
+
+    // Dumps start midway through the trace, so they can't use the index or
+    // refer to blobs written before.  Chunks are compressed on the merging
+    // thread, so that they reach the recorder in step with the events.
+    setIndexing(false);
+    setBlobDedup(false);
+    setFile(File::createSnappy());
+    m_file->setCompressionThreads(0);
 
-#if 0
-    // For debugging the exception handler
-    *((int *)0) = 0;
+    recorder = new FlightRecorder(size);
+    newDefinitions = &recorder->current->definitions;
+    if (!Writer::open(recorder)) {
+        os::log("apitrace: error: failed to start the flight recorder\n");
+        os::abort();
+    }
+    _flushStage();
+    m_file->flush();
+    recorder->start();
+
+    // Nobody reads the recorder as it is written
+    m_flushFrames = false;
+    m_trackFrames = false;
+
+#ifndef _WIN32
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = dumpSignalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &action, NULL);
 #endif
 }
 
-static uintptr_t next_thread_num = 1;
+/**
+ * Close the recorder's segment once it has a chunk worth of events, or dump
+ * it if the event just written asked for it.
+ */
+void
+LocalWriter::_recordEvent(void) {
+    if (triggered) {
+        std::string reason = std::string("call to ") + triggered->name;
+        triggered = NULL;
+        _dump(reason);
+    } else if (!recorder->current->data.empty()) {
+        _endSegment();
+    }
+}
 
-static OS_THREAD_SPECIFIC_PTR(void)
-thread_num;
-
-void LocalWriter::checkProcessId(void) {
-    if (m_file->isOpened() &&
-        os::getCurrentProcessId() != pid) {
-        // We are a forked child process that inherited the trace file, so
-        // create a new file.  We can't call any method of the current
-        // file, as it may cause it to flush and corrupt the parent's
-        // trace, so we effectively leak the old file object.
-        m_file = File::createSnappy();
-        // Don't want to open the same file again
-        os::unsetEnvironment("TRACE_FILE");
+void
+LocalWriter::_endSegment(void) {
+    _flushStage();
+    m_file->flush();
+    recorder->endSegment(call_no);
+    newDefinitions = &recorder->current->definitions;
+}
+
+/**
+ * Write the events kept by the flight recorder out to a trace of their own.
+ */
+void
+LocalWriter::_dump(const std::string &reason) {
+    _endSegment();
+
+    os::String fileName(dumpFileName.c_str());
+    if (numDumps) {
+        fileName.trimExtension();
+        fileName = os::String::format("%s.%u.trace", fileName.str(), numDumps);
+    }
+    ++numDumps;
+
+    Writer writer;
+    writer.setIndexing(false);
+    writer.setBlobDedup(false);
+    if (!dumpCodec.empty()) {
+        File *file = File::createForCodec(dumpCodec.c_str());
+        if (file) {
+            writer.setFile(file);
+        }
+    }
+
+    bool complete = recorder->numDropped == 0;
+    Properties properties = m_properties;
+    properties["flight_recorder"] = reason;
+    if (!complete) {
+        properties["replayable"] = "no";
+    }
+    writer.setProperties(properties);
+
+    if (!writer.open(fileName)) {
+        os::log("apitrace: error: failed to open %s\n", fileName.str());
+        return;
+    }
+
+    if (!complete) {
+        unsigned firstCall = recorder->segments.empty()
+                           ? call_no : recorder->segments.front()->firstCall;
+        _define(writer, recorder->dropped, firstCall);
+    }
+
+    File *file = File::createSnappy();
+    if (file->open(new FlightRecorder::Reader(*recorder), File::Read)) {
+        char buffer[64 * 1024];
+        size_t length;
+        while ((length = file->read(buffer, sizeof buffer)) != 0) {
+            writer.writeRaw(buffer, length);
+        }
+        file->close();
+    }
+    delete file;
+
+    writer.close();
+
+    os::log("apitrace: flight recorder dumped to %s, on %s\n",
+            fileName.str(), reason.c_str());
+}
+
+/**
+ * Define the given signatures and stacks upfront, for a trace which starts
+ * with the given call.  Frames come first, so that stacks can refer to them
+ * by id only, as readers which know them already skip them.
+ */
+void
+LocalWriter::_define(Writer &writer, const Definitions &definitions,
+                     unsigned nextCall) {
+    writer.beginDefine();
+    for (size_t i = 0; i < definitions.stacks.size(); ++i) {
+        const Stack *stack = definitions.stacks[i];
+        for (size_t j = 0; j < stack->frames.size(); ++j) {
+            writer.defineFrame(&stack->frames[j]);
+        }
+    }
+    for (size_t i = 0; i < definitions.functions.size(); ++i) {
+        writer.defineFunction(definitions.functions[i]);
+    }
+    for (size_t i = 0; i < definitions.structs.size(); ++i) {
+        writer.defineStruct(definitions.structs[i]);
+    }
+    for (size_t i = 0; i < definitions.enums.size(); ++i) {
+        writer.defineEnum(definitions.enums[i]);
+    }
+    for (size_t i = 0; i < definitions.bitmasks.size(); ++i) {
+        writer.defineBitmask(definitions.bitmasks[i]);
+    }
+    for (size_t i = 0; i < definitions.stacks.size(); ++i) {
+        const Stack *stack = definitions.stacks[i];
+        unsigned num_frames = stack->frames.size();
+        if (writer.defineStack(stack->id, num_frames)) {
+            for (unsigned j = 0; j < num_frames; ++j) {
+                writer.writeStackFrame(&stack->frames[j]);
+            }
+        }
+    }
+    writer.defineCallNo(nextCall);
+    writer.endDefine();
+}
+
+/**
+ * File name of a segment of the rotated trace, e.g. name.0001.trace.
+ */
+std::string
+LocalWriter::_segmentFileName(unsigned index) const {
+    os::String base(manifestFileName.c_str());
+    base.trimExtension();
+    os::String fileName = os::String::format("%s.%04u.trace", base.str(), index);
+    return fileName.str();
+}
+
+/**
+ * Rotate after the frame which takes the segment past the limits, or right
+ * away if there are no frames in sight.
+ */
+void
+LocalWriter::_checkRotate(void) {
+    bool frameEnded = m_numFrames != checkedFrames;
+    checkedFrames = m_numFrames;
+    if (frameEnded) {
+        if ((rotateFrames && m_numFrames >= rotateFrames) ||
+            (rotateSize && m_numBytes >= rotateSize)) {
+            _closeSegment();
+        }
+    } else if (rotateSize && m_numBytes >= 2 * rotateSize) {
+        _closeSegment();
+    }
+}
+
+/**
+ * Close the current segment.  The next one is only opened along with the
+ * next event, so that the trace doesn't end with an empty one.
+ */
+void
+LocalWriter::_closeSegment(void) {
+    ManifestSegment &last = manifest.segments.back();
+    last.endCall = call_no;
+    last.endFrame = last.firstFrame + m_numFrames;
+    Writer::close();
+    _writeManifest();
+    rotatePending = true;
+}
+
+/**
+ * Start the next segment, defining upfront all that was defined in the
+ * previous ones.
+ */
+void
+LocalWriter::_rotate(void) {
+    rotatePending = false;
+
+    unsigned nextCall = call_no;
+    ManifestSegment segment;
+    segment.filename = _segmentFileName(manifest.segments.size() + 1);
+    segment.firstCall = nextCall;
+    segment.firstFrame = manifest.segments.back().endFrame;
+
+    if (!Writer::open(segment.filename.c_str())) {
+        os::log("apitrace: error: failed to open %s\n", segment.filename.c_str());
+        os::abort();
+    }
+    m_trackFrames = true;
+    checkedFrames = 0;
+    _define(*this, *allDefinitions, nextCall);
+
+    manifest.segments.push_back(segment);
+    _writeManifest();
+}
+
+void
+LocalWriter::_writeManifest(void) {
+    if (!manifest.write(manifestFileName.c_str())) {
+        os::log("apitrace: warning: failed to write %s\n", manifestFileName.c_str());
+    }
+}
+
+/**
+ * Parse the calls to leave out, from the APITRACE_FILTER environment variable,
+ * or else from the file named by APITRACE_FILTER_FILE.
+ *
+ * The policy is a whitespace separated list of function names, of name
+ * prefixes ending in '*', and of "@no_side_effects" or "@verbose" for all the
+ * functions with those call flags.  Lines starting with '#' are comments.
+ * Frame-ending functions are never left out.
+ */
+void
+LocalWriter::_loadFilter(void) {
+    std::string policy;
+    const char *env = getenv("APITRACE_FILTER");
+    if (env) {
+        policy = env;
+    } else {
+        const char *filename = getenv("APITRACE_FILTER_FILE");
+        if (!filename) {
+            return;
+        }
+        FILE *fp = fopen(filename, "rt");
+        if (!fp) {
+            os::log("apitrace: warning: failed to open %s\n", filename);
+            return;
+        }
+        char line[1024];
+        while (fgets(line, sizeof line, fp)) {
+            if (line[0] != '#') {
+                policy += line;
+                policy += ' ';
+            }
+        }
+        fclose(fp);
+    }
+
+    callFilter.flags = 0;
+    size_t pos = 0;
+    while (true) {
+        pos = policy.find_first_not_of(" \t\r\n", pos);
+        if (pos == std::string::npos) {
+            break;
+        }
+        size_t end = policy.find_first_of(" \t\r\n", pos);
+        std::string token = policy.substr(pos, end - pos);
+        pos = end;
+
+        if (token == "@no_side_effects") {
+            callFilter.flags |= CALL_FLAG_NO_SIDE_EFFECTS;
+        } else if (token == "@verbose") {
+            callFilter.flags |= CALL_FLAG_VERBOSE;
+        } else if (token[token.size() - 1] == '*') {
+            callFilter.prefixes.push_back(token.substr(0, token.size() - 1));
+        } else {
+            callFilter.names.insert(token);
+        }
+
+        if (!callFilter.policy.empty()) {
+            callFilter.policy += ' ';
+        }
+        callFilter.policy += token;
+    }
+
+    if (callFilter.policy.empty()) {
+        return;
+    }
+
+    os::log("apitrace: leaving out %s\n", callFilter.policy.c_str());
+    filterDecisions = new unsigned char[MAX_FILTER_SIGS];
+    memset(filterDecisions, FILTER_UNKNOWN, MAX_FILTER_SIGS);
+}
+
+bool
+LocalWriter::_isFiltered(const FunctionSig *sig) {
+    bool filtered = false;
+    CallFlags flags = Parser::lookupCallFlags(sig->name);
+    if (!(flags & CALL_FLAG_END_FRAME)) {
+        if (flags & callFilter.flags) {
+            filtered = true;
+        } else if (callFilter.names.count(sig->name)) {
+            filtered = true;
+        } else {
+            for (size_t i = 0; i < callFilter.prefixes.size(); ++i) {
+                const std::string &prefix = callFilter.prefixes[i];
+                if (strncmp(sig->name, prefix.c_str(), prefix.size()) == 0) {
+                    filtered = true;
+                    break;
+                }
+            }
+        }
+    }
+    if (sig->id < MAX_FILTER_SIGS) {
+        filterDecisions[sig->id] = filtered ? FILTER_SKIP : FILTER_TRACE;
+    }
+    return filtered;
+}
+
+inline unsigned long long
+LocalWriter::_nanoseconds(long long time) const {
+    if (os::timeFrequency == 1000000000LL) {
+        return time;
+    }
+    // Avoid overflowing for long running applications
+    return (time / os::timeFrequency) * 1000000000LL +
+           (time % os::timeFrequency) * 1000000000LL / os::timeFrequency;
+}
+
+/**
+ * Open the trace on the first event.
+ */
+void
+LocalWriter::_open(void) {
+    os::unique_lock<os::mutex> lock(mutex);
+    if (!opened) {
         open();
+        os::memory_barrier();
+        opened = true;
+    }
+}
+
+LocalWriter::ThreadBuffer *
+LocalWriter::_newThreadBuffer(void) {
+    os::unique_lock<os::mutex> lock(wakeMutex);
+    ThreadBuffer *buffer = new ThreadBuffer(nextThreadId++);
+    threads.push_back(buffer);
+    os::memory_barrier();
+    numThreads = threads.size();
+    threadBuffer = buffer;
+    exitingThreadBuffer = buffer;
+    return buffer;
+}
+
+void
+LocalWriter::ThreadBuffer::threadExit(void *buffer) {
+    localWriter._retireThreadBuffer(static_cast<ThreadBuffer *>(buffer));
+}
+
+void
+LocalWriter::exitThread(void) {
+    ThreadBuffer *buffer = threadBuffer;
+    if (buffer) {
+        _retireThreadBuffer(buffer);
+    }
+}
+
+/**
+ * Hand the buffer of an exiting thread over to the merging thread to free.
+ */
+void
+LocalWriter::_retireThreadBuffer(ThreadBuffer *buffer) {
+    // Calls made by other TLS destructors get a new buffer
+    threadBuffer = NULL;
+    os::memory_barrier();
+    buffer->retired = true;
+}
+
+/**
+ * Free the buffers of the threads which exited, once drained.  Must be
+ * called with the mutex held.
+ */
+void
+LocalWriter::_freeThreadBuffers(void) {
+    bool drained = false;
+    for (size_t i = 0; i < mergeThreads.size(); ++i) {
+        if (mergeThreads[i]->isDrained()) {
+            drained = true;
+            break;
+        }
+    }
+    if (!drained) {
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(wakeMutex);
+    std::vector<ThreadBuffer *>::iterator it = threads.begin();
+    while (it != threads.end()) {
+        ThreadBuffer *buffer = *it;
+        if (buffer->isDrained()) {
+            if (buffer == lastThread) {
+                lastThread = NULL;
+            }
+            delete buffer;
+            it = threads.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    numThreads = threads.size();
+    mergeThreads = threads;
+}
+
+inline LocalWriter::ThreadBuffer *
+LocalWriter::_beginEvent(void) {
+    if (!opened) {
+        _open();
+    }
+
+    ThreadBuffer *buffer = threadBuffer;
+    if (!buffer) {
+        buffer = _newThreadBuffer();
+    }
+    if (buffer->pending > MAX_PENDING_SIZE) {
+        _waitForMerge(buffer);
+    }
+    return buffer;
+}
+
+/**
+ * Publish the event to the merging thread.
+ */
+inline void
+LocalWriter::_endEvent(ThreadBuffer *buffer) {
+    buffer->closeRaw();
+    os::memory_barrier();
+    buffer->committed = buffer->writePtr;
+    os::memory_barrier();
+
+    // Waking up the merging thread for every event would be costly, so let
+    // a block worth of events accumulate, as they would in the file cache
+    // anyway, unless someone is reading the trace as it is written.
+    if (mergerSleeping &&
+        (buffer->writeBlock != buffer->signaledBlock ||
+         buffer->waiting ||
+         m_flushFrames ||
+         dumpRequested)) {
+        buffer->signaledBlock = buffer->writeBlock;
+        os::unique_lock<os::mutex> lock(wakeMutex);
+        wakeCond.signal();
+    }
+}
+
+/**
+ * Wait for the merging thread to catch up with this thread.
+ */
+void
+LocalWriter::_waitForMerge(ThreadBuffer *buffer) {
+    buffer->waiting = true;
+    // Start a new block, so that all others can be freed
+    buffer->closeRaw();
+    buffer->nextBlock(0);
+    _endEvent(buffer);
+
+    os::unique_lock<os::mutex> lock(buffer->drainMutex);
+    while (buffer->pending > buffer->writeBlock->size) {
+        buffer->drained.wait(lock);
+    }
+    buffer->waiting = false;
+}
+
+/**
+ * Whether there is anything for the merging thread to do.  Committed
+ * events behind one still being written by another thread don't count,
+ * lest the merging thread spin on them.
+ */
+bool
+LocalWriter::_nextEventAvailable(void) {
+    if (numThreads != mergeThreads.size()) {
+        return true;
+    }
+    for (size_t i = 0; i < mergeThreads.size(); ++i) {
+        ThreadBuffer *buffer = mergeThreads[i];
+        if (buffer->peekEvent() == nextEvent ||
+            (buffer->waiting && buffer->canSkipBlockEnd())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Whether any committed events are left, which the thread writing the
+ * missing one may not wake us up for.
+ */
+bool
+LocalWriter::_hasCommittedEvents(void) {
+    for (size_t i = 0; i < mergeThreads.size(); ++i) {
+        if (mergeThreads[i]->hasCommitted()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+LocalWriter::ThreadBuffer *
+LocalWriter::_findNextEvent(void) {
+    // Threads often make several calls in a row
+    if (lastThread && lastThread->peekEvent() == nextEvent) {
+        return lastThread;
+    }
+    for (size_t i = 0; i < mergeThreads.size(); ++i) {
+        ThreadBuffer *buffer = mergeThreads[i];
+        if (buffer != lastThread && buffer->peekEvent() == nextEvent) {
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write the committed events to the file, in order, up to the first one
+ * which is still missing.  Must be called with the mutex held.
+ */
+bool
+LocalWriter::_mergeEvents(void) {
+    if (numThreads != mergeThreads.size()) {
+        os::unique_lock<os::mutex> lock(wakeMutex);
+        mergeThreads = threads;
+    }
+
+    bool merged = false;
+    ThreadBuffer *buffer;
+    while ((buffer = _findNextEvent()) != NULL) {
+        if (rotatePending) {
+            _rotate();
+        }
+        _replayEvent(buffer);
+        ++nextEvent;
+        lastThread = buffer;
+        merged = true;
+        if (recorder) {
+            _recordEvent();
+        } else if (allDefinitions) {
+            _checkRotate();
+        }
+    }
+
+    // Let threads waiting on us free their blocks
+    for (size_t i = 0; i < mergeThreads.size(); ++i) {
+        buffer = mergeThreads[i];
+        if (buffer->waiting && buffer->hasCommitted()) {
+            buffer->skipBlockEnd();
+        }
+    }
+
+    _freeThreadBuffers();
+
+    return merged;
+}
+
+void
+LocalWriter::_replayEvent(ThreadBuffer *buffer) {
+    for (;;) {
+        buffer->skipBlockEnd();
+        Op op = static_cast<Op>(*buffer->readPtr++);
+        switch (op) {
+        case OP_RAW:
+            {
+                uint32_t length = buffer->read<uint32_t>();
+                _write(buffer->readPtr, length);
+                buffer->readPtr += length;
+            }
+            break;
+        case OP_ENTER:
+            {
+                unsigned call = (unsigned)buffer->read<unsigned long long>();
+                const FunctionSig *sig = buffer->read<const FunctionSig *>();
+                if (newDefinitions && !isDefined(functions, sig->id)) {
+                    newDefinitions->functions.push_back(sig);
+                    if (recorder) {
+                        if (sig->id >= triggers.size()) {
+                            triggers.resize(sig->id + 1);
+                        }
+                        triggers[sig->id] = triggerNames.count(sig->name) != 0;
+                    }
+                }
+                if (recorder && triggers[sig->id]) {
+                    triggered = sig;
+                }
+                unsigned call_no = Writer::beginEnter(sig, buffer->threadId);
+                buffer->openCalls.push_back(std::make_pair(call, call_no));
+            }
+            break;
+        case OP_LEAVE:
+            {
+                buffer->read<unsigned long long>();
+                unsigned call = buffer->read<unsigned>();
+                unsigned call_no = call;
+                // Calls are left in reverse order, unless some never returned
+                size_t i = buffer->openCalls.size();
+                while (i--) {
+                    if (buffer->openCalls[i].first == call) {
+                        call_no = buffer->openCalls[i].second;
+                        buffer->openCalls.erase(buffer->openCalls.begin() + i);
+                        break;
+                    }
+                }
+                Writer::beginLeave(call_no);
+            }
+            break;
+        case OP_END_ENTER:
+            Writer::endEnter();
+            // Past the last event, the block end may not be written yet
+            if (buffer->hasCommitted()) {
+                buffer->skipBlockEnd();
+            }
+            return;
+        case OP_END_LEAVE:
+            Writer::endLeave();
+            if (buffer->hasCommitted()) {
+                buffer->skipBlockEnd();
+            }
+            return;
+        case OP_STRUCT:
+            {
+                const StructSig *sig = buffer->read<const StructSig *>();
+                if (newDefinitions && !isDefined(structs, sig->id)) {
+                    newDefinitions->structs.push_back(sig);
+                }
+                Writer::beginStruct(sig);
+            }
+            break;
+        case OP_ENUM:
+            {
+                const EnumSig *sig = buffer->read<const EnumSig *>();
+                if (newDefinitions && !isDefined(enums, sig->id)) {
+                    newDefinitions->enums.push_back(sig);
+                }
+                Writer::writeEnum(sig, buffer->read<signed long long>());
+            }
+            break;
+        case OP_BITMASK:
+            {
+                const BitmaskSig *sig = buffer->read<const BitmaskSig *>();
+                if (newDefinitions && !isDefined(bitmasks, sig->id)) {
+                    newDefinitions->bitmasks.push_back(sig);
+                }
+                Writer::writeBitmask(sig, buffer->read<unsigned long long>());
+            }
+            break;
+        case OP_STACK:
+            {
+                const Stack *stack = buffer->read<const Stack *>();
+                if (newDefinitions && !isDefined(Writer::stacks, stack->id)) {
+                    newDefinitions->stacks.push_back(stack);
+                }
+                unsigned num_frames = stack->frames.size();
+                if (Writer::beginStack(stack->id, num_frames)) {
+                    for (unsigned i = 0; i < num_frames; ++i) {
+                        Writer::writeStackFrame(&stack->frames[i]);
+                    }
+                }
+                Writer::endStack();
+            }
+            break;
+        case OP_BLOB:
+            {
+                unsigned long long digest = buffer->read<unsigned long long>();
+                size_t size = buffer->read<size_t>();
+                if (Writer::_beginBlob(size, digest)) {
+                    // Referred to a blob written before, so drop the bytes
+                    while (size) {
+                        buffer->skipBlockEnd();
+                        assert(*buffer->readPtr == OP_RAW);
+                        buffer->readPtr++;
+                        uint32_t length = buffer->read<uint32_t>();
+                        buffer->readPtr += length;
+                        size -= length;
+                    }
+                }
+            }
+            break;
+        default:
+            assert(0);
+            return;
+        }
+    }
+}
+
+void *
+LocalWriter::mergerThreadProc(LocalWriter *_this) {
+    merging = _this;
+
+    for (;;) {
+        _this->mutex.lock();
+        _this->_mergeEvents();
+        if (_this->recorder && dumpRequested) {
+            dumpRequested = 0;
+            _this->_dump("signal");
+        }
+
+        os::unique_lock<os::mutex> wakeLock(_this->wakeMutex);
+        _this->mergerSleeping = true;
+        os::memory_barrier();
+        bool available = _this->_nextEventAvailable();
+        bool stalled = !available && _this->_hasCommittedEvents();
+        _this->mutex.unlock();
+
+        if (_this->stopMerger) {
+            _this->mergerSleeping = false;
+            break;
+        }
+        if (stalled) {
+            _this->wakeCond.wait_for(wakeLock, MERGE_RETRY_MS);
+        } else if (!available) {
+            _this->wakeCond.wait(wakeLock);
+        }
+        _this->mergerSleeping = false;
+    }
+
+    return NULL;
+}
+
+void
+LocalWriter::_stopMerger(void) {
+    {
+        os::unique_lock<os::mutex> lock(wakeMutex);
+        stopMerger = true;
+        wakeCond.signal();
+    }
+    mergerThread.join();
+
+    // Write whatever was left
+    os::unique_lock<os::mutex> lock(mutex);
+    _mergeEvents();
+}
+
+/*
+ * Forked children inherit the trace file and the buffers, but not the
+ * merging thread, so they start over with a new trace.  The locks are held
+ * across the fork so that the child doesn't inherit them in an inconsistent
+ * state.
+ */
+
+void
+LocalWriter::_prepareFork(void) {
+    localWriter.mutex.lock();
+    localWriter.wakeMutex.lock();
+}
+
+void
+LocalWriter::_parentFork(void) {
+    localWriter.wakeMutex.unlock();
+    localWriter.mutex.unlock();
+}
+
+void
+LocalWriter::_childFork(void) {
+    LocalWriter &writer = localWriter;
+
+    writer.wakeMutex.unlock();
+    writer.mutex.unlock();
+
+    if (writer.opened) {
+        // We can't call any method of the current file, as it may cause it
+        // to flush and corrupt the parent's trace, so we effectively leak
+        // the old file object.
+        writer.m_file = File::createSnappy();
+        writer.recorder = NULL;
+        writer.newDefinitions = NULL;
+        // Don't want to open the same file again, but a shared memory
+        // area has a slot for each process
+        const char *lpFileName = getenv("TRACE_FILE");
+        if (!lpFileName || strncmp(lpFileName, "shm:", 4) != 0) {
+            os::unsetEnvironment("TRACE_FILE");
+        }
+        writer.mergerThread = os::thread();
+        writer.mergerSleeping = false;
+        writer.opened = false;
+    }
+
+    writer.nextPosition = 0;
+    writer.nextEvent = 0;
+    writer.lastThread = NULL;
+    for (size_t i = 0; i < writer.threads.size(); ++i) {
+        ThreadBuffer *buffer = writer.threads[i];
+        buffer->reset();
+        // Only the forking thread carries on in the child
+        if (buffer != threadBuffer) {
+            buffer->retired = true;
+        }
     }
 }
 
 unsigned LocalWriter::beginEnter(const FunctionSig *sig, bool fake) {
-    mutex.lock();
-    ++acquired;
+    ThreadBuffer *buffer = _beginEvent();
 
-    checkProcessId();
-    if (!m_file->isOpened()) {
-        open();
+    unsigned long long position = os::atomic_fetch_add(&nextPosition, 1ULL);
+
+    /*
+     * The call is only numbered when merged, so hand out a handle for
+     * beginLeave() instead, which is unique among the calls of this thread
+     * not left yet, unless one lasts for 2^32 events.
+     */
+    unsigned call = (unsigned)position;
+
+    char *ptr = buffer->reserveOp(1 + sizeof position + sizeof sig);
+    *ptr++ = OP_ENTER;
+    memcpy(ptr, &position, sizeof position);
+    ptr += sizeof position;
+    memcpy(ptr, &sig, sizeof sig);
+    buffer->writePtr = ptr + sizeof sig;
+    buffer->enteringCall = call;
+
+    if (!fake) {
+        // Only match the function name against APITRACE_BACKTRACE once
+        std::vector<unsigned char> &needed = buffer->backtraceNeeded;
+        if (sig->id >= needed.size()) {
+            needed.resize(sig->id + 1, BACKTRACE_UNKNOWN);
+        }
+        if (needed[sig->id] == BACKTRACE_UNKNOWN) {
+            needed[sig->id] = backtrace_is_needed(sig->name)
+                            ? BACKTRACE_NEEDED : BACKTRACE_NOT_NEEDED;
+        }
+        if (needed[sig->id] == BACKTRACE_NEEDED) {
+            const Stack *stack = NULL;
+            {
+                os::unique_lock<os::mutex> lock(backtraceMutex);
+                std::vector<RawStackFrame> backtrace = get_backtrace();
+                if (backtrace.size()) {
+                    stack = _internStack(backtrace);
+                }
+            }
+            if (stack) {
+                buffer->writeOp(OP_STACK, stack);
+            }
+        }
     }
+    return call;
+}
 
-    // Although thread_num is a void *, we actually use it as a uintptr_t
-    uintptr_t this_thread_num =
-        reinterpret_cast<uintptr_t>(static_cast<void *>(thread_num));
-    if (!this_thread_num) {
-        this_thread_num = next_thread_num++;
-        thread_num = reinterpret_cast<void *>(this_thread_num);
+/**
+ * Find the stack with the same frames as the given backtrace, or add it.
+ */
+const LocalWriter::Stack *
+LocalWriter::_internStack(const std::vector<RawStackFrame> &backtrace) {
+    std::vector<Id> ids(backtrace.size());
+    for (size_t i = 0; i < backtrace.size(); ++i) {
+        ids[i] = backtrace[i].id;
     }
 
-    assert(this_thread_num);
-    unsigned thread_id = this_thread_num - 1;
-    unsigned call_no = Writer::beginEnter(sig, thread_id);
-    if (!fake && backtrace_is_needed(sig->name)) {
-        std::vector<RawStackFrame> backtrace = get_backtrace();
-        beginBacktrace(backtrace.size());
-        for (unsigned i = 0; i < backtrace.size(); ++i) {
-            writeStackFrame(&backtrace[i]);
+    std::vector<Stack *> &bucket = stacks[hash64(&ids[0], ids.size() * sizeof ids[0])];
+    for (size_t i = 0; i < bucket.size(); ++i) {
+        const Stack *stack = bucket[i];
+        if (stack->frames.size() != ids.size()) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < ids.size() && stack->frames[j].id == ids[j]) {
+            ++j;
+        }
+        if (j == ids.size()) {
+            return stack;
         }
-        endBacktrace();
     }
-    return call_no;
+
+    Stack *stack = new Stack;
+    stack->id = numStacks++;
+    stack->frames = backtrace;
+    bucket.push_back(stack);
+    return stack;
 }
 
 void LocalWriter::endEnter(void) {
-    Writer::endEnter();
-    --acquired;
-    mutex.unlock();
+    ThreadBuffer *buffer = threadBuffer;
+    if (timing) {
+        // Right before the real call is made
+        long long now = os::getTime();
+        buffer->writeByte(trace::CALL_TIME);
+        buffer->writeUInt(_nanoseconds(now - timeBase));
+        buffer->enterTimes.push_back(std::make_pair(buffer->enteringCall, now));
+    }
+    buffer->writeOp(OP_END_ENTER);
+    _endEvent(buffer);
 }
 
 void LocalWriter::beginLeave(unsigned call) {
-    mutex.lock();
-    ++acquired;
-    Writer::beginLeave(call);
+    // Right after the real call returned
+    long long now = timing ? os::getTime() : 0;
+
+    ThreadBuffer *buffer = _beginEvent();
+
+    unsigned long long position = os::atomic_fetch_add(&nextPosition, 1ULL);
+
+    char *ptr = buffer->reserveOp(1 + sizeof position + sizeof call);
+    *ptr++ = OP_LEAVE;
+    memcpy(ptr, &position, sizeof position);
+    ptr += sizeof position;
+    memcpy(ptr, &call, sizeof call);
+    buffer->writePtr = ptr + sizeof call;
+
+    if (timing) {
+        // Calls are left in reverse order, unless some never returned
+        size_t i = buffer->enterTimes.size();
+        while (i--) {
+            if (buffer->enterTimes[i].first == call) {
+                buffer->writeByte(trace::CALL_TIME);
+                buffer->writeUInt(_nanoseconds(now - buffer->enterTimes[i].second));
+                buffer->enterTimes.resize(i);
+                break;
+            }
+        }
+    }
 }
 
 void LocalWriter::endLeave(void) {
-    Writer::endLeave();
-    --acquired;
-    mutex.unlock();
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeOp(OP_END_LEAVE);
+    _endEvent(buffer);
+}
+
+void LocalWriter::beginArg(unsigned index) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::CALL_ARG);
+    buffer->writeUInt(index);
+}
+
+void LocalWriter::beginReturn(void) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::CALL_RET);
+}
+
+void LocalWriter::beginArray(size_t length) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_ARRAY);
+    buffer->writeUInt(length);
+}
+
+void LocalWriter::beginStruct(const StructSig *sig) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeOp(OP_STRUCT, sig);
+}
+
+void LocalWriter::beginRepr(void) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_REPR);
+}
+
+void LocalWriter::writeBool(bool value) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(value ? trace::TYPE_TRUE : trace::TYPE_FALSE);
+}
+
+void LocalWriter::writeSInt(signed long long value) {
+    ThreadBuffer *buffer = threadBuffer;
+    if (value < 0) {
+        buffer->writeByte(trace::TYPE_SINT);
+        buffer->writeUInt(-value);
+    } else {
+        buffer->writeByte(trace::TYPE_UINT);
+        buffer->writeUInt(value);
+    }
+}
+
+void LocalWriter::writeUInt(unsigned long long value) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_UINT);
+    buffer->writeUInt(value);
+}
+
+void LocalWriter::writeFloat(float value) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_FLOAT);
+    buffer->writeBytes(&value, sizeof value);
+}
+
+void LocalWriter::writeDouble(double value) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_DOUBLE);
+    buffer->writeBytes(&value, sizeof value);
+}
+
+void LocalWriter::writeString(const char *str) {
+    if (!str) {
+        LocalWriter::writeNull();
+        return;
+    }
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_STRING);
+    buffer->writeString(str, strlen(str));
+}
+
+void LocalWriter::writeString(const char *str, size_t len) {
+    if (!str) {
+        LocalWriter::writeNull();
+        return;
+    }
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_STRING);
+    buffer->writeString(str, len);
+}
+
+void LocalWriter::writeWString(const wchar_t *str) {
+    if (!str) {
+        LocalWriter::writeNull();
+        return;
+    }
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_STRING);
+    buffer->writeString("<wide-string>", strlen("<wide-string>"));
+}
+
+void LocalWriter::writeBlob(const void *data, size_t size) {
+    if (!data) {
+        LocalWriter::writeNull();
+        return;
+    }
+    ThreadBuffer *buffer = threadBuffer;
+    if (m_blobDedup &&
+        size >= BLOB_DEDUP_MIN_SIZE &&
+        size <= BLOB_DEDUP_MAX_SIZE) {
+        // Hash here rather than in the merging thread, and leave whether
+        // to write the bytes to it, as only it knows what was written before
+        unsigned long long digest = hash64(data, size);
+        char *ptr = buffer->reserveOp(1 + sizeof digest + sizeof size);
+        *ptr++ = OP_BLOB;
+        memcpy(ptr, &digest, sizeof digest);
+        ptr += sizeof digest;
+        memcpy(ptr, &size, sizeof size);
+        buffer->writePtr = ptr + sizeof size;
+        buffer->writeBytes(data, size);
+        // The bytes must be raw operations of their own to be skippable
+        buffer->closeRaw();
+        return;
+    }
+    buffer->writeByte(trace::TYPE_BLOB);
+    buffer->writeUInt(size);
+    if (size) {
+        buffer->writeBytes(data, size);
+    }
+}
+
+void LocalWriter::writeEnum(const EnumSig *sig, signed long long value) {
+    ThreadBuffer *buffer = threadBuffer;
+    char *ptr = buffer->reserveOp(1 + sizeof sig + sizeof value);
+    *ptr++ = OP_ENUM;
+    memcpy(ptr, &sig, sizeof sig);
+    ptr += sizeof sig;
+    memcpy(ptr, &value, sizeof value);
+    buffer->writePtr = ptr + sizeof value;
+}
+
+void LocalWriter::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
+    ThreadBuffer *buffer = threadBuffer;
+    char *ptr = buffer->reserveOp(1 + sizeof sig + sizeof value);
+    *ptr++ = OP_BITMASK;
+    memcpy(ptr, &sig, sizeof sig);
+    ptr += sizeof sig;
+    memcpy(ptr, &value, sizeof value);
+    buffer->writePtr = ptr + sizeof value;
+}
+
+void LocalWriter::writeNull(void) {
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_NULL);
+}
+
+void LocalWriter::writePointer(unsigned long long addr) {
+    if (!addr) {
+        LocalWriter::writeNull();
+        return;
+    }
+    ThreadBuffer *buffer = threadBuffer;
+    buffer->writeByte(trace::TYPE_OPAQUE);
+    buffer->writeUInt(addr);
 }
 
 void LocalWriter::flush(void) {
     /*
-     * Do nothing if the mutex is already acquired (e.g., if a segfault happen
-     * while writing the file) as state could be inconsistent, therefore yield
-     * inconsistent trace files and/or repeated segfaults till infinity.
+     * Do nothing if the exception happened while writing the file (e.g., a
+     * segfault in the merging thread), as state could be inconsistent,
+     * therefore yield inconsistent trace files and/or repeated segfaults
+     * till infinity.
      */
 
-    mutex.lock();
-    if (acquired) {
+    if (merging) {
         os::log("apitrace: ignoring exception while tracing\n");
-    } else {
-        ++acquired;
-        if (m_file->isOpened()) {
-            if (os::getCurrentProcessId() != pid) {
-                os::log("apitrace: ignoring exception in child process\n");
-            } else {
-                os::log("apitrace: flushing trace due to an exception\n");
+        return;
+    }
+
+    os::unique_lock<os::mutex> lock(mutex);
+    if (opened) {
+        merging = this;
+        if (recorder) {
+            _mergeEvents();
+            _dump("crash");
+        } else {
+            os::log("apitrace: flushing trace due to an exception\n");
+            _mergeEvents();
+            if (!rotatePending) {
                 m_file->flush();
             }
         }
-        --acquired;
+        merging = NULL;
     }
-    mutex.unlock();
 }
 
 
@@ -232,4 +1981,3 @@ LocalWriter localWriter;
 
 
 } /* namespace trace */
-
@@ -33,8 +33,13 @@
 
 #include <stdint.h>
 
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
 #include "os_thread.hpp"
-#include "os_process.hpp"
+#include "trace_manifest.hpp"
 #include "trace_writer.hpp"
 
 
@@ -50,33 +55,178 @@ namespace trace {
      *
      * In particular:
      * - it creates a trace file based on the current process name
-     * - uses mutexes to allow tracing from multiple threades
+     * - allows tracing from multiple threads without locking: each thread
+     *   serializes its events into a buffer of its own, and a background
+     *   thread merges them into the trace file in the order they started
      * - flushes the output to ensure the last call is traced in event of
      *   abnormal termination
+     * - or else, as a flight recorder, keeps only the most recent part of the
+     *   trace in memory, and writes it out when asked to or on a crash
+     * - optionally splits the trace into segments of a given size or number
+     *   of frames, listed by a manifest
+     *
+     * Writer is inherited privately, for the merging thread to write the
+     * file with, as calling its methods from any other thread would bypass
+     * the buffers.
      */
-    class LocalWriter : public Writer {
+    class LocalWriter : private Writer {
+    public:
+        class ThreadBuffer;
+
     protected:
+        /**
+         * Number of events so far, so that a single atomic increment gives
+         * the position of each event in the trace.  Calls are only numbered
+         * as their events are merged, in that order.
+         */
+        volatile unsigned long long nextPosition;
+
         /**
          * This mutex guarantees that only one thread writes to the trace file
-         * at one given instance.
-         *
-         * We need a recursive mutex so that we dont't dead lock in the event
-         * of a segfault happens while the mutex is held.
-         *
-         * To prevent deadlocks, the call for the real function (the one being
-         * traced) should not be done with the mutex held. That is, it should
-         * be done outside the beginEnter/endEnter and beginLeave/endLeave
-         * pairs. Preferably between these two pairs.
-         */
-        os::recursive_mutex mutex;
-        int acquired;
+         * at one given instance, be it the merging thread or an exception
+         * handler flushing the trace.
+         */
+        os::mutex mutex;
+
+        /**
+         * Position of the next event to write to the file.
+         */
+        unsigned long long nextEvent;
 
         /**
-         * ID of the processed that opened the trace file.
+         * Protects the list of thread buffers, and the sleeping/waiting
+         * handshakes between the traced threads and the merging thread.
+         * Buffers are added by their threads, and removed by the merging
+         * thread once their threads exited and they were drained.
+         */
+        os::mutex wakeMutex;
+        os::condition_variable wakeCond;
+        std::vector<ThreadBuffer *> threads;
+        volatile size_t numThreads;
+        unsigned nextThreadId;
+        volatile bool mergerSleeping;
+        volatile bool stopMerger;
+
+        // Merging thread's copy of the thread list
+        std::vector<ThreadBuffer *> mergeThreads;
+        ThreadBuffer *lastThread;
+
+        os::thread mergerThread;
+        volatile bool opened;
+
+        // libbacktrace is not thread safe
+        os::mutex backtraceMutex;
+
+        /*
+         * Backtraces seen so far, by the hash of their frame ids, see
+         * CALL_STACK.  Protected by backtraceMutex, and kept until the writer
+         * is destroyed, as events refer to them until merged.
+         */
+        struct Stack;
+        typedef std::map<unsigned long long, std::vector<Stack *> > StackMap;
+        StackMap stacks;
+        unsigned numStacks;
+
+        const Stack *_internStack(const std::vector<RawStackFrame> &backtrace);
+
+        /*
+         * Calls to leave out, see APITRACE_FILTER.  Whether each function is
+         * left out is decided on its first call, and remembered by signature
+         * id; threads racing to decide store the same value.
+         */
+        struct CallFilter {
+            std::string policy;
+            std::set<std::string> names;
+            std::vector<std::string> prefixes;
+            CallFlags flags;
+        };
+        CallFilter callFilter;
+        // FILTER_UNKNOWN, FILTER_TRACE, or FILTER_SKIP by signature id, or
+        // NULL when not filtering
+        unsigned char *filterDecisions;
+
+        void _loadFilter(void);
+        bool _isFiltered(const FunctionSig *sig);
+
+        // Whether to record call times, and since when, in os::getTime()
+        // units
+        bool timing;
+        long long timeBase;
+
+        inline unsigned long long _nanoseconds(long long time) const;
+
+        /*
+         * Signatures and stacks defined so far, for traces which start
+         * midway to define upfront.  The merging thread notes them down in
+         * newDefinitions as they are defined, when not NULL.
+         */
+        struct Definitions;
+        Definitions *newDefinitions;
+
+        static void _define(Writer &writer, const Definitions &definitions,
+                            unsigned nextCall);
+
+        /*
+         * Flight recorder, see APITRACE_FLIGHT_RECORDER.  The file writes
+         * to it instead of to disk, and it is only used by the merging
+         * thread, or with the mutex held.
+         */
+        class FlightRecorder;
+        FlightRecorder *recorder;
+        std::string dumpFileName;
+        std::string dumpCodec;
+        unsigned numDumps;
+        // Functions whose calls trigger a dump, by signature id
+        std::set<std::string> triggerNames;
+        std::vector<bool> triggers;
+        const FunctionSig *triggered;
+
+        void _openRecorder(size_t size);
+        void _recordEvent(void);
+        void _endSegment(void);
+        void _dump(const std::string &reason);
+
+        /*
+         * Rotation, see APITRACE_ROTATE_SIZE and APITRACE_ROTATE_FRAMES.
+         * Only used by the merging thread, or with the mutex held.
          */
-        os::ProcessId pid;
+        unsigned long long rotateSize;
+        unsigned rotateFrames;
+        std::string manifestFileName;
+        Manifest manifest;
+        Definitions *allDefinitions;
+        unsigned checkedFrames;
+        // Whether the current segment was closed, and the next one is to be
+        // opened with the next event
+        bool rotatePending;
+
+        std::string _segmentFileName(unsigned index) const;
+        void _checkRotate(void);
+        void _closeSegment(void);
+        void _rotate(void);
+        void _writeManifest(void);
+
+        void _open(void);
+        ThreadBuffer *_newThreadBuffer(void);
+        void _retireThreadBuffer(ThreadBuffer *buffer);
+        void _freeThreadBuffers(void);
+        ThreadBuffer *_beginEvent(void);
+        void _endEvent(ThreadBuffer *buffer);
+        void _waitForMerge(ThreadBuffer *buffer);
+
+        bool _nextEventAvailable(void);
+        bool _hasCommittedEvents(void);
+        ThreadBuffer *_findNextEvent(void);
+        bool _mergeEvents(void);
+        void _replayEvent(ThreadBuffer *buffer);
+        static void *mergerThreadProc(LocalWriter *_this);
+        void _stopMerger(void);
 
-        void checkProcessId();
+        static void _prepareFork(void);
+        static void _parentFork(void);
+        static void _childFork(void);
+
+        friend class ThreadBuffer;
 
     public:
         /**
@@ -89,25 +239,92 @@ namespace trace {
         void open(void);
 
         /**
-         * It will acquire the mutex.
+         * Retires the calling thread's buffer, as it is about to exit.  Only
+         * needed on Windows, from DllMain, where TLS has no destructors.
+         */
+        void exitThread(void);
+
+        enum {
+            FILTER_UNKNOWN = 0,
+            FILTER_TRACE,
+            FILTER_SKIP,
+            MAX_FILTER_SIGS = 65536
+        };
+
+        /**
+         * Whether calls to the given function are to be left out of the
+         * trace, to be checked before serializing anything.
+         */
+        inline bool isFiltered(const FunctionSig *sig) {
+            if (!filterDecisions) {
+                return false;
+            }
+            if (sig->id < MAX_FILTER_SIGS && filterDecisions[sig->id]) {
+                return filterDecisions[sig->id] == FILTER_SKIP;
+            }
+            return _isFiltered(sig);
+        }
+
+        /**
+         * Starts an event in the calling thread's buffer.
          */
         unsigned beginEnter(const FunctionSig *sig, bool fake = false);
 
         /**
-         * It will release the mutex.
+         * Hands the event over to the merging thread.
          */
         void endEnter(void);
 
         /**
-         * It will acquire the mutex.
+         * Starts an event in the calling thread's buffer.
          */
         void beginLeave(unsigned call);
 
         /**
-         * It will release the mutex.
+         * Hands the event over to the merging thread.
          */
         void endLeave(void);
 
+        /*
+         * These shadow the Writer methods, to serialize into the calling
+         * thread's buffer instead of the file.
+         */
+
+        void beginArg(unsigned index);
+        inline void endArg(void) {}
+
+        void beginReturn(void);
+        inline void endReturn(void) {}
+
+        void beginArray(size_t length);
+        inline void endArray(void) {}
+
+        inline void beginElement(void) {}
+        inline void endElement(void) {}
+
+        void beginStruct(const StructSig *sig);
+        inline void endStruct(void) {}
+
+        void beginRepr(void);
+        inline void endRepr(void) {}
+
+        void writeBool(bool value);
+        void writeSInt(signed long long value);
+        void writeUInt(unsigned long long value);
+        void writeFloat(float value);
+        void writeDouble(double value);
+        void writeString(const char *str);
+        void writeString(const char *str, size_t size);
+        void writeWString(const wchar_t *str);
+        void writeBlob(const void *data, size_t size);
+        void writeEnum(const EnumSig *sig, signed long long value);
+        void writeBitmask(const BitmaskSig *sig, unsigned long long value);
+        void writeNull(void);
+        void writePointer(unsigned long long addr);
+
+        /**
+         * Writes all the complete events to the file and flushes it.
+         */
         void flush(void);
     };
 
@@ -116,6 +116,7 @@ public:
             }
             writer.endBacktrace();
         }
+        call->decodeArgs();
         for (unsigned i = 0; i < call->args.size(); ++i) {
             if (call->args[i].value) {
                 writer.beginArg(i);
@@ -123,8 +124,18 @@ public:
                 writer.endArg();
             }
         }
+        if (call->timed) {
+            writer.writeTime(call->enter_time);
+        }
         writer.endEnter();
+        if (call->flags & CALL_FLAG_INCOMPLETE) {
+            // Never left when traced
+            return;
+        }
         writer.beginLeave(call_no);
+        if (call->timed) {
+            writer.writeTime(call->duration);
+        }
         if (call->ret) {
             writer.beginReturn();
             _visit(call->ret);
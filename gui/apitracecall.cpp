@@ -669,6 +669,7 @@ ApiTraceCall::ApiTraceCall(ApiTraceFrame *parentFrame,
         call->ret->visit(retVisitor);
         m_returnValue = retVisitor.variant();
     }
+    call->decodeArgs();
     m_argValues.reserve(call->args.size());
     for (int i = 0; i < call->args.size(); ++i) {
         if (call->args[i].value) {
@@ -704,6 +705,8 @@ ApiTraceCall::ApiTraceCall(ApiTraceFrame *parentFrame,
             else {
                 if (frame->offset >= 0) {
                     qbacktrace += QString("[0x%1]").arg(frame->offset, 0, 16);
+                } else if (frame->address >= 0) {
+                    qbacktrace += QString("[0x%1]").arg(frame->address, 0, 16);
                 }
             }
             qbacktrace += "\n";
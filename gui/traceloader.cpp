@@ -114,6 +114,33 @@ void TraceLoader::scanTrace()
     int numOfCalls = 0;
     int lastPercentReport = 0;
 
+    // Frames are readily available from the index, if the trace has one.
+    if (m_parser.loadIndex()) {
+        const trace::FrameIndex &frameIndex = m_parser.getFrameIndex();
+        for (trace::FrameIndex::const_iterator it = frameIndex.begin();
+             it != frameIndex.end(); ++it) {
+            FrameBookmark frameBookmark(it->start);
+            frameBookmark.numberOfCalls = it->numberOfCalls;
+
+            currentFrame = new ApiTraceFrame();
+            currentFrame->number = numOfFrames;
+            currentFrame->setNumChildren(it->numberOfCalls);
+            if (it->complete) {
+                currentFrame->setLastCallIndex(it->lastCallNo);
+            }
+            frames.append(currentFrame);
+
+            m_createdFrames.append(currentFrame);
+            m_frameBookmarks[numOfFrames] = frameBookmark;
+            ++numOfFrames;
+        }
+
+        emit parsed(100);
+
+        emit framesLoaded(frames);
+        return;
+    }
+
     m_parser.getBookmark(startBookmark);
 
     while ((call = m_parser.scan_call())) {
@@ -796,11 +796,22 @@ int main(int argc, char **argv)
 
     os::setExceptionCallback(exceptionCallback);
 
+    // Calls are deleted soon after being retraced, and blobs which must
+    // outlive them get bound, so blobs needn't be copied out of the trace.
+    retrace::parser.setZeroCopyBlobs(true);
+
     for (i = optind; i < argc; ++i) {
         if (!retrace::parser.open(argv[i])) {
             return 1;
         }
 
+        const trace::Properties &properties = retrace::parser.getProperties();
+        trace::Properties::const_iterator replayable = properties.find("replayable");
+        if (replayable != properties.end() && replayable->second == "no") {
+            std::cerr << "warning: " << argv[i] << " lacks the calls made before it starts, "
+                         "so it's unlikely to replay\n";
+        }
+
         retrace::mainLoop();
 
         retrace::parser.close();
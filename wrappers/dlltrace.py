@@ -63,6 +63,19 @@ class DllDispatcher(Dispatcher):
         return '_get%sProcAddress' % (module.name.upper())
 
 
+def emitDllMain():
+    # Windows TLS has no destructors, so the thread buffers of the trace
+    # writer must be retired as threads detach.
+    print r'EXTERN_C BOOL WINAPI'
+    print r'DllMain(HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved) {'
+    print r'    if (fdwReason == DLL_THREAD_DETACH) {'
+    print r'        trace::localWriter.exitThread();'
+    print r'    }'
+    print r'    return TRUE;'
+    print r'}'
+    print r''
+
+
 class DllTracer(Tracer):
 
     def header(self, api):
@@ -72,3 +85,8 @@ class DllTracer(Tracer):
             dispatcher.dispatchModule(module)
 
         Tracer.header(self, api)
+
+    def footer(self, api):
+        Tracer.footer(self, api)
+
+        emitDllMain()
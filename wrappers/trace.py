@@ -489,28 +489,41 @@ class Tracer:
 
     def traceFunctionImplBody(self, function):
         if not function.internal:
-            print '    unsigned _call = trace::localWriter.beginEnter(&_%s_sig);' % (function.name,)
+            # Calls left out by the capture policy are still unwrapped and
+            # wrapped, but not serialized
+            print '    bool _filtered = trace::localWriter.isFiltered(&_%s_sig);' % (function.name,)
+            print '    unsigned _call = _filtered ? 0 : trace::localWriter.beginEnter(&_%s_sig);' % (function.name,)
             for arg in function.args:
                 if not arg.output:
                     self.unwrapArg(function, arg)
+            print '    if (!_filtered) {'
             for arg in function.args:
                 if not arg.output:
                     self.serializeArg(function, arg)
             print '    trace::localWriter.endEnter();'
+            print '    }'
         self.invokeFunction(function)
         if not function.internal:
+            print '    if (!_filtered) {'
             print '    trace::localWriter.beginLeave(_call);'
+            print '    }'
             print '    if (%s) {' % self.wasFunctionSuccessful(function)
             for arg in function.args:
                 if arg.output:
+                    print '    if (!_filtered) {'
                     self.serializeArg(function, arg)
+                    print '    }'
                     self.wrapArg(function, arg)
             print '    }'
             if function.type is not stdapi.Void:
+                print '    if (!_filtered) {'
                 self.serializeRet(function, "_result")
+                print '    }'
             if function.type is not stdapi.Void:
                 self.wrapRet(function, "_result")
+            print '    if (!_filtered) {'
             print '    trace::localWriter.endLeave();'
+            print '    }'
 
     def invokeFunction(self, function, prefix='_', suffix=''):
         if function.type is stdapi.Void:
@@ -690,31 +703,42 @@ class Tracer:
 
         print '    %s *_this = static_cast<%s *>(m_pInstance);' % (base, base)
 
-        print '    unsigned _call = trace::localWriter.beginEnter(&_sig);'
+        print '    bool _filtered = trace::localWriter.isFiltered(&_sig);'
+        print '    unsigned _call = _filtered ? 0 : trace::localWriter.beginEnter(&_sig);'
+        print '    if (!_filtered) {'
         print '    trace::localWriter.beginArg(0);'
         print '    trace::localWriter.writePointer((uintptr_t)m_pInstance);'
         print '    trace::localWriter.endArg();'
+        print '    }'
         for arg in method.args:
             if not arg.output:
                 self.unwrapArg(method, arg)
+        print '    if (!_filtered) {'
         for arg in method.args:
             if not arg.output:
                 self.serializeArg(method, arg)
         print '    trace::localWriter.endEnter();'
+        print '    }'
         
         self.invokeMethod(interface, base, method)
 
+        print '    if (!_filtered) {'
         print '    trace::localWriter.beginLeave(_call);'
+        print '    }'
 
         print '    if (%s) {' % self.wasFunctionSuccessful(method)
         for arg in method.args:
             if arg.output:
+                print '    if (!_filtered) {'
                 self.serializeArg(method, arg)
+                print '    }'
                 self.wrapArg(method, arg)
         print '    }'
 
         if method.type is not stdapi.Void:
+            print '    if (!_filtered) {'
             self.serializeRet(method, '_result')
+            print '    }'
         if method.type is not stdapi.Void:
             self.wrapRet(method, '_result')
 
@@ -724,7 +748,9 @@ class Tracer:
             print r'        delete this;'
             print r'    }'
         
+        print '    if (!_filtered) {'
         print '    trace::localWriter.endLeave();'
+        print '    }'
 
     def implementIidWrapper(self, api):
         print r'static void'
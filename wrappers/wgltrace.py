@@ -28,6 +28,7 @@
 
 
 from gltrace import GlTracer
+from dlltrace import emitDllMain
 from specs.stdapi import Module, API
 from specs.glapi import glapi
 from specs.wglapi import wglapi
@@ -78,6 +79,11 @@ class WglTracer(GlTracer):
             print '            gltrace::clearContext();'
             print '    }'
 
+    def footer(self, api):
+        GlTracer.footer(self, api)
+
+        emitDllMain()
+
 
 if __name__ == '__main__':
     print